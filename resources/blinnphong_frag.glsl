@@ -1,16 +1,22 @@
-#version 120
+#version 140
 
-uniform vec3 lightPos1;
-uniform vec3 lightColor1;
-uniform vec3 lightPos2;
-uniform vec3 lightColor2;
-uniform vec3 ka; // ambient color
-uniform vec3 kd; // diffuse color
-uniform vec3 ks; // specular color
-uniform float s; // shininess
+// Number of lights to shade with, at most the length of the Frame arrays
+#ifndef LIGHT_COUNT
+#define LIGHT_COUNT 2
+#endif
 
-varying vec3 vertexPositionCameraSpace;
-varying vec3 vertexNormalCameraSpace;
+#include "frame.glsl"
+
+in vec3 vertexPositionCameraSpace;
+in vec3 vertexNormalCameraSpace;
+
+// Material, passed through from the vertex shader
+in vec3 vKa; // ambient color
+in vec3 vKd; // diffuse color
+in vec3 vKs; // specular color
+in float vS; // shininess
+
+out vec4 fragColor;
 
 vec3 applyLight(vec3 lightPos, vec3 lightColor, vec3 vertexPos, vec3 normal, vec3 kd, vec3 ks, float shininess) {
     // Compute light vector (direction from fragment to light source)
@@ -31,22 +37,20 @@ vec3 applyLight(vec3 lightPos, vec3 lightColor, vec3 vertexPos, vec3 normal, vec
     vec3 specular = ks * specularIntensity;
     
     // Multiply each component by the light's color
-    return (ka + diffuse + specular) * lightColor;
+    return (vKa + diffuse + specular) * lightColor;
 }
 
 void main() {
     // Compute normalized normal vector
     vec3 n = normalize(vertexNormalCameraSpace);
 
-    // Apply first light
-    vec3 color1 = applyLight(lightPos1, lightColor1, vertexPositionCameraSpace, n, kd, ks, s);
-
-    // Apply second light
-    vec3 color2 = applyLight(lightPos2, lightColor2, vertexPositionCameraSpace, n, kd, ks, s);
-
-    // Sum up the light contributions
-    vec3 finalColor = color1 + color2;
+    // Sum up the light contributions. The count is a constant, so the
+    // compiler unrolls the loop.
+    vec3 finalColor = vec3(0.0);
+    for(int i = 0; i < LIGHT_COUNT; ++i) {
+        finalColor += applyLight(lightPos[i].xyz, lightColor[i].rgb, vertexPositionCameraSpace, n, vKd, vKs, vS);
+    }
     
     // Set the final color output
-    gl_FragColor = vec4(finalColor, 1.0);
+    fragColor = vec4(finalColor, 1.0);
 }
@@ -1,22 +1,40 @@
-#version 120
+#version 140
 
-uniform mat4 P;
-uniform mat4 MV;
+#include "frame.glsl"
+#include "transform.glsl"
+#include "material.glsl"
 
-attribute vec4 aPos; // in object space
-attribute vec3 aNor; // in object space
+in vec4 aPos; // in object space
+in vec3 aNor; // in object space
 
-varying vec3 vertexPositionCameraSpace;
-varying vec3 vertexNormalCameraSpace;
+out vec3 vertexPositionCameraSpace;
+out vec3 vertexNormalCameraSpace;
+out vec3 vKa;
+out vec3 vKd;
+out vec3 vKs;
+out float vS;
+
+#include "decode.glsl"
 
 void main()
 {
-    gl_Position = P * MV * aPos;
+    mat4 modelView = getModelView();
+    vec4 pos = decodePosition();
+    gl_Position = P * modelView * pos;
     
-    // Transform vertex position and normal to camera space
-    vec4 vertexPositionWorldSpace = MV * aPos;
+    // Transform vertex position and normal to camera space. This assumes
+    // the model-view matrix has a uniform scale.
+    vec4 vertexPositionWorldSpace = modelView * pos;
     vertexPositionCameraSpace = vertexPositionWorldSpace.xyz;
     
-    vec4 vertexNormalWorldSpace = MV * vec4(aNor, 0.0);
+    vec4 vertexNormalWorldSpace = modelView * vec4(decodeNormal(), 0.0);
     vertexNormalCameraSpace = normalize(vertexNormalWorldSpace.xyz);
+    
+    // The fragment shader takes the material from here, so that the
+    // instanced variant can pick one per instance
+    MaterialData m = getMaterial();
+    vKa = m.ka;
+    vKd = m.kd;
+    vKs = m.ks;
+    vS = m.s;
 }
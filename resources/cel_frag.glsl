@@ -1,57 +1,71 @@
-#version 120
+#version 140
 
-// Lighting properties
-uniform vec3 lightPos; // Position of the light source
-uniform vec3 lightColor; // Color of the light source
+// Number of lights to shade with, at most the length of the Frame arrays
+#ifndef LIGHT_COUNT
+#define LIGHT_COUNT 1
+#endif
+// Number of levels each color component is quantized to
+#ifndef CEL_LEVELS
+#define CEL_LEVELS 5
+#endif
 
-// Material properties
-uniform vec3 ka; // Ambient reflectivity
-uniform vec3 kd; // Diffuse reflectivity
-uniform vec3 ks; // Specular reflectivity
-uniform float s; // Shininess
+#include "frame.glsl"
 
-varying vec3 vPos; // Position in view space from vertex shader
-varying vec3 vNor; // Normal in view space from vertex shader
+in vec3 vPos; // Position in view space from vertex shader
+in vec3 vNor; // Normal in view space from vertex shader
+
+// Material properties from the vertex shader
+in vec3 vKa; // Ambient reflectivity
+in vec3 vKd; // Diffuse reflectivity
+in vec3 vKs; // Specular reflectivity
+in float vS; // Shininess
+
+out vec4 fragColor;
 
 // Function to quantize a color component based on the number of levels
 float quantize(float value, int levels) {
     return floor(value * float(levels)) / float(levels - 1);
 }
 
+#ifdef SILHOUETTE
+#include "rim.glsl"
+#endif
+
 void main() {
-    vec3 N = normalize(vNor); // Normalized normal vector
-    vec3 eyeVector = normalize(-vPos); // Direction from fragment to camera in view space
-    float intensity = abs(dot(N, eyeVector)); // Dot product for silhouette effect
-    
+#ifdef SILHOUETTE
     // Check for silhouette
-    if(intensity < 0.3) {
-        gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0); // Black silhouette
+    if(onSilhouette(vPos, vNor)) {
+        fragColor = vec4(0.0, 0.0, 0.0, 1.0); // Black silhouette
         return;
     }
+#endif
     
-    // Lighting calculations for non-silhouette areas
-    vec3 L = normalize(lightPos - vPos); // Direction from surface point to light
-    vec3 V = eyeVector; // Already calculated
-    vec3 R = reflect(-L, N); // Reflected light vector
+    vec3 N = normalize(vNor); // Normalized normal vector
+    vec3 V = normalize(-vPos); // Direction from fragment to camera in view space
+    vec3 color = vec3(0.0);
+    for(int i = 0; i < LIGHT_COUNT; ++i) {
+        vec3 L = normalize(lightPos[i].xyz - vPos); // Direction from surface point to light
+        vec3 R = reflect(-L, N); // Reflected light vector
 
-    // Ambient component
-    vec3 ambient = ka * lightColor;
+        // Ambient component
+        vec3 ambient = vKa * lightColor[i].rgb;
 
-    // Diffuse component
-    float diff = max(dot(N, L), 0.0);
-    vec3 diffuse = kd * diff * lightColor;
+        // Diffuse component
+        float diff = max(dot(N, L), 0.0);
+        vec3 diffuse = vKd * diff * lightColor[i].rgb;
 
-    // Specular component
-    float spec = pow(max(dot(V, R), 0.0), s);
-    vec3 specular = ks * spec * lightColor;
+        // Specular component
+        float spec = pow(max(dot(V, R), 0.0), vS);
+        vec3 specular = vKs * spec * lightColor[i].rgb;
 
-    // Combine components
-    vec3 color = ambient + diffuse + specular;
+        // Combine components
+        color += ambient + diffuse + specular;
+    }
 
     // Apply quantization to each color component
-    color.r = quantize(color.r, 5);
-    color.g = quantize(color.g, 5);
-    color.b = quantize(color.b, 5);
+    color.r = quantize(color.r, CEL_LEVELS);
+    color.g = quantize(color.g, CEL_LEVELS);
+    color.b = quantize(color.b, CEL_LEVELS);
 
-    gl_FragColor = vec4(color, 1.0);
+    fragColor = vec4(color, 1.0);
 }
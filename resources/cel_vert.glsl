@@ -1,23 +1,36 @@
-#version 120
+#version 140
 
-uniform mat4 P; // Projection matrix
-uniform mat4 MV; // Model-view matrix
-uniform mat3 N; // Normal matrix for transforming normals
+#include "frame.glsl"
+#include "transform.glsl"
+#include "material.glsl"
 
-attribute vec4 aPos; // Vertex position in object space
-attribute vec3 aNor; // Vertex normal in object space
+in vec4 aPos; // Vertex position in object space
+in vec3 aNor; // Vertex normal in object space
 
-varying vec3 vPos; // Position in view space for fragment shader
-varying vec3 vNor; // Normal in view space for fragment shader
+out vec3 vPos; // Position in view space for fragment shader
+out vec3 vNor; // Normal in view space for fragment shader
+out vec3 vKa; // Material for the fragment shader
+out vec3 vKd;
+out vec3 vKs;
+out float vS;
+
+#include "decode.glsl"
 
 void main() {
     // Transform vertex position to view space
-    vec4 viewPos = MV * aPos;
+    vec4 viewPos = getModelView() * decodePosition();
     vPos = viewPos.xyz;
 
     // Transform normal to view space and normalize
-    vNor = normalize(N * aNor);
+    vNor = normalize(getNormalMatrix() * decodeNormal());
 
     // Project vertex to clip space
     gl_Position = P * viewPos;
+
+    // Pass the material through
+    MaterialData m = getMaterial();
+    vKa = m.ka;
+    vKd = m.kd;
+    vKs = m.ks;
+    vS = m.s;
 }
@@ -0,0 +1,36 @@
+// Vertex decoding, see Shape::setCompressed(). With OCT_NORMALS, aNor.xy
+// holds an octahedral-encoded normal.
+#ifdef INSTANCED
+// Per instance, so that arena draws of different shapes can be submitted
+// together (see GeometryArena)
+in vec3 iPosScale;
+in vec3 iPosOffset;
+#define posScale iPosScale
+#define posOffset iPosOffset
+#else
+uniform vec3 posScale; // object-space position = aPos.xyz * posScale + posOffset
+uniform vec3 posOffset;
+#endif
+
+vec4 decodePosition()
+{
+    return vec4(aPos.xyz * posScale + posOffset, 1.0);
+}
+
+#ifdef OCT_NORMALS
+vec3 decodeNormal()
+{
+    vec2 e = aNor.xy;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(n.z < 0.0) {
+        vec2 s = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        n.xy = (1.0 - abs(n.yx)) * s;
+    }
+    return normalize(n);
+}
+#else
+vec3 decodeNormal()
+{
+    return aNor;
+}
+#endif
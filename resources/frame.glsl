@@ -0,0 +1,7 @@
+// Camera and lights, set once per frame (see UniformBlocks)
+layout(std140) uniform Frame {
+    mat4 P; // projection matrix
+    mat4 V; // view matrix
+    vec4 lightPos[2]; // in camera space
+    vec4 lightColor[2];
+};
@@ -0,0 +1,29 @@
+// Material of the object being drawn: the one bound to the Material block,
+// or with INSTANCED the one from the MaterialTable that iMaterial selects
+struct MaterialData {
+    vec3 ka; // ambient color
+    vec3 kd; // diffuse color
+    vec3 ks; // specular color
+    float s; // shininess
+};
+
+#ifdef INSTANCED
+layout(std140) uniform MaterialTable {
+    MaterialData materials[8];
+};
+in float iMaterial; // per instance
+
+MaterialData getMaterial()
+{
+    return materials[int(iMaterial + 0.5)];
+}
+#else
+layout(std140) uniform Material {
+    MaterialData material;
+};
+
+MaterialData getMaterial()
+{
+    return material;
+}
+#endif
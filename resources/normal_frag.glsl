@@ -1,8 +1,10 @@
-#version 120
+#version 140
 
-varying vec3 color; // passed from the vertex shader
+in vec3 color; // passed from the vertex shader
+
+out vec4 fragColor;
 
 void main()
 {
-	gl_FragColor = vec4(color.r, color.g, color.b, 1.0);
+	fragColor = vec4(color.r, color.g, color.b, 1.0);
 }
@@ -1,15 +1,17 @@
-#version 120
+#version 140
 
-uniform mat4 P;
-uniform mat4 MV;
+#include "frame.glsl"
+#include "transform.glsl"
 
-attribute vec4 aPos; // in object space
-attribute vec3 aNor; // in object space
+in vec4 aPos; // in object space
+in vec3 aNor; // in object space
 
-varying vec3 color; // Pass to fragment shader
+out vec3 color; // Pass to fragment shader
+
+#include "decode.glsl"
 
 void main()
 {
-	gl_Position = P * (MV * aPos);
-	color = normalize(0.5 * aNor + vec3(0.5, 0.5, 0.5));
+	gl_Position = P * (getModelView() * decodePosition());
+	color = normalize(0.5 * decodeNormal() + vec3(0.5, 0.5, 0.5));
 }
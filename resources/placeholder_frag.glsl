@@ -0,0 +1,8 @@
+#version 140
+
+out vec4 fragColor;
+
+void main()
+{
+	fragColor = vec4(0.6, 0.6, 0.6, 1.0);
+}
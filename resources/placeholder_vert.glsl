@@ -0,0 +1,24 @@
+#version 140
+
+// Stands in for a program that is still compiling, so it is kept small
+
+#include "frame.glsl"
+#include "transform.glsl"
+
+in vec4 aPos; // in object space
+
+// Vertex decoding, see Shape::setCompressed()
+#ifdef INSTANCED
+in vec3 iPosScale; // per instance
+in vec3 iPosOffset;
+#define posScale iPosScale
+#define posOffset iPosOffset
+#else
+uniform vec3 posScale; // object-space position = aPos.xyz * posScale + posOffset
+uniform vec3 posOffset;
+#endif
+
+void main()
+{
+	gl_Position = P * (getModelView() * vec4(aPos.xyz * posScale + posOffset, 1.0));
+}
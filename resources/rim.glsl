@@ -0,0 +1,11 @@
+// Whether a fragment at pos with normal nor (in view space) lies on the
+// silhouette, where the surface turns away from the eye
+#ifndef RIM_THRESHOLD
+#define RIM_THRESHOLD 0.3
+#endif
+
+bool onSilhouette(vec3 pos, vec3 nor)
+{
+    vec3 eyeVector = normalize(-pos); // Direction from fragment to camera in view space
+    return abs(dot(normalize(nor), eyeVector)) < RIM_THRESHOLD;
+}
@@ -0,0 +1,37 @@
+// Transforms of the object being drawn: from the Object block, or with
+// INSTANCED from the iModel attribute (see Shape::drawInstanced()).
+// Include frame.glsl first.
+#ifdef INSTANCED
+in mat4 iModel; // per instance, applied before the view matrix
+
+mat4 getModelView()
+{
+    return V * iModel;
+}
+
+// Inverse transpose of the upper 3x3 of the model-view matrix, up to a scale
+// factor (the cofactor matrix)
+mat3 getNormalMatrix()
+{
+    mat4 M = getModelView();
+    vec3 a = M[0].xyz;
+    vec3 b = M[1].xyz;
+    vec3 c = M[2].xyz;
+    return mat3(cross(b, c), cross(c, a), cross(a, b));
+}
+#else
+layout(std140) uniform Object {
+    mat4 MV; // model-view matrix
+    mat3 N; // normal matrix
+};
+
+mat4 getModelView()
+{
+    return MV;
+}
+
+mat3 getNormalMatrix()
+{
+    return N;
+}
+#endif
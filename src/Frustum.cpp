@@ -0,0 +1,108 @@
+#include "Frustum.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define FRUSTUM_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+Frustum::Frustum() :
+	eye(0.0f),
+	coneCulling(false)
+{
+}
+
+Frustum::~Frustum()
+{
+}
+
+void Frustum::set(const glm::mat4 &P, const glm::mat4 &MV)
+{
+	// Gribb and Hartmann: each plane is a sum or difference of the last row
+	// of the matrix and one of the other rows. glm matrices are column-major.
+	glm::mat4 M = P * MV;
+	glm::vec4 rows[4];
+	for(int i = 0; i < 4; ++i) {
+		rows[i] = glm::vec4(M[0][i], M[1][i], M[2][i], M[3][i]);
+	}
+	planes[0] = rows[3] + rows[0];
+	planes[1] = rows[3] - rows[0];
+	planes[2] = rows[3] + rows[1];
+	planes[3] = rows[3] - rows[1];
+	planes[4] = rows[3] + rows[2];
+	planes[5] = rows[3] - rows[2];
+	// Normalize so that plane distances are in object units
+	for(int i = 0; i < 6; ++i) {
+		float len = glm::length(glm::vec3(planes[i]));
+		if(len > 0.0f) {
+			planes[i] /= len;
+		}
+	}
+	// The camera is at the origin of eye space
+	eye = glm::vec3(glm::inverse(MV) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+}
+
+bool Frustum::intersectsSphere(const float center[3], float radius) const
+{
+	for(int i = 0; i < 6; ++i) {
+		const glm::vec4 &p = planes[i];
+		if(p.x*center[0] + p.y*center[1] + p.z*center[2] + p.w < -radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t Frustum::cullSpheres(const float *x, const float *y, const float *z, const float *r, size_t n, unsigned char *visible) const
+{
+	size_t count = 0;
+	size_t i = 0;
+#ifdef FRUSTUM_SSE
+	// Four spheres at a time against each plane
+	__m128 px[6], py[6], pz[6], pw[6];
+	for(int p = 0; p < 6; ++p) {
+		px[p] = _mm_set1_ps(planes[p].x);
+		py[p] = _mm_set1_ps(planes[p].y);
+		pz[p] = _mm_set1_ps(planes[p].z);
+		pw[p] = _mm_set1_ps(planes[p].w);
+	}
+	const __m128 zero = _mm_setzero_ps();
+	for(; i + 4 <= n; i += 4) {
+		__m128 cx = _mm_loadu_ps(x + i);
+		__m128 cy = _mm_loadu_ps(y + i);
+		__m128 cz = _mm_loadu_ps(z + i);
+		__m128 nr = _mm_sub_ps(zero, _mm_loadu_ps(r + i));
+		__m128 inside = _mm_cmpeq_ps(zero, zero);
+		for(int p = 0; p < 6; ++p) {
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px[p], cx), _mm_mul_ps(py[p], cy)), _mm_add_ps(_mm_mul_ps(pz[p], cz), pw[p]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(d, nr));
+		}
+		int mask = _mm_movemask_ps(inside);
+		for(int k = 0; k < 4; ++k) {
+			visible[i+k] = (unsigned char)((mask >> k) & 1);
+			count += visible[i+k];
+		}
+	}
+#endif
+	for(; i < n; ++i) {
+		float c[3] = { x[i], y[i], z[i] };
+		visible[i] = intersectsSphere(c, r[i]) ? 1 : 0;
+		count += visible[i];
+	}
+	return count;
+}
+
+bool Frustum::isBackfacing(const float center[3], float radius, const float axis[3], float cutoff) const
+{
+	if(!coneCulling || cutoff >= 1.0f) {
+		return false;
+	}
+	// A triangle at p with normal n faces away if dot(p - eye, n) > 0. For
+	// every normal within the cone, that holds if the direction to p is
+	// within 90 degrees minus the cone's half angle of the axis. Widen the
+	// test by the radius to cover every point of the sphere.
+	glm::vec3 d = glm::vec3(center[0], center[1], center[2]) - eye;
+	glm::vec3 a(axis[0], axis[1], axis[2]);
+	return glm::dot(d, a) >= cutoff*glm::length(d) + radius*(1.0f + cutoff);
+}
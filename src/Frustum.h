@@ -0,0 +1,43 @@
+#pragma once
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <cstddef>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+/**
+ * The view frustum and camera position in the object space of one shape,
+ * used to cull objects and clusters of triangles before they are drawn.
+ * Working in object space avoids transforming every bounding sphere each
+ * frame. With MV set to the view matrix alone, the planes are in world space
+ * and many objects can be tested in one batch.
+ */
+class Frustum
+{
+public:
+	Frustum();
+	virtual ~Frustum();
+	// Extracts the planes from P*MV and the camera position from MV
+	void set(const glm::mat4 &P, const glm::mat4 &MV);
+	// Only cull back-facing clusters when back faces are not drawn anyway
+	void setConeCulling(bool b) { coneCulling = b; }
+	bool isConeCulling() const { return coneCulling; }
+	// False if the sphere is completely outside one of the planes
+	bool intersectsSphere(const float center[3], float radius) const;
+	// Tests n spheres, given as separate coordinate arrays, and sets
+	// visible[i] to 1 if sphere i intersects the frustum and 0 otherwise.
+	// Returns the number of visible spheres. Uses SSE where available.
+	size_t cullSpheres(const float *x, const float *y, const float *z, const float *r, size_t n, unsigned char *visible) const;
+	// True if every triangle inside the sphere with normals in the cone faces
+	// away from the camera. cutoff is the sine of the cone's half angle.
+	bool isBackfacing(const float center[3], float radius, const float axis[3], float cutoff) const;
+	
+private:
+	glm::vec4 planes[6]; // left, right, bottom, top, near, far
+	glm::vec3 eye;
+	bool coneCulling;
+};
+
+#endif
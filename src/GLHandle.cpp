@@ -0,0 +1,189 @@
+#include "GLHandle.h"
+
+#include <deque>
+#include <vector>
+
+#include "GLState.h"
+
+using namespace std;
+
+namespace {
+
+struct Released {
+	GLHandle::Type type;
+	GLuint name;
+};
+
+struct Frame {
+	GLsync fence; // 0 if sync objects are not supported
+	vector<Released> names;
+};
+
+struct DeletionQueue {
+	vector<Released> current; // released since the last endFrame()
+	deque<Frame> frames; // oldest first
+	size_t pending = 0;
+	size_t deleted = 0;
+	bool closed = false;
+};
+
+// Never destroyed, so that handles held by globals can still be released
+// while the program exits
+DeletionQueue &getQueue()
+{
+	static DeletionQueue *queue = new DeletionQueue();
+	return *queue;
+}
+
+void deleteName(const Released &r)
+{
+	switch(r.type) {
+		case GLHandle::BUFFER:
+			glDeleteBuffers(1, &r.name);
+			GLState::forgetBuffer(r.name);
+			break;
+		case GLHandle::SHADER:
+			glDeleteShader(r.name);
+			break;
+		case GLHandle::PROGRAM:
+			glDeleteProgram(r.name);
+			GLState::forgetProgram(r.name);
+			break;
+		case GLHandle::VERTEX_ARRAY:
+			glDeleteVertexArrays(1, &r.name);
+			GLState::forgetVertexArray(r.name);
+			break;
+	}
+}
+
+void deleteFrame(Frame &f)
+{
+	DeletionQueue &q = getQueue();
+	for(const Released &r : f.names) {
+		deleteName(r);
+	}
+	q.pending -= f.names.size();
+	q.deleted += f.names.size();
+	if(f.fence) {
+		glDeleteSync(f.fence);
+	}
+}
+
+}
+
+GLHandle::GLHandle(Type type, GLuint name) :
+	type(type),
+	name(name)
+{
+}
+
+GLHandle::GLHandle(GLHandle &&other) noexcept :
+	type(other.type),
+	name(other.name)
+{
+	other.name = 0;
+}
+
+GLHandle &GLHandle::operator=(GLHandle &&other) noexcept
+{
+	if(this != &other) {
+		reset();
+		type = other.type;
+		name = other.name;
+		other.name = 0;
+	}
+	return *this;
+}
+
+GLHandle::~GLHandle()
+{
+	reset();
+}
+
+GLHandle GLHandle::createBuffer()
+{
+	GLuint name;
+	glGenBuffers(1, &name);
+	return GLHandle(BUFFER, name);
+}
+
+GLHandle GLHandle::createShader(GLenum shaderType)
+{
+	return GLHandle(SHADER, glCreateShader(shaderType));
+}
+
+GLHandle GLHandle::createProgram()
+{
+	return GLHandle(PROGRAM, glCreateProgram());
+}
+
+GLHandle GLHandle::createVertexArray()
+{
+	GLuint name;
+	glGenVertexArrays(1, &name);
+	return GLHandle(VERTEX_ARRAY, name);
+}
+
+void GLHandle::reset(GLuint name)
+{
+	DeletionQueue &q = getQueue();
+	if(this->name && !q.closed) {
+		Released r = { type, this->name };
+		q.current.push_back(r);
+		q.pending++;
+	}
+	this->name = name;
+}
+
+GLuint GLHandle::release()
+{
+	GLuint n = name;
+	name = 0;
+	return n;
+}
+
+void GLHandle::endFrame()
+{
+	DeletionQueue &q = getQueue();
+	if(!q.current.empty()) {
+		q.frames.push_back(Frame());
+		Frame &f = q.frames.back();
+		// Without sync objects, deleting right away is still correct; the
+		// driver keeps the storage until the GPU is done with it
+		f.fence = GLEW_VERSION_3_2 ? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : 0;
+		f.names.swap(q.current);
+	}
+	// Fences signal in order, so stop at the first one not yet passed
+	while(!q.frames.empty()) {
+		Frame &f = q.frames.front();
+		if(f.fence && glClientWaitSync(f.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			break;
+		}
+		deleteFrame(f);
+		q.frames.pop_front();
+	}
+}
+
+void GLHandle::shutdown()
+{
+	DeletionQueue &q = getQueue();
+	glFinish();
+	q.frames.push_back(Frame());
+	q.frames.back().fence = 0;
+	q.frames.back().names.swap(q.current);
+	while(!q.frames.empty()) {
+		deleteFrame(q.frames.front());
+		q.frames.pop_front();
+	}
+	q.closed = true;
+}
+
+size_t GLHandle::getPendingCount()
+{
+	return getQueue().pending;
+}
+
+size_t GLHandle::getDeletedCount()
+{
+	return getQueue().deleted;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef GLHANDLE_H
+#define GLHANDLE_H
+
+#include <cstddef>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+/**
+ * Owns the name of one OpenGL buffer, shader, program, or vertex array.
+ * Handles can be moved but not copied. A handle that goes out of scope does
+ * not delete its object right away: the name is queued, and endFrame() puts
+ * a fence (glFenceSync) after the frame's commands and deletes the queued
+ * names once the GPU has passed the fence of the frame that released them.
+ * Deleting an object that queued draws still use never makes the driver
+ * wait, and objects freed while the app runs are actually freed.
+ */
+class GLHandle
+{
+public:
+	enum Type {
+		BUFFER,
+		SHADER,
+		PROGRAM,
+		VERTEX_ARRAY
+	};
+
+	// Takes ownership of name, which may be 0
+	GLHandle(Type type = BUFFER, GLuint name = 0);
+	GLHandle(GLHandle &&other) noexcept;
+	GLHandle &operator=(GLHandle &&other) noexcept;
+	GLHandle(const GLHandle &) = delete;
+	GLHandle &operator=(const GLHandle &) = delete;
+	virtual ~GLHandle();
+
+	static GLHandle createBuffer();
+	static GLHandle createShader(GLenum shaderType);
+	static GLHandle createProgram();
+	static GLHandle createVertexArray();
+
+	GLuint get() const { return name; }
+	Type getType() const { return type; }
+	// Queues the current object for deletion and takes ownership of name
+	void reset(GLuint name = 0);
+	// Gives up ownership without deleting
+	GLuint release();
+
+	// Fences the commands issued so far and deletes the names released
+	// before earlier fences that the GPU has passed. Call once per frame.
+	static void endFrame();
+	// Waits for the GPU and deletes every queued name. Names released
+	// afterwards are dropped, so call this before destroying the context.
+	static void shutdown();
+	static size_t getPendingCount();
+	static size_t getDeletedCount();
+
+private:
+	Type type;
+	GLuint name;
+};
+
+#endif
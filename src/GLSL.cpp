@@ -45,12 +45,24 @@ void checkVersion()
 	if((verstr == NULL) || (sscanf(verstr, "%d.%d", &major, &minor) != 2)) {
 		printf("Invalid GL_VERSION format %d.%d\n", major, minor);
 	}
-	if(major < 2) {
+	// The shaders read uniform blocks, which need 3.1
+	if(major < 3 || (major == 3 && minor < 1)) {
 		printf("This shader example will not work due to the installed Opengl version, which is %d.%d.\n", major, minor);
 		exit(0);
 	}
 }
 
+bool isCoreProfile()
+{
+	// Only 3.2 and later contexts have profiles
+	if(!GLEW_VERSION_3_2) {
+		return false;
+	}
+	GLint mask = 0;
+	glGetIntegerv(GL_CONTEXT_PROFILE_MASK, &mask);
+	return (mask & GL_CONTEXT_CORE_PROFILE_BIT) != 0;
+}
+
 void checkError(const char *str)
 {
 	GLenum glErr = glGetError();
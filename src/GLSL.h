@@ -30,6 +30,9 @@ std::string NumberToString(T x)
 namespace GLSL {
 
 	void checkVersion();
+	// Whether the context has no deprecated features, such as the default
+	// vertex array object
+	bool isCoreProfile();
 	void checkError(const char *str = 0);
 	void printProgramInfoLog(GLuint program);
 	void printShaderInfoLog(GLuint shader);
@@ -0,0 +1,274 @@
+#include "GLState.h"
+
+using namespace std;
+
+namespace {
+
+// Never a valid name or enum, so the next call always differs
+const GLuint UNKNOWN = ~0u;
+
+const GLenum BUFFER_TARGETS[] = {
+	GL_ARRAY_BUFFER,
+	GL_ELEMENT_ARRAY_BUFFER,
+	GL_DRAW_INDIRECT_BUFFER,
+	GL_UNIFORM_BUFFER,
+	GL_COPY_READ_BUFFER,
+	GL_COPY_WRITE_BUFFER
+};
+const int NUM_BUFFER_TARGETS = sizeof(BUFFER_TARGETS)/sizeof(GLenum);
+
+const GLenum CAPS[] = {
+	GL_CULL_FACE,
+	GL_DEPTH_TEST,
+	GL_BLEND
+};
+const int NUM_CAPS = sizeof(CAPS)/sizeof(GLenum);
+
+// Uniform buffer binding points that are tracked
+const int NUM_UNIFORM_BINDINGS = 8;
+
+struct Range {
+	GLuint buffer;
+	GLintptr offset;
+	GLsizeiptr size; // -1 for the whole buffer (glBindBufferBase)
+};
+
+struct State {
+	GLuint program;
+	GLuint vao;
+	GLuint buffers[NUM_BUFFER_TARGETS];
+	Range uniformRanges[NUM_UNIFORM_BINDINGS];
+	GLuint caps[NUM_CAPS]; // GL_TRUE, GL_FALSE, or UNKNOWN
+	GLenum polygonMode;
+	GLenum depthFunc;
+	GLuint depthMask;
+	GLState::Stats frame; // counts so far
+	GLState::Stats lastFrame;
+	
+	State()
+	{
+		frame.issued = frame.skipped = 0;
+		lastFrame = frame;
+		invalidate();
+	}
+	
+	void invalidate()
+	{
+		program = UNKNOWN;
+		vao = UNKNOWN;
+		for(GLuint &b : buffers) {
+			b = UNKNOWN;
+		}
+		for(Range &r : uniformRanges) {
+			r.buffer = UNKNOWN;
+		}
+		for(GLuint &c : caps) {
+			c = UNKNOWN;
+		}
+		polygonMode = UNKNOWN;
+		depthFunc = UNKNOWN;
+		depthMask = UNKNOWN;
+	}
+};
+
+State &getState()
+{
+	static State state;
+	return state;
+}
+
+// Records value and returns true if the call must be sent
+bool update(GLuint &cached, GLuint value)
+{
+	State &s = getState();
+	if(cached == value) {
+		s.frame.skipped++;
+		return false;
+	}
+	cached = value;
+	s.frame.issued++;
+	return true;
+}
+
+int findTarget(GLenum target)
+{
+	for(int i = 0; i < NUM_BUFFER_TARGETS; ++i) {
+		if(BUFFER_TARGETS[i] == target) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int findCap(GLenum cap)
+{
+	for(int i = 0; i < NUM_CAPS; ++i) {
+		if(CAPS[i] == cap) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Sets the range of a uniform binding point, and the generic binding that
+// the GL call also sets. Returns true if the call must be sent.
+bool updateRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+	State &s = getState();
+	int t = findTarget(target);
+	if(target != GL_UNIFORM_BUFFER || index >= NUM_UNIFORM_BINDINGS) {
+		if(t >= 0) {
+			s.buffers[t] = buffer;
+		}
+		s.frame.issued++;
+		return true;
+	}
+	Range &r = s.uniformRanges[index];
+	if(r.buffer == buffer && r.offset == offset && r.size == size) {
+		s.frame.skipped++;
+		return false;
+	}
+	r.buffer = buffer;
+	r.offset = offset;
+	r.size = size;
+	s.buffers[t] = buffer;
+	s.frame.issued++;
+	return true;
+}
+
+}
+
+namespace GLState {
+
+void useProgram(GLuint program)
+{
+	if(update(getState().program, program)) {
+		glUseProgram(program);
+	}
+}
+
+void bindVertexArray(GLuint vao)
+{
+	State &s = getState();
+	if(update(s.vao, vao)) {
+		glBindVertexArray(vao);
+		s.buffers[findTarget(GL_ELEMENT_ARRAY_BUFFER)] = UNKNOWN;
+	}
+}
+
+void bindBuffer(GLenum target, GLuint buffer)
+{
+	int t = findTarget(target);
+	if(t < 0) {
+		getState().frame.issued++;
+		glBindBuffer(target, buffer);
+	} else if(update(getState().buffers[t], buffer)) {
+		glBindBuffer(target, buffer);
+	}
+}
+
+void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+	if(updateRange(target, index, buffer, offset, size)) {
+		glBindBufferRange(target, index, buffer, offset, size);
+	}
+}
+
+void bindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+	if(updateRange(target, index, buffer, 0, -1)) {
+		glBindBufferBase(target, index, buffer);
+	}
+}
+
+void setEnabled(GLenum cap, bool enabled)
+{
+	int c = findCap(cap);
+	if(c >= 0 && !update(getState().caps[c], enabled ? GL_TRUE : GL_FALSE)) {
+		return;
+	}
+	if(c < 0) {
+		getState().frame.issued++;
+	}
+	if(enabled) {
+		glEnable(cap);
+	} else {
+		glDisable(cap);
+	}
+}
+
+void polygonMode(GLenum mode)
+{
+	if(update(getState().polygonMode, mode)) {
+		glPolygonMode(GL_FRONT_AND_BACK, mode);
+	}
+}
+
+void depthFunc(GLenum func)
+{
+	if(update(getState().depthFunc, func)) {
+		glDepthFunc(func);
+	}
+}
+
+void depthMask(bool mask)
+{
+	if(update(getState().depthMask, mask ? GL_TRUE : GL_FALSE)) {
+		glDepthMask(mask ? GL_TRUE : GL_FALSE);
+	}
+}
+
+void invalidate()
+{
+	getState().invalidate();
+}
+
+void forgetBuffer(GLuint buffer)
+{
+	State &s = getState();
+	for(GLuint &b : s.buffers) {
+		if(b == buffer) {
+			b = 0;
+		}
+	}
+	// Indexed bindings are not reset by the GL, but the name may be reused
+	for(Range &r : s.uniformRanges) {
+		if(r.buffer == buffer) {
+			r.buffer = UNKNOWN;
+		}
+	}
+}
+
+void forgetVertexArray(GLuint vao)
+{
+	State &s = getState();
+	if(s.vao == vao) {
+		s.vao = 0;
+		s.buffers[findTarget(GL_ELEMENT_ARRAY_BUFFER)] = UNKNOWN;
+	}
+}
+
+void forgetProgram(GLuint program)
+{
+	// A program in use is only deleted once it is no longer used, so the
+	// binding stays, but the name may be reused
+	State &s = getState();
+	if(s.program == program) {
+		s.program = UNKNOWN;
+	}
+}
+
+void endFrame()
+{
+	State &s = getState();
+	s.lastFrame = s.frame;
+	s.frame.issued = 0;
+	s.frame.skipped = 0;
+}
+
+Stats getFrameStats()
+{
+	return getState().lastFrame;
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+/**
+ * The bound program, vertex array, and buffers, the enabled capabilities,
+ * the polygon mode, and the depth state, as last set through these
+ * functions. A call that would not change the state is skipped instead of
+ * sent to the driver. Everything that sets this state must go through here,
+ * or call invalidate() afterwards.
+ * The element array binding belongs to the bound vertex array, so it is
+ * forgotten whenever another one is bound.
+ */
+namespace GLState {
+
+	// Calls sent to the driver and calls skipped
+	struct Stats {
+		unsigned issued;
+		unsigned skipped;
+	};
+
+	void useProgram(GLuint program);
+	void bindVertexArray(GLuint vao);
+	// Other targets than the array, element array, draw indirect, uniform,
+	// and copy buffers are not tracked
+	void bindBuffer(GLenum target, GLuint buffer);
+	// Uniform buffer binding points only. Also binds the buffer to target,
+	// like the GL call does.
+	void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+	void bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+	void setEnabled(GLenum cap, bool enabled);
+	// For GL_FRONT_AND_BACK
+	void polygonMode(GLenum mode);
+	void depthFunc(GLenum func);
+	void depthMask(bool mask);
+
+	// The next call of each kind is sent, whatever it sets
+	void invalidate();
+	// GL unbinds objects when they are deleted. Called by GLHandle.
+	void forgetBuffer(GLuint buffer);
+	void forgetVertexArray(GLuint vao);
+	void forgetProgram(GLuint program);
+
+	// Ends the frame's counts, see getFrameStats()
+	void endFrame();
+	// Counts of the last frame
+	Stats getFrameStats();
+
+}
+
+#endif
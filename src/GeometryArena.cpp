@@ -0,0 +1,321 @@
+#include "GeometryArena.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "GLSL.h"
+#include "GLState.h"
+#include "Program.h"
+#include "VertexFormat.h"
+
+using namespace std;
+
+GeometryArena::GeometryArena(size_t vertexCapacity, size_t elementCapacity) :
+	vertexCapacity(vertexCapacity),
+	elementCapacity(elementCapacity),
+	commandCount(0),
+	submitCount(0)
+{
+}
+
+GeometryArena::~GeometryArena()
+{
+}
+
+bool GeometryArena::isSupported()
+{
+	return GLEW_VERSION_3_2;
+}
+
+bool GeometryArena::isMultiDrawSupported()
+{
+	return GLEW_VERSION_4_3;
+}
+
+bool GeometryArena::allocate(Pool &pool, unsigned nverts, unsigned nelems, Record &r)
+{
+	if(!pool.vertAlloc.allocate(nverts, r.vert)) {
+		return false;
+	}
+	if(!pool.eleAlloc.allocate(nelems, r.ele)) {
+		pool.vertAlloc.free(r.vert);
+		return false;
+	}
+	return true;
+}
+
+bool GeometryArena::add(unsigned vertexFormat, unsigned indexSize, const float decode[6],
+	const void *vert, size_t nverts, const void *ele, size_t nelems, unsigned &handle)
+{
+	size_t stride = VertexFormat::get(vertexFormat).stride;
+	Record r;
+	r.nverts = (unsigned)nverts;
+	r.nelems = (unsigned)nelems;
+	memcpy(r.decode, decode, sizeof(r.decode));
+	r.live = true;
+
+	// Find a pool with the same layout and room left, compacting it if the
+	// free space is there but split up
+	size_t p = 0;
+	for(; p < pools.size(); ++p) {
+		Pool &pool = pools[p];
+		if(pool.vertexFormat != vertexFormat || pool.indexSize != indexSize) {
+			continue;
+		}
+		if(allocate(pool, r.nverts, r.nelems, r)) {
+			break;
+		}
+		if(pool.vertAlloc.getSize() - pool.vertAlloc.getUsed() >= nverts &&
+			pool.eleAlloc.getSize() - pool.eleAlloc.getUsed() >= nelems) {
+			compact((unsigned)p);
+			if(allocate(pools[p], r.nverts, r.nelems, r)) {
+				break;
+			}
+		}
+	}
+	if(p == pools.size()) {
+		unsigned maxVerts = (unsigned)(vertexCapacity/stride);
+		unsigned maxElems = (unsigned)(elementCapacity/indexSize);
+		if(nverts > maxVerts || nelems > maxElems) {
+			cerr << "GeometryArena: " << nverts << " vertices and " << nelems << " indices do not fit in a pool" << endl;
+			return false;
+		}
+		Pool pool;
+		pool.vertexFormat = vertexFormat;
+		pool.indexSize = indexSize;
+		pool.vertAlloc.reset(maxVerts);
+		pool.eleAlloc.reset(maxElems);
+		GLState::bindVertexArray(0);
+		pool.vertBuf = GLHandle::createBuffer();
+		GLState::bindBuffer(GL_ARRAY_BUFFER, pool.vertBuf.get());
+		glBufferData(GL_ARRAY_BUFFER, maxVerts*stride, NULL, GL_STATIC_DRAW);
+		pool.eleBuf = GLHandle::createBuffer();
+		GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.eleBuf.get());
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, (size_t)maxElems*indexSize, NULL, GL_STATIC_DRAW);
+		pools.push_back(move(pool));
+		allocate(pools[p], r.nverts, r.nelems, r);
+	}
+
+	Pool &pool = pools[p];
+	GLState::bindVertexArray(0);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, pool.vertBuf.get());
+	glBufferSubData(GL_ARRAY_BUFFER, r.vert.offset*stride, nverts*stride, vert);
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.eleBuf.get());
+	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, (size_t)r.ele.offset*indexSize, nelems*indexSize, ele);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, 0);
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	r.allocation.pool = (unsigned)p;
+	r.allocation.baseVertex = r.vert.offset;
+	r.allocation.firstIndex = r.ele.offset;
+	r.allocation.vertBufID = pool.vertBuf.get();
+	r.allocation.eleBufID = pool.eleBuf.get();
+	if(freeHandles.empty()) {
+		handle = (unsigned)records.size();
+		records.push_back(r);
+	} else {
+		handle = freeHandles.back();
+		freeHandles.pop_back();
+		records[handle] = r;
+	}
+
+	GLSL::checkError(GET_FILE_LINE);
+	return true;
+}
+
+void GeometryArena::free(unsigned handle)
+{
+	Record &r = records[handle];
+	Pool &pool = pools[r.allocation.pool];
+	pool.vertAlloc.free(r.vert);
+	pool.eleAlloc.free(r.ele);
+	r.live = false;
+	freeHandles.push_back(handle);
+}
+
+void GeometryArena::compact()
+{
+	for(size_t p = 0; p < pools.size(); ++p) {
+		compact((unsigned)p);
+	}
+}
+
+void GeometryArena::compact(unsigned p)
+{
+	Pool &pool = pools[p];
+	vector<unsigned> live;
+	for(size_t h = 0; h < records.size(); ++h) {
+		if(records[h].live && records[h].allocation.pool == p) {
+			live.push_back((unsigned)h);
+		}
+	}
+
+	// Each buffer is packed in the order of its ranges: the ranges are
+	// gathered into a scratch buffer, which is then copied back to the start
+	// of the pool's buffer. Going through the scratch buffer keeps the buffer
+	// names, so the VAOs stay valid, and avoids overlapping copies.
+	for(int pass = 0; pass < 2; ++pass) {
+		bool verts = pass == 0;
+		size_t unit = verts ? VertexFormat::get(pool.vertexFormat).stride : pool.indexSize;
+		unsigned buf = verts ? pool.vertBuf.get() : pool.eleBuf.get();
+		OffsetAllocator &alloc = verts ? pool.vertAlloc : pool.eleAlloc;
+		sort(live.begin(), live.end(), [&](unsigned a, unsigned b) {
+			return verts ? records[a].vert.offset < records[b].vert.offset : records[a].ele.offset < records[b].ele.offset;
+		});
+		size_t total = (size_t)alloc.getUsed()*unit;
+		if(total == 0) {
+			alloc.reset(alloc.getSize());
+			continue;
+		}
+		// Released at the end of the pass, and deleted once the copies are done
+		GLHandle scratch = GLHandle::createBuffer();
+		GLState::bindBuffer(GL_COPY_WRITE_BUFFER, scratch.get());
+		glBufferData(GL_COPY_WRITE_BUFFER, total, NULL, GL_STREAM_COPY);
+		GLState::bindBuffer(GL_COPY_READ_BUFFER, buf);
+		size_t dst = 0;
+		for(unsigned h : live) {
+			const Record &r = records[h];
+			size_t src = (size_t)(verts ? r.vert.offset : r.ele.offset)*unit;
+			size_t size = (size_t)(verts ? r.nverts : r.nelems)*unit;
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, src, dst, size);
+			dst += size;
+		}
+		GLState::bindBuffer(GL_COPY_READ_BUFFER, scratch.get());
+		GLState::bindBuffer(GL_COPY_WRITE_BUFFER, buf);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, total);
+		GLState::bindBuffer(GL_COPY_READ_BUFFER, 0);
+		GLState::bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		// A fresh allocator hands out the same packed offsets in this order
+		alloc.reset(alloc.getSize());
+		for(unsigned h : live) {
+			Record &r = records[h];
+			if(verts) {
+				alloc.allocate(r.nverts, r.vert);
+				r.allocation.baseVertex = r.vert.offset;
+			} else {
+				alloc.allocate(r.nelems, r.ele);
+				r.allocation.firstIndex = r.ele.offset;
+			}
+		}
+	}
+
+	GLSL::checkError(GET_FILE_LINE);
+}
+
+GeometryArena::Stats GeometryArena::getStats() const
+{
+	Stats stats = { 0, 0, 0, 0, 0, (unsigned)pools.size(), 0.0f };
+	size_t freeTotal = 0, freeSplit = 0;
+	for(const Pool &pool : pools) {
+		for(int pass = 0; pass < 2; ++pass) {
+			const OffsetAllocator &alloc = pass == 0 ? pool.vertAlloc : pool.eleAlloc;
+			size_t unit = pass == 0 ? VertexFormat::get(pool.vertexFormat).stride : pool.indexSize;
+			size_t free = (size_t)(alloc.getSize() - alloc.getUsed())*unit;
+			size_t largest = (size_t)alloc.getLargestFree()*unit;
+			stats.capacity += (size_t)alloc.getSize()*unit;
+			stats.used += (size_t)alloc.getUsed()*unit;
+			stats.largestFree = max(stats.largestFree, largest);
+			stats.freeBlocks += alloc.getFreeBlockCount();
+			freeTotal += free;
+			freeSplit += free - largest;
+		}
+	}
+	stats.allocations = (unsigned)(records.size() - freeHandles.size());
+	stats.fragmentation = freeTotal > 0 ? (float)freeSplit/freeTotal : 0.0f;
+	return stats;
+}
+
+unsigned GeometryArena::addInstance(const Shape::Instance &instance, unsigned handle)
+{
+	const float *decode = records[handle].decode;
+	decodes.insert(decodes.end(), decode, decode + 6);
+	instances.push_back(instance);
+	return (unsigned)instances.size() - 1;
+}
+
+void GeometryArena::addCommand(unsigned pool, const DrawCommand &command)
+{
+	pools[pool].commands.push_back(command);
+}
+
+unsigned GeometryArena::getVAO(Pool &pool, const shared_ptr<Program> &prog)
+{
+	auto found = pool.vaos.find(prog->getSerial());
+	if(found != pool.vaos.end()) {
+		return found->second.get();
+	}
+	// First draw of this pool with this program
+	GLHandle &vao = pool.vaos[prog->getSerial()];
+	vao = GLHandle::createVertexArray();
+	GLState::bindVertexArray(vao.get());
+	GLState::bindBuffer(GL_ARRAY_BUFFER, pool.vertBuf.get());
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.eleBuf.get());
+	VertexFormat::get(pool.vertexFormat).setAttribPointers(prog, true);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, instBuf.get());
+	Shape::setInstanceAttribPointers(prog, true);
+	// The decoding of each draw's shape, next to its instance
+	GLState::bindBuffer(GL_ARRAY_BUFFER, decodeBuf.get());
+	const char *names[2] = { "iPosScale", "iPosOffset" };
+	for(int i = 0; i < 2; ++i) {
+		int h = prog->getAttribute(names[i]);
+		if(h != -1) {
+			glEnableVertexAttribArray(h);
+			glVertexAttribPointer(h, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), (const void *)(3*i*sizeof(float)));
+			glVertexAttribDivisor(h, 1);
+		}
+	}
+	GLState::bindBuffer(GL_ARRAY_BUFFER, 0);
+	return vao.get();
+}
+
+void GeometryArena::submit(const function<shared_ptr<Program>(unsigned vertexFormat)> &getProgram)
+{
+	commandCount = 0;
+	submitCount = 0;
+	if(instances.empty()) {
+		return;
+	}
+	if(!instBuf.get()) {
+		instBuf = GLHandle::createBuffer();
+		decodeBuf = GLHandle::createBuffer();
+		cmdBuf = GLHandle::createBuffer();
+	}
+
+	// One upload of the per-draw data for all pools, and of all commands
+	vector<DrawCommand> commands;
+	for(const Pool &pool : pools) {
+		commands.insert(commands.end(), pool.commands.begin(), pool.commands.end());
+	}
+	GLState::bindBuffer(GL_ARRAY_BUFFER, instBuf.get());
+	glBufferData(GL_ARRAY_BUFFER, instances.size()*sizeof(Shape::Instance), instances.data(), GL_STREAM_DRAW);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, decodeBuf.get());
+	glBufferData(GL_ARRAY_BUFFER, decodes.size()*sizeof(float), decodes.data(), GL_STREAM_DRAW);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, 0);
+	GLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, cmdBuf.get());
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size()*sizeof(DrawCommand), commands.data(), GL_STREAM_DRAW);
+
+	size_t first = 0;
+	for(Pool &pool : pools) {
+		if(pool.commands.empty()) {
+			continue;
+		}
+		shared_ptr<Program> prog = getProgram(pool.vertexFormat);
+		prog->bind();
+		GLState::bindVertexArray(getVAO(pool, prog));
+		GLenum type = pool.indexSize == sizeof(unsigned short) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+		glMultiDrawElementsIndirect(GL_TRIANGLES, type, (const void *)(first*sizeof(DrawCommand)), (GLsizei)pool.commands.size(), 0);
+		first += pool.commands.size();
+		commandCount += (unsigned)pool.commands.size();
+		submitCount++;
+		pool.commands.clear();
+	}
+	GLState::bindVertexArray(0);
+	GLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	GLState::useProgram(0);
+	instances.clear();
+	decodes.clear();
+
+	GLSL::checkError(GET_FILE_LINE);
+}
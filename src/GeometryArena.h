@@ -0,0 +1,134 @@
+#pragma once
+#ifndef GEOMETRYARENA_H
+#define GEOMETRYARENA_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "GLHandle.h"
+#include "OffsetAllocator.h"
+#include "Shape.h"
+
+class Program;
+
+/**
+ * Large vertex and element buffers shared by many shapes, so that shapes
+ * drawn with the same program are submitted together with one
+ * glMultiDrawElementsIndirect instead of one bind and draw each.
+ * Shapes with the same vertex format and index type share a pool. Ranges of a pool's buffers are handed out by an
+ * OffsetAllocator in units of vertices and indices, and draws address them
+ * with baseVertex and firstIndex. Freed ranges are reused, and compact()
+ * moves the live ranges to the front of their buffers with
+ * glCopyBufferSubData when the free space gets fragmented.
+ * Per-draw data comes from a Shape::Instance, and from the position decoding
+ * of the drawn shape, that each draw selects with baseInstance, so the
+ * programs must be the INSTANCED shader variants.
+ * Draws are queued with Shape::queueDraw() and sent with submit().
+ */
+class GeometryArena
+{
+public:
+	// Same layout as the DrawElementsIndirectCommand of the GL spec
+	struct DrawCommand {
+		unsigned count;
+		unsigned instanceCount;
+		unsigned firstIndex;
+		int baseVertex;
+		unsigned baseInstance;
+	};
+	// Where a shape's arrays are. Changes when the pool is compacted.
+	struct Allocation {
+		unsigned pool;
+		unsigned baseVertex;
+		unsigned firstIndex;
+		unsigned vertBufID;
+		unsigned eleBufID;
+	};
+	// Memory use of all pools, in bytes
+	struct Stats {
+		size_t capacity;
+		size_t used;
+		size_t largestFree; // largest free block of any buffer
+		unsigned allocations;
+		unsigned freeBlocks;
+		unsigned pools;
+		// Share of the free space that is not in the largest free block of
+		// its buffer; 0 when every buffer has one free block
+		float fragmentation;
+	};
+
+	// The capacities are per pool, in bytes
+	GeometryArena(size_t vertexCapacity = 16 << 20, size_t elementCapacity = 8 << 20);
+	virtual ~GeometryArena();
+	// Storage and baseVertex draws need GL 3.2; submit() needs GL 4.3
+	static bool isSupported();
+	static bool isMultiDrawSupported();
+
+	// Copies nverts vertices and nelems indices into a pool with the same
+	// layout and returns the handle of the ranges. decode holds the shape's
+	// posScale and posOffset, which its draws pass to the vertex shader.
+	// Returns false if they do not fit in a pool.
+	bool add(unsigned vertexFormat, unsigned indexSize, const float decode[6],
+		const void *vert, size_t nverts, const void *ele, size_t nelems, unsigned &handle);
+	void free(unsigned handle);
+	const Allocation &getAllocation(unsigned handle) const { return records[handle].allocation; }
+	// Moves the live ranges of every pool to the front of its buffers
+	void compact();
+	Stats getStats() const;
+
+	// Queues per-draw data, with the decoding of the shape added as handle,
+	// and returns its index for DrawCommand::baseInstance
+	unsigned addInstance(const Shape::Instance &instance, unsigned handle);
+	void addCommand(unsigned pool, const DrawCommand &command);
+	// Draws everything queued since the last submit, one
+	// glMultiDrawElementsIndirect per pool, and clears the queue. Each pool
+	// is drawn with, and binds, the program getProgram returns for its
+	// vertex format.
+	void submit(const std::function<std::shared_ptr<Program>(unsigned vertexFormat)> &getProgram);
+
+	// Commands and pools drawn by the last submit()
+	unsigned getCommandCount() const { return commandCount; }
+	unsigned getSubmitCount() const { return submitCount; }
+
+private:
+	struct Pool {
+		unsigned vertexFormat;
+		unsigned indexSize;
+		GLHandle vertBuf;
+		GLHandle eleBuf;
+		OffsetAllocator vertAlloc; // in vertices
+		OffsetAllocator eleAlloc; // in indices
+		std::vector<DrawCommand> commands;
+		std::map<unsigned, GLHandle> vaos; // by Program::getSerial()
+	};
+	struct Record {
+		Allocation allocation;
+		OffsetAllocator::Allocation vert;
+		OffsetAllocator::Allocation ele;
+		unsigned nverts;
+		unsigned nelems;
+		float decode[6];
+		bool live;
+	};
+
+	bool allocate(Pool &pool, unsigned nverts, unsigned nelems, Record &r);
+	void compact(unsigned pool);
+	unsigned getVAO(Pool &pool, const std::shared_ptr<Program> &prog);
+
+	size_t vertexCapacity;
+	size_t elementCapacity;
+	std::vector<Pool> pools;
+	std::vector<Record> records; // by handle
+	std::vector<unsigned> freeHandles;
+	std::vector<Shape::Instance> instances;
+	std::vector<float> decodes; // posScale and posOffset of each instance
+	GLHandle instBuf;
+	GLHandle decodeBuf;
+	GLHandle cmdBuf;
+	unsigned commandCount;
+	unsigned submitCount;
+};
+
+#endif
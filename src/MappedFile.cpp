@@ -0,0 +1,96 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+MappedFile::MappedFile() :
+	ptr(0),
+	len(0)
+#ifdef _WIN32
+	, file(0),
+	mapping(0)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const string &fileName)
+{
+	close();
+#ifdef _WIN32
+	HANDLE f = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(f == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fsize;
+	if(!GetFileSizeEx(f, &fsize) || fsize.QuadPart == 0) {
+		CloseHandle(f);
+		return false;
+	}
+	HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(m == NULL) {
+		CloseHandle(f);
+		return false;
+	}
+	const void *p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+	if(p == NULL) {
+		CloseHandle(m);
+		CloseHandle(f);
+		return false;
+	}
+	file = f;
+	mapping = m;
+	ptr = (const char *)p;
+	len = (size_t)fsize.QuadPart;
+#else
+	int fd = ::open(fileName.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping stays valid after the descriptor is closed.
+	::close(fd);
+	if(p == MAP_FAILED) {
+		return false;
+	}
+	ptr = (const char *)p;
+	len = (size_t)st.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(!ptr) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(ptr);
+	CloseHandle((HANDLE)mapping);
+	CloseHandle((HANDLE)file);
+	file = 0;
+	mapping = 0;
+#else
+	munmap((void *)ptr, len);
+#endif
+	ptr = 0;
+	len = 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+/**
+ * A read-only memory mapping of a whole file. The mapping is released when
+ * the object is destroyed or close() is called.
+ */
+class MappedFile
+{
+public:
+	MappedFile();
+	virtual ~MappedFile();
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	
+	bool open(const std::string &fileName);
+	void close();
+	const char *data() const { return ptr; }
+	size_t size() const { return len; }
+	
+private:
+	const char *ptr;
+	size_t len;
+#ifdef _WIN32
+	void *file;
+	void *mapping;
+#endif
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include "MeshCache.h"
+#include "VertexFormat.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+const char MAGIC[4] = { 'A', '3', 'M', 'C' };
+// Bump whenever the header, section table, or the contents of any section change.
+const uint32_t VERSION = 5;
+const uint64_t ALIGNMENT = 16;
+
+struct Header {
+	char magic[4];
+	uint32_t version;
+	uint64_t srcSize;
+	int64_t srcMtime;
+	uint64_t srcHash;
+	MeshCache::Info info;
+	uint32_t nsections;
+	uint32_t pad;
+};
+
+struct SectionEntry {
+	uint32_t tag;
+	uint32_t pad;
+	uint64_t offset;
+	uint64_t size;
+};
+
+bool statFile(const string &fileName, uint64_t &size, int64_t &mtime)
+{
+	struct stat st;
+	if(stat(fileName.c_str(), &st) != 0) {
+		return false;
+	}
+	size = (uint64_t)st.st_size;
+	mtime = (int64_t)st.st_mtime;
+	return true;
+}
+
+// 64-bit FNV-1a of the whole file
+bool hashFile(const string &fileName, uint64_t &hash)
+{
+	MappedFile src;
+	if(!src.open(fileName)) {
+		return false;
+	}
+	hash = 14695981039346656037ull;
+	const unsigned char *p = (const unsigned char *)src.data();
+	for(size_t i = 0; i < src.size(); ++i) {
+		hash = (hash ^ p[i]) * 1099511628211ull;
+	}
+	return true;
+}
+
+uint64_t alignUp(uint64_t x)
+{
+	return (x + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+}
+
+MeshCache::MeshCache()
+{
+	memset(&info, 0, sizeof(info));
+}
+
+MeshCache::~MeshCache()
+{
+}
+
+bool MeshCache::load(const string &cacheName, const string &srcName, size_t lodSize, size_t clusterSize)
+{
+	sections.clear();
+	uint64_t srcSize;
+	int64_t srcMtime;
+	if(!statFile(srcName, srcSize, srcMtime) || !file.open(cacheName)) {
+		return false;
+	}
+	Header header;
+	if(file.size() < sizeof(header)) {
+		file.close();
+		return false;
+	}
+	memcpy(&header, file.data(), sizeof(header));
+	if(memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.srcSize != srcSize) {
+		file.close();
+		return false;
+	}
+	// A touched or copied source only needs rehashing, not reparsing.
+	if(header.srcMtime != srcMtime) {
+		uint64_t srcHash;
+		if(!hashFile(srcName, srcHash) || srcHash != header.srcHash) {
+			file.close();
+			return false;
+		}
+	}
+	uint64_t tableEnd = sizeof(header) + (uint64_t)header.nsections*sizeof(SectionEntry);
+	if(tableEnd > file.size()) {
+		file.close();
+		return false;
+	}
+	const SectionEntry *table = (const SectionEntry *)(file.data() + sizeof(header));
+	for(uint32_t i = 0; i < header.nsections; ++i) {
+		if(table[i].offset + table[i].size > file.size()) {
+			sections.clear();
+			file.close();
+			return false;
+		}
+		SectionData s;
+		s.tag = table[i].tag;
+		s.data = file.data() + table[i].offset;
+		s.size = table[i].size;
+		sections.push_back(s);
+	}
+	info = header.info;
+	// A truncated or edited cache could have the right stamp but not the
+	// right sizes
+	if(!checkSections(lodSize, clusterSize)) {
+		cerr << cacheName << ": sections do not match the header, ignoring the cache" << endl;
+		sections.clear();
+		file.close();
+		return false;
+	}
+	return true;
+}
+
+bool MeshCache::checkSections(size_t lodSize, size_t clusterSize) const
+{
+	// The cache holds float vertices with 16- or 32-bit indices
+	if((info.vertexFormat != FORMAT_PN && info.vertexFormat != FORMAT_PNT) ||
+	   (info.indexSize != sizeof(uint16_t) && info.indexSize != sizeof(uint32_t))) {
+		return false;
+	}
+	uint64_t vertSize, eleSize, lodsSize, clustersSize;
+	if(!getSection(VERTEX, &vertSize) || !getSection(ELEMENT, &eleSize) ||
+	   !getSection(LOD, &lodsSize) || !getSection(CLUSTER, &clustersSize)) {
+		return false;
+	}
+	return vertSize == (uint64_t)info.nverts*VertexFormat::get(info.vertexFormat).stride &&
+	       eleSize == (uint64_t)info.nelems*info.indexSize &&
+	       lodsSize > 0 && lodsSize % lodSize == 0 &&
+	       clustersSize % clusterSize == 0;
+}
+
+bool MeshCache::save(const string &cacheName, const string &srcName, const Info &info, const vector<SectionData> &sections)
+{
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	if(!statFile(srcName, header.srcSize, header.srcMtime) || !hashFile(srcName, header.srcHash)) {
+		return false;
+	}
+	header.info = info;
+	header.nsections = (uint32_t)sections.size();
+	
+	vector<SectionEntry> table(sections.size());
+	uint64_t offset = alignUp(sizeof(header) + table.size()*sizeof(SectionEntry));
+	for(size_t i = 0; i < sections.size(); ++i) {
+		table[i].tag = sections[i].tag;
+		table[i].pad = 0;
+		table[i].offset = offset;
+		table[i].size = sections[i].size;
+		offset = alignUp(offset + sections[i].size);
+	}
+	
+	// Write to a temporary file first so a partially written cache is never mapped.
+	string tmpName = cacheName + ".tmp";
+	FILE *fp = fopen(tmpName.c_str(), "wb");
+	if(fp == NULL) {
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	if(!table.empty()) {
+		ok = ok && fwrite(&table[0], sizeof(SectionEntry), table.size(), fp) == table.size();
+	}
+	const char zeros[ALIGNMENT] = { 0 };
+	uint64_t written = sizeof(header) + table.size()*sizeof(SectionEntry);
+	for(size_t i = 0; i < sections.size() && ok; ++i) {
+		ok = fwrite(zeros, 1, table[i].offset - written, fp) == table[i].offset - written;
+		ok = ok && fwrite(sections[i].data, 1, sections[i].size, fp) == sections[i].size;
+		written = table[i].offset + sections[i].size;
+	}
+	ok = (fclose(fp) == 0) && ok;
+	if(ok) {
+		remove(cacheName.c_str());
+		ok = rename(tmpName.c_str(), cacheName.c_str()) == 0;
+	}
+	if(!ok) {
+		remove(tmpName.c_str());
+	}
+	return ok;
+}
+
+const void *MeshCache::getSection(uint32_t tag, uint64_t *size) const
+{
+	for(size_t i = 0; i < sections.size(); ++i) {
+		if(sections[i].tag == tag) {
+			if(size) {
+				*size = sections[i].size;
+			}
+			return sections[i].data;
+		}
+	}
+	return NULL;
+}
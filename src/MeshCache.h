@@ -0,0 +1,68 @@
+#pragma once
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "MappedFile.h"
+
+/**
+ * A versioned binary cache of a loaded mesh. The file starts with a fixed
+ * header (source file stamp, bounds, counts, attribute layout), followed by a
+ * table of sections and the raw arrays, each aligned to 16 bytes. Arrays are
+ * stored exactly as they are uploaded to the GPU, so a memory-mapped cache
+ * can be passed straight to glBufferData.
+ */
+class MeshCache
+{
+public:
+	enum Section {
+		VERTEX = 0, // interleaved vertices in Info::vertexFormat
+		ELEMENT,    // uint16 or uint32 [nelems], see Info::indexSize
+		LOD,        // index ranges of the levels of detail, see Shape
+		CLUSTER     // MeshOptimizer::Cluster [nclusters]
+	};
+	
+	struct SectionData {
+		uint32_t tag;
+		const void *data;
+		uint64_t size; // in bytes
+	};
+	
+	struct Info {
+		uint32_t nverts;
+		uint32_t nelems;
+		uint32_t indexSize; // 2 or 4 bytes
+		uint32_t vertexFormat; // attribute layout of the VERTEX section
+		float bmin[3];
+		float bmax[3];
+		double parseTime; // seconds it took to build the mesh from source
+	};
+	
+	MeshCache();
+	virtual ~MeshCache();
+	
+	// Maps cacheName and checks it against the current state of srcName,
+	// and the size of each section against the header. lodSize and
+	// clusterSize are the sizes of one LOD and one CLUSTER record; there
+	// must be at least one LOD.
+	bool load(const std::string &cacheName, const std::string &srcName, size_t lodSize, size_t clusterSize);
+	// Writes a cache for srcName. Returns false if the file could not be written.
+	static bool save(const std::string &cacheName, const std::string &srcName, const Info &info, const std::vector<SectionData> &sections);
+	
+	const Info &getInfo() const { return info; }
+	// Returns NULL if the section is not present.
+	const void *getSection(uint32_t tag, uint64_t *size = 0) const;
+	
+private:
+	bool checkSections(size_t lodSize, size_t clusterSize) const;
+	
+	MappedFile file;
+	Info info;
+	std::vector<SectionData> sections;
+};
+
+#endif
@@ -0,0 +1,490 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+using namespace std;
+
+namespace MeshOptimizer {
+
+namespace {
+
+// Forsyth's scoring parameters (LRU cache model)
+const int FORSYTH_CACHE_SIZE = 32;
+const float CACHE_DECAY_POWER = 1.5f;
+const float LAST_TRI_SCORE = 0.75f;
+const float VALENCE_BOOST_SCALE = 2.0f;
+const float VALENCE_BOOST_POWER = 0.5f;
+
+// The FIFO cache size assumed when splitting clusters for overdraw
+const int OVERDRAW_CACHE_SIZE = 16;
+
+// Triangles whose normal is further than this from a culling cluster's
+// average normal (cosine of the angle) start a new cluster
+const float CLUSTER_MIN_NORMAL_DOT = 0.9f;
+
+float vertexScore(int cachePos, int remaining)
+{
+	if(remaining == 0) {
+		// No triangles left to draw with this vertex
+		return -1.0f;
+	}
+	float score = 0.0f;
+	if(cachePos >= 0) {
+		if(cachePos < 3) {
+			// Used by the last triangle; a fixed score avoids favoring any
+			// of its three vertices.
+			score = LAST_TRI_SCORE;
+		} else {
+			float scaler = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+			score = pow(1.0f - (cachePos - 3) * scaler, CACHE_DECAY_POWER);
+		}
+	}
+	// Favor vertices with few triangles left to clear them out early
+	score += VALENCE_BOOST_SCALE * pow((float)remaining, -VALENCE_BOOST_POWER);
+	return score;
+}
+
+// Simulates a FIFO cache over triangles [begin, end) and returns the misses
+unsigned int simulateFifo(const vector<unsigned int> &indices, size_t begin, size_t end, vector<unsigned int> &cacheTime, unsigned int &timestamp, int cacheSize)
+{
+	unsigned int misses = 0;
+	for(size_t i = 3*begin; i < 3*end; ++i) {
+		unsigned int v = indices[i];
+		if(timestamp - cacheTime[v] > (unsigned int)cacheSize) {
+			cacheTime[v] = timestamp++;
+			++misses;
+		}
+	}
+	return misses;
+}
+
+}
+
+CacheStats analyzeVertexCache(const vector<unsigned int> &indices, size_t nverts, int cacheSize)
+{
+	CacheStats stats = { 0.0f, 0.0f };
+	size_t ntris = indices.size()/3;
+	if(ntris == 0) {
+		return stats;
+	}
+	// Timestamps start past the cache size so every vertex starts as a miss
+	vector<unsigned int> cacheTime(nverts, 0);
+	unsigned int timestamp = cacheSize + 1;
+	unsigned int misses = simulateFifo(indices, 0, ntris, cacheTime, timestamp, cacheSize);
+	vector<bool> used(nverts, false);
+	size_t nused = 0;
+	for(size_t i = 0; i < indices.size(); ++i) {
+		if(!used[indices[i]]) {
+			used[indices[i]] = true;
+			++nused;
+		}
+	}
+	stats.acmr = (float)misses / ntris;
+	stats.atvr = (float)misses / nused;
+	return stats;
+}
+
+void optimizeVertexCache(vector<unsigned int> &indices, size_t nverts)
+{
+	size_t ntris = indices.size()/3;
+	if(ntris == 0) {
+		return;
+	}
+	
+	// Triangle adjacency for each vertex, stored contiguously. The first
+	// remaining[v] entries of each list are the triangles not yet emitted.
+	vector<int> remaining(nverts, 0);
+	for(size_t i = 0; i < indices.size(); ++i) {
+		remaining[indices[i]]++;
+	}
+	vector<unsigned int> offsets(nverts + 1, 0);
+	for(size_t v = 0; v < nverts; ++v) {
+		offsets[v+1] = offsets[v] + remaining[v];
+	}
+	vector<unsigned int> adjacency(indices.size());
+	vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for(size_t t = 0; t < ntris; ++t) {
+		for(int k = 0; k < 3; ++k) {
+			adjacency[fill[indices[3*t+k]]++] = (unsigned int)t;
+		}
+	}
+	
+	vector<int> cachePos(nverts, -1);
+	vector<float> vscore(nverts);
+	for(size_t v = 0; v < nverts; ++v) {
+		vscore[v] = vertexScore(-1, remaining[v]);
+	}
+	vector<float> tscore(ntris);
+	vector<bool> emitted(ntris, false);
+	for(size_t t = 0; t < ntris; ++t) {
+		tscore[t] = vscore[indices[3*t]] + vscore[indices[3*t+1]] + vscore[indices[3*t+2]];
+	}
+	
+	vector<unsigned int> result;
+	result.reserve(indices.size());
+	vector<unsigned int> cache, newCache;
+	cache.reserve(FORSYTH_CACHE_SIZE + 3);
+	newCache.reserve(FORSYTH_CACHE_SIZE + 3);
+	
+	long best = (long)(max_element(tscore.begin(), tscore.end()) - tscore.begin());
+	size_t scan = 0;
+	for(size_t n = 0; n < ntris; ++n) {
+		if(best < 0) {
+			// Dead end: continue with the next triangle in input order
+			while(emitted[scan]) {
+				++scan;
+			}
+			best = (long)scan;
+		}
+		const unsigned int *tri = &indices[3*best];
+		emitted[best] = true;
+		result.insert(result.end(), tri, tri + 3);
+		
+		// Remove the triangle from its vertices' adjacency lists
+		for(int k = 0; k < 3; ++k) {
+			unsigned int v = tri[k];
+			unsigned int *list = &adjacency[offsets[v]];
+			for(int j = 0; j < remaining[v]; ++j) {
+				if(list[j] == (unsigned int)best) {
+					swap(list[j], list[remaining[v] - 1]);
+					break;
+				}
+			}
+			remaining[v]--;
+		}
+		
+		// Move the triangle's vertices to the front of the LRU cache
+		newCache.assign(tri, tri + 3);
+		for(size_t j = 0; j < cache.size(); ++j) {
+			unsigned int v = cache[j];
+			if(v != tri[0] && v != tri[1] && v != tri[2]) {
+				newCache.push_back(v);
+			}
+		}
+		for(size_t j = FORSYTH_CACHE_SIZE; j < newCache.size(); ++j) {
+			cachePos[newCache[j]] = -1;
+			vscore[newCache[j]] = vertexScore(-1, remaining[newCache[j]]);
+		}
+		newCache.resize(min(newCache.size(), (size_t)FORSYTH_CACHE_SIZE));
+		cache.swap(newCache);
+		for(size_t j = 0; j < cache.size(); ++j) {
+			cachePos[cache[j]] = (int)j;
+			vscore[cache[j]] = vertexScore((int)j, remaining[cache[j]]);
+		}
+		
+		// Rescore the triangles around the cached vertices and pick the best
+		best = -1;
+		float bestScore = -1.0f;
+		for(size_t j = 0; j < cache.size(); ++j) {
+			unsigned int v = cache[j];
+			for(int a = 0; a < remaining[v]; ++a) {
+				unsigned int t = adjacency[offsets[v] + a];
+				const unsigned int *u = &indices[3*t];
+				tscore[t] = vscore[u[0]] + vscore[u[1]] + vscore[u[2]];
+				if(tscore[t] > bestScore) {
+					bestScore = tscore[t];
+					best = (long)t;
+				}
+			}
+		}
+	}
+	indices.swap(result);
+}
+
+void optimizeOverdraw(vector<unsigned int> &indices, const vector<float> &positions, float threshold)
+{
+	size_t ntris = indices.size()/3;
+	size_t nverts = positions.size()/3;
+	if(ntris == 0) {
+		return;
+	}
+	
+	// Hard boundaries: triangles where the whole cache has to be refilled
+	vector<size_t> hard;
+	{
+		vector<unsigned int> cacheTime(nverts, 0);
+		unsigned int timestamp = OVERDRAW_CACHE_SIZE + 1;
+		for(size_t t = 0; t < ntris; ++t) {
+			if(simulateFifo(indices, t, t + 1, cacheTime, timestamp, OVERDRAW_CACHE_SIZE) == 3) {
+				hard.push_back(t);
+			}
+		}
+		if(hard.empty() || hard[0] != 0) {
+			hard.insert(hard.begin(), 0);
+		}
+		hard.push_back(ntris);
+	}
+	
+	// Soft boundaries: split each hard cluster further as long as the
+	// pieces stay within threshold of the cluster's own ACMR. Advancing the
+	// timestamp past the cache size empties the simulated cache.
+	vector<size_t> clusters;
+	vector<unsigned int> cacheTime(nverts, 0);
+	unsigned int timestamp = OVERDRAW_CACHE_SIZE + 1;
+	for(size_t h = 0; h + 1 < hard.size(); ++h) {
+		size_t begin = hard[h];
+		size_t end = hard[h+1];
+		timestamp += OVERDRAW_CACHE_SIZE + 1;
+		unsigned int clusterMisses = simulateFifo(indices, begin, end, cacheTime, timestamp, OVERDRAW_CACHE_SIZE);
+		float clusterThreshold = threshold * clusterMisses / (end - begin);
+		
+		timestamp += OVERDRAW_CACHE_SIZE + 1;
+		clusters.push_back(begin);
+		size_t start = begin;
+		unsigned int misses = 0;
+		for(size_t t = begin; t < end; ++t) {
+			misses += simulateFifo(indices, t, t + 1, cacheTime, timestamp, OVERDRAW_CACHE_SIZE);
+			if(t + 1 < end && (float)misses / (t + 1 - start) <= clusterThreshold) {
+				// Start a new cluster with a cold cache
+				clusters.push_back(t + 1);
+				start = t + 1;
+				misses = 0;
+				timestamp += OVERDRAW_CACHE_SIZE + 1;
+			}
+		}
+	}
+	clusters.push_back(ntris);
+	
+	// Sort key: how far the cluster faces out from the mesh center
+	auto position = [&](unsigned int v) {
+		return glm::vec3(positions[3*v], positions[3*v+1], positions[3*v+2]);
+	};
+	glm::vec3 meshCenter(0.0f);
+	float meshArea = 0.0f;
+	size_t nclusters = clusters.size() - 1;
+	vector<glm::vec3> centers(nclusters), normals(nclusters);
+	vector<float> areas(nclusters, 0.0f);
+	for(size_t c = 0; c < nclusters; ++c) {
+		for(size_t t = clusters[c]; t < clusters[c+1]; ++t) {
+			glm::vec3 p0 = position(indices[3*t]);
+			glm::vec3 p1 = position(indices[3*t+1]);
+			glm::vec3 p2 = position(indices[3*t+2]);
+			glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+			float area = glm::length(n);
+			centers[c] += (p0 + p1 + p2) * (area / 3.0f);
+			normals[c] += n;
+			areas[c] += area;
+		}
+		meshCenter += centers[c];
+		meshArea += areas[c];
+		if(areas[c] > 0.0f) {
+			centers[c] /= areas[c];
+		}
+	}
+	if(meshArea > 0.0f) {
+		meshCenter /= meshArea;
+	}
+	vector<float> keys(nclusters);
+	for(size_t c = 0; c < nclusters; ++c) {
+		float len = glm::length(normals[c]);
+		keys[c] = len > 0.0f ? glm::dot(centers[c] - meshCenter, normals[c] / len) : 0.0f;
+	}
+	vector<size_t> order(nclusters);
+	for(size_t c = 0; c < nclusters; ++c) {
+		order[c] = c;
+	}
+	stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] > keys[b]; });
+	
+	vector<unsigned int> result;
+	result.reserve(indices.size());
+	for(size_t i = 0; i < nclusters; ++i) {
+		size_t c = order[i];
+		result.insert(result.end(), indices.begin() + 3*clusters[c], indices.begin() + 3*clusters[c+1]);
+	}
+	indices.swap(result);
+}
+
+vector<Cluster> buildClusters(vector<unsigned int> &indices, const vector<float> &positions, unsigned int firstIndex, size_t maxTriangles)
+{
+	vector<Cluster> clusters;
+	size_t ntris = indices.size()/3;
+	size_t nverts = positions.size()/3;
+	if(ntris == 0) {
+		return clusters;
+	}
+	
+	auto position = [&](unsigned int v) {
+		return glm::vec3(positions[3*v], positions[3*v+1], positions[3*v+2]);
+	};
+	vector<glm::vec3> normals(ntris), centroids(ntris);
+	float totalArea = 0.0f;
+	for(size_t t = 0; t < ntris; ++t) {
+		glm::vec3 p0 = position(indices[3*t]);
+		glm::vec3 p1 = position(indices[3*t+1]);
+		glm::vec3 p2 = position(indices[3*t+2]);
+		glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+		float len = glm::length(n);
+		normals[t] = len > 0.0f ? n / len : glm::vec3(0.0f);
+		centroids[t] = (p0 + p1 + p2) / 3.0f;
+		totalArea += 0.5f*len;
+	}
+	// Rough radius of a full cluster, to trade compactness against flatness
+	float clusterRadius = sqrt(totalArea / ntris * maxTriangles / (float)M_PI);
+	if(clusterRadius <= 0.0f) {
+		clusterRadius = 1.0f;
+	}
+	
+	// Triangles around each vertex
+	vector<unsigned int> offsets(nverts + 1, 0);
+	for(size_t i = 0; i < indices.size(); ++i) {
+		offsets[indices[i] + 1]++;
+	}
+	for(size_t v = 0; v < nverts; ++v) {
+		offsets[v+1] += offsets[v];
+	}
+	vector<unsigned int> adjacency(indices.size());
+	vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for(size_t i = 0; i < indices.size(); ++i) {
+		adjacency[fill[indices[i]]++] = (unsigned int)(i/3);
+	}
+	
+	// Grow each cluster from the first unassigned triangle, always taking
+	// the neighbor that best matches its average normal and stays close
+	const unsigned int NONE = ~0u;
+	vector<unsigned int> owner(ntris, NONE);
+	vector<unsigned int> seen(ntris, NONE); // last cluster that queued each triangle
+	vector<unsigned int> members, frontier;
+	vector<unsigned int> localIndex(nverts, NONE), localToGlobal, local;
+	vector<unsigned int> result;
+	result.reserve(indices.size());
+	for(size_t seed = 0; seed < ntris; ++seed) {
+		if(owner[seed] != NONE) {
+			continue;
+		}
+		unsigned int c = (unsigned int)clusters.size();
+		members.clear();
+		frontier.clear();
+		glm::vec3 normalSum(0.0f), centroidSum(0.0f);
+		unsigned int next = (unsigned int)seed;
+		while(next != NONE) {
+			owner[next] = c;
+			members.push_back(next);
+			normalSum += normals[next];
+			centroidSum += centroids[next];
+			if(members.size() >= maxTriangles) {
+				break;
+			}
+			for(int k = 0; k < 3; ++k) {
+				unsigned int v = indices[3*next+k];
+				for(unsigned int j = offsets[v]; j < offsets[v+1]; ++j) {
+					unsigned int t = adjacency[j];
+					if(owner[t] == NONE && seen[t] != c) {
+						seen[t] = c;
+						frontier.push_back(t);
+					}
+				}
+			}
+			float len = glm::length(normalSum);
+			glm::vec3 axis = len > 0.0f ? normalSum / len : glm::vec3(0.0f);
+			glm::vec3 center = centroidSum / (float)members.size();
+			next = NONE;
+			float bestScore = 0.0f;
+			for(size_t j = 0; j < frontier.size(); ) {
+				unsigned int t = frontier[j];
+				if(owner[t] != NONE) {
+					frontier[j] = frontier.back();
+					frontier.pop_back();
+					continue;
+				}
+				float d = glm::dot(normals[t], axis);
+				float score = d - glm::length(centroids[t] - center) / clusterRadius;
+				if(d >= CLUSTER_MIN_NORMAL_DOT && (next == NONE || score > bestScore)) {
+					next = t;
+					bestScore = score;
+				}
+				++j;
+			}
+		}
+		
+		// Reorder the cluster's triangles for the vertex cache on their own,
+		// through a local vertex numbering
+		local.clear();
+		localToGlobal.clear();
+		for(size_t j = 0; j < members.size(); ++j) {
+			for(int k = 0; k < 3; ++k) {
+				unsigned int v = indices[3*members[j]+k];
+				if(localIndex[v] == NONE) {
+					localIndex[v] = (unsigned int)localToGlobal.size();
+					localToGlobal.push_back(v);
+				}
+				local.push_back(localIndex[v]);
+			}
+		}
+		optimizeVertexCache(local, localToGlobal.size());
+		Cluster cluster;
+		cluster.first = firstIndex + (unsigned int)result.size();
+		cluster.count = 3*(unsigned int)members.size();
+		glm::vec3 bmin = position(localToGlobal[0]), bmax = bmin;
+		for(size_t j = 0; j < local.size(); ++j) {
+			result.push_back(localToGlobal[local[j]]);
+		}
+		for(size_t j = 0; j < localToGlobal.size(); ++j) {
+			bmin = glm::min(bmin, position(localToGlobal[j]));
+			bmax = glm::max(bmax, position(localToGlobal[j]));
+			localIndex[localToGlobal[j]] = NONE;
+		}
+		glm::vec3 center = 0.5f*(bmin + bmax);
+		float radius = 0.0f;
+		for(size_t j = 0; j < localToGlobal.size(); ++j) {
+			radius = max(radius, glm::length(position(localToGlobal[j]) - center));
+		}
+		float len = glm::length(normalSum);
+		glm::vec3 axis = len > 0.0f ? normalSum / len : glm::vec3(0.0f, 0.0f, 1.0f);
+		float minDot = len > 0.0f ? 1.0f : -1.0f;
+		for(size_t j = 0; j < members.size(); ++j) {
+			if(glm::dot(normals[members[j]], normals[members[j]]) > 0.0f) {
+				minDot = min(minDot, glm::dot(normals[members[j]], axis));
+			}
+		}
+		for(int k = 0; k < 3; ++k) {
+			cluster.center[k] = center[k];
+			cluster.coneAxis[k] = axis[k];
+		}
+		cluster.radius = radius;
+		cluster.coneCutoff = minDot > 0.0f ? sqrt(1.0f - minDot*minDot) : 1.0f;
+		clusters.push_back(cluster);
+	}
+	indices.swap(result);
+	return clusters;
+}
+
+vector<unsigned int> optimizeVertexFetch(vector<unsigned int> &indices, size_t nverts)
+{
+	const unsigned int UNUSED = ~0u;
+	vector<unsigned int> remap(nverts, UNUSED);
+	unsigned int next = 0;
+	for(size_t i = 0; i < indices.size(); ++i) {
+		unsigned int &v = indices[i];
+		if(remap[v] == UNUSED) {
+			remap[v] = next++;
+		}
+		v = remap[v];
+	}
+	for(size_t v = 0; v < nverts; ++v) {
+		if(remap[v] == UNUSED) {
+			remap[v] = next++;
+		}
+	}
+	return remap;
+}
+
+void remapVertices(vector<float> &attribs, const vector<unsigned int> &remap, int ncomps)
+{
+	if(attribs.empty()) {
+		return;
+	}
+	vector<float> result(attribs.size());
+	for(size_t v = 0; v < remap.size(); ++v) {
+		for(int k = 0; k < ncomps; ++k) {
+			result[ncomps*remap[v] + k] = attribs[ncomps*v + k];
+		}
+	}
+	attribs.swap(result);
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Reordering passes for indexed triangle meshes, run once when a mesh is
+ * loaded. The usual order is optimizeVertexCache(), optimizeOverdraw(),
+ * buildClusters(), and finally optimizeVertexFetch().
+ */
+namespace MeshOptimizer {
+
+	// A contiguous range of triangles with bounds for culling
+	struct Cluster {
+		unsigned int first; // first index
+		unsigned int count; // number of indices
+		float center[3];    // bounding sphere
+		float radius;
+		float coneAxis[3];  // average normal
+		float coneCutoff;   // sine of the normal cone's half angle; 1 if it cannot be culled
+	};
+
+	// Post-transform cache statistics from a FIFO cache simulation
+	struct CacheStats {
+		float acmr; // average cache misses per triangle (0.5 is ideal)
+		float atvr; // average transformed vertices per vertex (1.0 is ideal)
+	};
+	
+	CacheStats analyzeVertexCache(const std::vector<unsigned int> &indices, size_t nverts, int cacheSize = 16);
+	
+	// Reorders triangles for post-transform cache locality (Forsyth).
+	void optimizeVertexCache(std::vector<unsigned int> &indices, size_t nverts);
+	
+	// Splits the cache-optimized triangle list into clusters and sorts them so
+	// that outward-facing clusters are drawn first (Sander et al.). threshold
+	// is the ACMR increase allowed for finer clusters, e.g. 1.05.
+	void optimizeOverdraw(std::vector<unsigned int> &indices, const std::vector<float> &positions, float threshold = 1.05f);
+	
+	// Groups neighboring triangles with similar normals into clusters of at
+	// most maxTriangles for culling. The clusters keep the order of their
+	// first triangle, and each one is reordered for the vertex cache. Index
+	// offsets in the returned clusters start at firstIndex.
+	std::vector<Cluster> buildClusters(std::vector<unsigned int> &indices, const std::vector<float> &positions, unsigned int firstIndex = 0, size_t maxTriangles = 128);
+	
+	// Renumbers vertices in order of first use. Returns the remap table
+	// (old index -> new index); unreferenced vertices are moved to the end.
+	std::vector<unsigned int> optimizeVertexFetch(std::vector<unsigned int> &indices, size_t nverts);
+	
+	// Applies a remap table from optimizeVertexFetch() to an attribute array
+	// with the given number of components per vertex.
+	void remapVertices(std::vector<float> &attribs, const std::vector<unsigned int> &remap, int ncomps);
+}
+
+#endif
@@ -0,0 +1,360 @@
+#include "MeshSimplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+using namespace std;
+
+namespace MeshSimplifier {
+
+namespace {
+
+// Weight of the planes that keep open borders in place, relative to the
+// triangle planes
+const float BORDER_WEIGHT = 10.0f;
+
+// A collapse is rejected if it rotates a triangle normal by more than this
+// (cosine of the angle)
+const float MAX_NORMAL_CHANGE = 0.25f;
+
+// Symmetric 4x4 error quadric, plus the total weight of the planes
+struct Quadric {
+	double a2, ab, ac, ad;
+	double b2, bc, bd;
+	double c2, cd;
+	double d2;
+	double w;
+};
+
+Quadric planeQuadric(const glm::vec3 &n, float d, float w)
+{
+	Quadric q;
+	q.a2 = w*n.x*n.x; q.ab = w*n.x*n.y; q.ac = w*n.x*n.z; q.ad = w*n.x*d;
+	q.b2 = w*n.y*n.y; q.bc = w*n.y*n.z; q.bd = w*n.y*d;
+	q.c2 = w*n.z*n.z; q.cd = w*n.z*d;
+	q.d2 = w*d*d;
+	q.w = w;
+	return q;
+}
+
+void addQuadric(Quadric &q, const Quadric &r)
+{
+	q.a2 += r.a2; q.ab += r.ab; q.ac += r.ac; q.ad += r.ad;
+	q.b2 += r.b2; q.bc += r.bc; q.bd += r.bd;
+	q.c2 += r.c2; q.cd += r.cd;
+	q.d2 += r.d2;
+	q.w += r.w;
+}
+
+// Weighted mean squared distance from p to the planes of q
+double evalQuadric(const Quadric &q, const glm::vec3 &p)
+{
+	double x = p.x, y = p.y, z = p.z;
+	double e = q.a2*x*x + 2.0*q.ab*x*y + 2.0*q.ac*x*z + 2.0*q.ad*x
+	         + q.b2*y*y + 2.0*q.bc*y*z + 2.0*q.bd*y
+	         + q.c2*z*z + 2.0*q.cd*z
+	         + q.d2;
+	return q.w > 0.0 ? fabs(e)/q.w : 0.0;
+}
+
+struct Collapse {
+	unsigned int from;
+	unsigned int to;
+	double cost;
+};
+
+uint64_t edgeKey(unsigned int a, unsigned int b)
+{
+	return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+}
+
+}
+
+float simplify(vector<unsigned int> &indices, const vector<float> &positions, size_t targetCount)
+{
+	size_t nverts = positions.size()/3;
+	if(indices.size() <= targetCount || nverts == 0) {
+		return 0.0f;
+	}
+
+	// Vertices that differ only in their normals or texcoords share one
+	// position vertex ("wedges"). The topology and the error are tracked on
+	// position vertices; the index list keeps pointing at wedges.
+	struct PosHash {
+		size_t operator()(const glm::vec3 &p) const {
+			unsigned int h[3];
+			memcpy(h, &p, sizeof(h));
+			return (size_t)h[0]*73856093u ^ (size_t)h[1]*19349663u ^ (size_t)h[2]*83492791u;
+		}
+	};
+	vector<glm::vec3> pos(nverts);
+	vector<unsigned int> wedgeOf(nverts);
+	unordered_map<glm::vec3, unsigned int, PosHash> unique;
+	unique.reserve(nverts);
+	for(size_t v = 0; v < nverts; ++v) {
+		pos[v] = glm::vec3(positions[3*v], positions[3*v+1], positions[3*v+2]);
+		wedgeOf[v] = unique.emplace(pos[v], (unsigned int)v).first->second;
+	}
+
+	// Drop triangles that are already degenerate
+	vector<unsigned int> tris;
+	tris.reserve(indices.size());
+	for(size_t i = 0; i + 2 < indices.size(); i += 3) {
+		unsigned int a = wedgeOf[indices[i]], b = wedgeOf[indices[i+1]], c = wedgeOf[indices[i+2]];
+		if(a != b && b != c && c != a) {
+			tris.insert(tris.end(), &indices[i], &indices[i] + 3);
+		}
+	}
+
+	// Area-weighted triangle planes, plus planes perpendicular to open
+	// borders so that the outline of the mesh stays put
+	vector<Quadric> quadrics(nverts);
+	memset(quadrics.data(), 0, quadrics.size()*sizeof(Quadric));
+	unordered_map<uint64_t, int> edgeCount;
+	edgeCount.reserve(tris.size());
+	for(size_t i = 0; i < tris.size(); i += 3) {
+		for(int k = 0; k < 3; ++k) {
+			++edgeCount[edgeKey(wedgeOf[tris[i+k]], wedgeOf[tris[i+(k+1)%3]])];
+		}
+	}
+	for(size_t i = 0; i < tris.size(); i += 3) {
+		unsigned int v[3] = { wedgeOf[tris[i]], wedgeOf[tris[i+1]], wedgeOf[tris[i+2]] };
+		glm::vec3 n = glm::cross(pos[v[1]] - pos[v[0]], pos[v[2]] - pos[v[0]]);
+		float len = glm::length(n);
+		if(len == 0.0f) {
+			continue;
+		}
+		n /= len;
+		Quadric q = planeQuadric(n, -glm::dot(n, pos[v[0]]), 0.5f*len);
+		for(int k = 0; k < 3; ++k) {
+			addQuadric(quadrics[v[k]], q);
+			unsigned int p0 = v[k], p1 = v[(k+1)%3];
+			if(edgeCount[edgeKey(p0, p1)] == 1) {
+				glm::vec3 e = pos[p1] - pos[p0];
+				glm::vec3 en = glm::cross(e, n);
+				float elen = glm::length(en);
+				if(elen > 0.0f) {
+					en /= elen;
+					Quadric qb = planeQuadric(en, -glm::dot(en, pos[p0]), BORDER_WEIGHT*glm::dot(e, e));
+					addQuadric(quadrics[p0], qb);
+					addQuadric(quadrics[p1], qb);
+				}
+			}
+		}
+	}
+
+	size_t targetTris = targetCount/3;
+	size_t ntris = tris.size()/3;
+	double maxError = 0.0;
+	vector<unsigned int> adjOffset(nverts + 1);
+	vector<unsigned int> adj;
+	vector<char> locked(nverts);
+	vector<char> dead;
+	vector<Collapse> collapses;
+	vector<pair<unsigned int, int> > neighbors, neighborsB;
+	vector<pair<unsigned int, unsigned int> > wedgeMap;
+	while(ntris > targetTris) {
+		// Triangles around each position vertex
+		fill(adjOffset.begin(), adjOffset.end(), 0);
+		for(size_t i = 0; i < tris.size(); ++i) {
+			++adjOffset[wedgeOf[tris[i]] + 1];
+		}
+		for(size_t v = 0; v < nverts; ++v) {
+			adjOffset[v+1] += adjOffset[v];
+		}
+		adj.resize(tris.size());
+		vector<unsigned int> fillPos(adjOffset.begin(), adjOffset.end() - 1);
+		for(size_t i = 0; i < tris.size(); ++i) {
+			adj[fillPos[wedgeOf[tris[i]]]++] = (unsigned int)(i/3);
+		}
+
+		// Rank every edge in both directions by the error of moving one
+		// endpoint onto the other
+		collapses.clear();
+		for(size_t i = 0; i < tris.size(); i += 3) {
+			for(int k = 0; k < 3; ++k) {
+				unsigned int p = wedgeOf[tris[i+k]], q = wedgeOf[tris[i+(k+1)%3]];
+				Quadric pq = quadrics[p];
+				addQuadric(pq, quadrics[q]);
+				collapses.push_back({ p, q, evalQuadric(pq, pos[q]) });
+				collapses.push_back({ q, p, evalQuadric(pq, pos[p]) });
+			}
+		}
+		sort(collapses.begin(), collapses.end(), [](const Collapse &x, const Collapse &y) {
+			return x.cost < y.cost;
+		});
+
+		// Apply the cheapest collapses whose neighborhoods do not overlap
+		fill(locked.begin(), locked.end(), 0);
+		dead.assign(tris.size()/3, 0);
+		size_t applied = 0;
+		for(size_t c = 0; c < collapses.size() && ntris > targetTris; ++c) {
+			unsigned int a = collapses[c].from, b = collapses[c].to;
+			if(locked[a] || locked[b]) {
+				continue;
+			}
+
+			// Count how many triangles around a share each neighbor. Every
+			// edge of a manifold has one or two triangles.
+			neighbors.clear();
+			for(unsigned int j = adjOffset[a]; j < adjOffset[a+1]; ++j) {
+				const unsigned int *t = &tris[3*adj[j]];
+				for(int k = 0; k < 3; ++k) {
+					unsigned int n = wedgeOf[t[k]];
+					if(n == a) {
+						continue;
+					}
+					auto it = find_if(neighbors.begin(), neighbors.end(), [n](const pair<unsigned int, int> &e) { return e.first == n; });
+					if(it == neighbors.end()) {
+						neighbors.push_back(make_pair(n, 1));
+					} else {
+						++it->second;
+					}
+				}
+			}
+			bool manifold = true, border = false;
+			int abCount = 0;
+			for(size_t j = 0; j < neighbors.size(); ++j) {
+				manifold = manifold && neighbors[j].second <= 2;
+				border = border || neighbors[j].second == 1;
+				if(neighbors[j].first == b) {
+					abCount = neighbors[j].second;
+				}
+			}
+			// Border vertices may only slide along the border
+			if(!manifold || (border && abCount != 1)) {
+				continue;
+			}
+
+			// Link condition: a and b may only share the vertices opposite
+			// their common edge, or the collapse would pinch the surface
+			neighborsB.clear();
+			for(unsigned int j = adjOffset[b]; j < adjOffset[b+1]; ++j) {
+				const unsigned int *t = &tris[3*adj[j]];
+				for(int k = 0; k < 3; ++k) {
+					neighborsB.push_back(make_pair(wedgeOf[t[k]], 0));
+				}
+			}
+			int shared = 0;
+			for(size_t j = 0; j < neighbors.size(); ++j) {
+				unsigned int n = neighbors[j].first;
+				if(n != b && find_if(neighborsB.begin(), neighborsB.end(), [n](const pair<unsigned int, int> &e) { return e.first == n; }) != neighborsB.end()) {
+					++shared;
+				}
+			}
+			if(shared != abCount) {
+				continue;
+			}
+
+			// Each wedge of a must turn into the wedge of b next to it. This
+			// fails when a has a seam that does not run along the edge.
+			wedgeMap.clear();
+			bool mapped = true;
+			for(unsigned int j = adjOffset[a]; j < adjOffset[a+1] && mapped; ++j) {
+				const unsigned int *t = &tris[3*adj[j]];
+				unsigned int wa = 0, wb = 0;
+				bool hasB = false;
+				for(int k = 0; k < 3; ++k) {
+					if(wedgeOf[t[k]] == a) {
+						wa = t[k];
+					} else if(wedgeOf[t[k]] == b) {
+						wb = t[k];
+						hasB = true;
+					}
+				}
+				if(!hasB) {
+					continue;
+				}
+				auto it = find_if(wedgeMap.begin(), wedgeMap.end(), [wa](const pair<unsigned int, unsigned int> &e) { return e.first == wa; });
+				if(it == wedgeMap.end()) {
+					wedgeMap.push_back(make_pair(wa, wb));
+				} else if(it->second != wb) {
+					mapped = false;
+				}
+			}
+
+			// Reject collapses that flip or badly rotate a triangle
+			for(unsigned int j = adjOffset[a]; j < adjOffset[a+1] && mapped; ++j) {
+				const unsigned int *t = &tris[3*adj[j]];
+				glm::vec3 p[3], q[3];
+				bool hasB = false;
+				unsigned int wa = 0;
+				for(int k = 0; k < 3; ++k) {
+					unsigned int w = wedgeOf[t[k]];
+					p[k] = pos[w];
+					q[k] = w == a ? pos[b] : pos[w];
+					hasB = hasB || w == b;
+					if(w == a) {
+						wa = t[k];
+					}
+				}
+				if(find_if(wedgeMap.begin(), wedgeMap.end(), [wa](const pair<unsigned int, unsigned int> &e) { return e.first == wa; }) == wedgeMap.end()) {
+					mapped = false;
+					break;
+				}
+				if(hasB) {
+					continue;
+				}
+				glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+				glm::vec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+				float l0 = glm::length(n0), l1 = glm::length(n1);
+				if(l1 == 0.0f || glm::dot(n0, n1) < MAX_NORMAL_CHANGE*l0*l1) {
+					mapped = false;
+				}
+			}
+			if(!mapped) {
+				continue;
+			}
+
+			// Collapse a onto b
+			for(unsigned int j = adjOffset[a]; j < adjOffset[a+1]; ++j) {
+				unsigned int ti = adj[j];
+				unsigned int *t = &tris[3*ti];
+				bool hasB = false;
+				for(int k = 0; k < 3; ++k) {
+					if(wedgeOf[t[k]] == a) {
+						unsigned int wa = t[k];
+						t[k] = find_if(wedgeMap.begin(), wedgeMap.end(), [wa](const pair<unsigned int, unsigned int> &e) { return e.first == wa; })->second;
+					} else if(wedgeOf[t[k]] == b) {
+						hasB = true;
+					}
+				}
+				if(hasB) {
+					dead[ti] = 1;
+					--ntris;
+				}
+			}
+			addQuadric(quadrics[b], quadrics[a]);
+			maxError = max(maxError, collapses[c].cost);
+			locked[a] = locked[b] = 1;
+			for(size_t j = 0; j < neighbors.size(); ++j) {
+				locked[neighbors[j].first] = 1;
+			}
+			++applied;
+		}
+		if(applied == 0) {
+			break;
+		}
+
+		// Remove the triangles that collapsed
+		size_t kept = 0;
+		for(size_t i = 0; i < dead.size(); ++i) {
+			if(!dead[i]) {
+				memmove(&tris[3*kept], &tris[3*i], 3*sizeof(unsigned int));
+				++kept;
+			}
+		}
+		tris.resize(3*kept);
+	}
+	indices.swap(tris);
+	return (float)sqrt(maxError);
+}
+
+}
@@ -0,0 +1,23 @@
+#pragma once
+#ifndef MESHSIMPLIFIER_H
+#define MESHSIMPLIFIER_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Quadric error edge-collapse simplification (Garland and Heckbert) for
+ * welded, indexed triangle meshes. Edges are collapsed onto one of their
+ * existing vertices, so the vertex arrays are shared by every level of detail
+ * and only the index list changes. Open borders, attribute seams, and
+ * non-manifold vertices are preserved.
+ */
+namespace MeshSimplifier {
+
+	// Collapses edges until at most targetCount indices are left or no more
+	// collapses are allowed. positions has 3 floats per vertex. Returns the
+	// geometric error of the result, in the same units as positions.
+	float simplify(std::vector<unsigned int> &indices, const std::vector<float> &positions, size_t targetCount);
+}
+
+#endif
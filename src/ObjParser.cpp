@@ -0,0 +1,375 @@
+#include "ObjParser.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <thread>
+
+#include "MappedFile.h"
+
+using namespace std;
+
+namespace {
+
+// Chunks smaller than this are not worth a thread of their own.
+const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+// Bits in Chunk::Relative::mask
+const unsigned REL_V = 1;
+const unsigned REL_VT = 2;
+const unsigned REL_VN = 4;
+
+struct Chunk {
+	const char *begin;
+	const char *end;
+	vector<float> vertices;
+	vector<float> normals;
+	vector<float> texcoords;
+	vector<ObjParser::Index> indices;
+	// Corners with negative indices, which are relative to the number of
+	// attributes defined so far and can only be resolved once the counts in
+	// the preceding chunks are known.
+	struct Relative {
+		size_t corner;
+		unsigned mask;
+	};
+	vector<Relative> relatives;
+};
+
+inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+inline const char *skipSpace(const char *p, const char *end)
+{
+	while(p < end && isSpace(*p)) {
+		++p;
+	}
+	return p;
+}
+
+inline bool isDigit(char c)
+{
+	return (unsigned)(c - '0') < 10;
+}
+
+// Parses a decimal float. Up to 19 significant digits with a small exponent
+// are converted exactly in double precision and rounded to float; anything
+// else falls back to strtod.
+const char *parseFloat(const char *p, const char *end, float &value)
+{
+	static const double POW10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *start = p;
+	bool negative = false;
+	if(p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+	uint64_t mantissa = 0;
+	int ndigits = 0;
+	int exponent = 0;
+	while(p < end && isDigit(*p)) {
+		if(ndigits < 19) {
+			mantissa = mantissa*10 + (uint64_t)(*p - '0');
+			if(mantissa != 0) {
+				++ndigits;
+			}
+		} else {
+			++exponent;
+		}
+		++p;
+	}
+	if(p < end && *p == '.') {
+		++p;
+		while(p < end && isDigit(*p)) {
+			if(ndigits < 19) {
+				mantissa = mantissa*10 + (uint64_t)(*p - '0');
+				if(mantissa != 0) {
+					++ndigits;
+				}
+				--exponent;
+			}
+			++p;
+		}
+	}
+	bool exact = ndigits < 19 && mantissa <= (1ull << 53);
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool expNegative = false;
+		if(q < end && (*q == '-' || *q == '+')) {
+			expNegative = *q == '-';
+			++q;
+		}
+		if(q < end && isDigit(*q)) {
+			int e = 0;
+			while(q < end && isDigit(*q)) {
+				e = min(e*10 + (*q - '0'), 10000);
+				++q;
+			}
+			exponent += expNegative ? -e : e;
+			p = q;
+		}
+	}
+	if(p == start) {
+		value = 0.0f;
+		return p;
+	}
+	if(!exact || exponent < -22 || exponent > 22) {
+		// Rare: copy the token so strtod cannot read past the mapping
+		char buf[64];
+		size_t n = min((size_t)(p - start), sizeof(buf) - 1);
+		memcpy(buf, start, n);
+		buf[n] = '\0';
+		value = (float)strtod(buf, NULL);
+		return p;
+	}
+	double d = (double)mantissa;
+	d = exponent < 0 ? d / POW10[-exponent] : d * POW10[exponent];
+	value = (float)(negative ? -d : d);
+	return p;
+}
+
+inline const char *parseInt(const char *p, const char *end, int &value)
+{
+	bool negative = false;
+	if(p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+	int v = 0;
+	while(p < end && isDigit(*p)) {
+		v = v*10 + (*p - '0');
+		++p;
+	}
+	value = negative ? -v : v;
+	return p;
+}
+
+// Converts a 1-based OBJ index to 0-based. Negative indices are returned
+// relative to the chunk and flagged so they can be rebased when merging.
+inline int fixIndex(int idx, size_t localCount, unsigned bit, unsigned &mask)
+{
+	if(idx > 0) {
+		return idx - 1;
+	}
+	if(idx == 0) {
+		return 0;
+	}
+	mask |= bit;
+	return (int)localCount + idx;
+}
+
+const char *parseCorner(const char *p, const char *end, const Chunk &chunk, ObjParser::Index &idx, unsigned &mask)
+{
+	int i;
+	idx.v = idx.vt = idx.vn = -1;
+	p = parseInt(p, end, i);
+	idx.v = fixIndex(i, chunk.vertices.size()/3, REL_V, mask);
+	if(p >= end || *p != '/') {
+		return p;
+	}
+	++p;
+	if(p < end && *p != '/') {
+		p = parseInt(p, end, i);
+		idx.vt = fixIndex(i, chunk.texcoords.size()/2, REL_VT, mask);
+	}
+	if(p >= end || *p != '/') {
+		return p;
+	}
+	++p;
+	p = parseInt(p, end, i);
+	idx.vn = fixIndex(i, chunk.normals.size()/3, REL_VN, mask);
+	return p;
+}
+
+const char *parseFloats(const char *p, const char *end, vector<float> &out, int count)
+{
+	for(int k = 0; k < count; ++k) {
+		float f = 0.0f;
+		p = skipSpace(p, end);
+		p = parseFloat(p, end, f);
+		out.push_back(f);
+	}
+	return p;
+}
+
+void parseChunk(Chunk &chunk)
+{
+	vector<ObjParser::Index> face;
+	vector<unsigned> faceMasks;
+	const char *p = chunk.begin;
+	const char *end = chunk.end;
+	while(p < end) {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if(eol == NULL) {
+			eol = end;
+		}
+		const char *q = skipSpace(p, eol);
+		if(q + 1 < eol && q[0] == 'v' && isSpace(q[1])) {
+			parseFloats(q + 2, eol, chunk.vertices, 3);
+		} else if(q + 2 < eol && q[0] == 'v' && q[1] == 'n' && isSpace(q[2])) {
+			parseFloats(q + 3, eol, chunk.normals, 3);
+		} else if(q + 2 < eol && q[0] == 'v' && q[1] == 't' && isSpace(q[2])) {
+			parseFloats(q + 3, eol, chunk.texcoords, 2);
+		} else if(q + 1 < eol && q[0] == 'f' && isSpace(q[1])) {
+			face.clear();
+			faceMasks.clear();
+			q += 2;
+			for(;;) {
+				q = skipSpace(q, eol);
+				if(q >= eol || *q == '\r' || *q == '#') {
+					break;
+				}
+				ObjParser::Index idx;
+				unsigned mask = 0;
+				const char *next = parseCorner(q, eol, chunk, idx, mask);
+				if(next == q) {
+					break;
+				}
+				face.push_back(idx);
+				faceMasks.push_back(mask);
+				// Skip anything left of the token
+				q = next;
+				while(q < eol && !isSpace(*q) && *q != '\r') {
+					++q;
+				}
+			}
+			// Polygon -> triangle fan conversion
+			for(size_t k = 2; k < face.size(); ++k) {
+				size_t corners[3] = { 0, k - 1, k };
+				for(int c = 0; c < 3; ++c) {
+					unsigned mask = faceMasks[corners[c]];
+					if(mask) {
+						chunk.relatives.push_back({ chunk.indices.size(), mask });
+					}
+					chunk.indices.push_back(face[corners[c]]);
+				}
+			}
+		}
+		p = eol + 1;
+	}
+}
+
+// Copies a chunk into its place in the merged arrays and rebases its
+// relative indices.
+void mergeChunk(const Chunk &chunk, ObjParser::Index *indices, float *vertices, float *normals, float *texcoords, int vbase, int vtbase, int vnbase)
+{
+	if(!chunk.vertices.empty()) {
+		memcpy(vertices, chunk.vertices.data(), chunk.vertices.size()*sizeof(float));
+	}
+	if(!chunk.normals.empty()) {
+		memcpy(normals, chunk.normals.data(), chunk.normals.size()*sizeof(float));
+	}
+	if(!chunk.texcoords.empty()) {
+		memcpy(texcoords, chunk.texcoords.data(), chunk.texcoords.size()*sizeof(float));
+	}
+	if(!chunk.indices.empty()) {
+		memcpy(indices, chunk.indices.data(), chunk.indices.size()*sizeof(ObjParser::Index));
+	}
+	for(size_t i = 0; i < chunk.relatives.size(); ++i) {
+		ObjParser::Index &idx = indices[chunk.relatives[i].corner];
+		unsigned mask = chunk.relatives[i].mask;
+		if(mask & REL_V) {
+			idx.v += vbase;
+		}
+		if(mask & REL_VT) {
+			idx.vt += vtbase;
+		}
+		if(mask & REL_VN) {
+			idx.vn += vnbase;
+		}
+	}
+}
+
+}
+
+ObjParser::ObjParser()
+{
+}
+
+ObjParser::~ObjParser()
+{
+}
+
+bool ObjParser::parse(const string &fileName, string &errStr, int nthreads)
+{
+	vertices.clear();
+	normals.clear();
+	texcoords.clear();
+	indices.clear();
+	
+	MappedFile file;
+	if(!file.open(fileName)) {
+		errStr = "Cannot open file [" + fileName + "]";
+		return false;
+	}
+	const char *data = file.data();
+	const char *dataEnd = data + file.size();
+	
+	// Split the file into line-aligned chunks
+	if(nthreads <= 0) {
+		nthreads = max(1, (int)thread::hardware_concurrency());
+	}
+	size_t nchunks = min((size_t)nthreads, max((size_t)1, file.size()/MIN_CHUNK_SIZE));
+	vector<Chunk> chunks(nchunks);
+	const char *p = data;
+	for(size_t c = 0; c < nchunks; ++c) {
+		const char *end = data + (c + 1)*(file.size()/nchunks);
+		if(c + 1 == nchunks) {
+			end = dataEnd;
+		} else {
+			const char *eol = (const char *)memchr(end, '\n', dataEnd - end);
+			end = eol ? eol + 1 : dataEnd;
+		}
+		chunks[c].begin = p;
+		chunks[c].end = max(p, end);
+		p = chunks[c].end;
+	}
+	
+	// Parse the chunks in parallel
+	vector<thread> workers;
+	for(size_t c = 1; c < nchunks; ++c) {
+		workers.emplace_back(parseChunk, ref(chunks[c]));
+	}
+	parseChunk(chunks[0]);
+	for(size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+	workers.clear();
+	
+	// Merge the chunks in file order
+	vector<size_t> vOffset(nchunks), vnOffset(nchunks), vtOffset(nchunks), iOffset(nchunks);
+	size_t nv = 0, nvn = 0, nvt = 0, ni = 0;
+	for(size_t c = 0; c < nchunks; ++c) {
+		vOffset[c] = nv;
+		vnOffset[c] = nvn;
+		vtOffset[c] = nvt;
+		iOffset[c] = ni;
+		nv += chunks[c].vertices.size();
+		nvn += chunks[c].normals.size();
+		nvt += chunks[c].texcoords.size();
+		ni += chunks[c].indices.size();
+	}
+	vertices.resize(nv);
+	normals.resize(nvn);
+	texcoords.resize(nvt);
+	indices.resize(ni);
+	for(size_t c = 0; c < nchunks; ++c) {
+		workers.emplace_back(mergeChunk, cref(chunks[c]), indices.data() + iOffset[c],
+			vertices.data() + vOffset[c], normals.data() + vnOffset[c], texcoords.data() + vtOffset[c],
+			(int)(vOffset[c]/3), (int)(vtOffset[c]/2), (int)(vnOffset[c]/3));
+	}
+	for(size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+	
+	if(vertices.empty()) {
+		errStr = "No vertices in [" + fileName + "]";
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#ifndef OBJPARSER_H
+#define OBJPARSER_H
+
+#include <string>
+#include <vector>
+
+/**
+ * A multithreaded parser for the geometry in an OBJ file. The file is
+ * memory-mapped and split into line-aligned chunks that are parsed in
+ * parallel, then merged in file order. Only v, vn, vt, and f records are
+ * read. Polygons are triangulated as fans and negative (relative) indices are
+ * resolved, both the same way tiny_obj_loader does.
+ */
+class ObjParser
+{
+public:
+	// A face corner. Indices are 0-based, or -1 if the attribute is missing.
+	struct Index {
+		int v;
+		int vt;
+		int vn;
+	};
+	
+	ObjParser();
+	virtual ~ObjParser();
+	
+	// nthreads <= 0 picks the number of hardware threads.
+	bool parse(const std::string &fileName, std::string &errStr, int nthreads = 0);
+	
+	const std::vector<float> &getVertices() const { return vertices; }   // 3 floats per position
+	const std::vector<float> &getNormals() const { return normals; }     // 3 floats per normal
+	const std::vector<float> &getTexcoords() const { return texcoords; } // 2 floats per texcoord
+	const std::vector<Index> &getIndices() const { return indices; }     // 3 corners per triangle
+	
+private:
+	std::vector<float> vertices;
+	std::vector<float> normals;
+	std::vector<float> texcoords;
+	std::vector<Index> indices;
+};
+
+#endif
@@ -0,0 +1,245 @@
+#include "OffsetAllocator.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+namespace {
+
+const unsigned NONE = ~0u;
+const unsigned MANTISSA_BITS = 3;
+const unsigned MANTISSA_VALUE = 1 << MANTISSA_BITS;
+const unsigned MANTISSA_MASK = MANTISSA_VALUE - 1;
+
+unsigned highestBit(unsigned x)
+{
+	unsigned bit = 0;
+	while(x >>= 1) {
+		++bit;
+	}
+	return bit;
+}
+
+unsigned lowestBit(unsigned x)
+{
+	unsigned bit = 0;
+	while(!(x & 1)) {
+		x >>= 1;
+		++bit;
+	}
+	return bit;
+}
+
+// Index of the lowest set bit of mask at or above start, or NONE
+unsigned lowestBitFrom(unsigned mask, unsigned start)
+{
+	if(start >= 32) {
+		return NONE;
+	}
+	mask &= ~0u << start;
+	return mask ? lowestBit(mask) : NONE;
+}
+
+// Size class of a block: a float with a 3-bit mantissa and no sign. Sizes
+// below 8 map to themselves. Rounding down is used for free blocks, so that
+// every block in a class is at least as large as the class; rounding up is
+// used for requests, so that any block in the class fits.
+unsigned sizeToBin(unsigned size, bool roundUp)
+{
+	if(size < MANTISSA_VALUE) {
+		return size;
+	}
+	unsigned mantissaStart = highestBit(size) - MANTISSA_BITS;
+	unsigned exponent = mantissaStart + 1;
+	unsigned mantissa = (size >> mantissaStart) & MANTISSA_MASK;
+	if(roundUp && (size & ((1u << mantissaStart) - 1))) {
+		// May carry into the exponent, which is still the right class
+		++mantissa;
+	}
+	return (exponent << MANTISSA_BITS) + mantissa;
+}
+
+}
+
+OffsetAllocator::OffsetAllocator(unsigned size)
+{
+	reset(size);
+}
+
+OffsetAllocator::~OffsetAllocator()
+{
+}
+
+void OffsetAllocator::reset(unsigned size)
+{
+	this->size = size;
+	used = 0;
+	allocationCount = 0;
+	freeBlockCount = 0;
+	usedBinsTop = 0;
+	for(int i = 0; i < 32; ++i) {
+		usedBins[i] = 0;
+	}
+	for(int i = 0; i < 256; ++i) {
+		binHeads[i] = NONE;
+	}
+	nodes.clear();
+	freeNodes.clear();
+	if(size > 0) {
+		insertFree(newNode(0, size));
+	}
+}
+
+unsigned OffsetAllocator::newNode(unsigned offset, unsigned size)
+{
+	unsigned n;
+	if(freeNodes.empty()) {
+		n = (unsigned)nodes.size();
+		nodes.push_back(Node());
+	} else {
+		n = freeNodes.back();
+		freeNodes.pop_back();
+	}
+	Node &node = nodes[n];
+	node.offset = offset;
+	node.size = size;
+	node.binPrev = NONE;
+	node.binNext = NONE;
+	node.neighborPrev = NONE;
+	node.neighborNext = NONE;
+	node.used = false;
+	return n;
+}
+
+void OffsetAllocator::insertFree(unsigned n)
+{
+	Node &node = nodes[n];
+	unsigned bin = sizeToBin(node.size, false);
+	node.used = false;
+	node.binPrev = NONE;
+	node.binNext = binHeads[bin];
+	if(node.binNext != NONE) {
+		nodes[node.binNext].binPrev = n;
+	}
+	binHeads[bin] = n;
+	usedBins[bin >> MANTISSA_BITS] |= 1 << (bin & MANTISSA_MASK);
+	usedBinsTop |= 1u << (bin >> MANTISSA_BITS);
+	freeBlockCount++;
+}
+
+void OffsetAllocator::removeFree(unsigned n)
+{
+	Node &node = nodes[n];
+	if(node.binPrev != NONE) {
+		nodes[node.binPrev].binNext = node.binNext;
+	} else {
+		// Head of its bin; clear the bin's bits when it empties
+		unsigned bin = sizeToBin(node.size, false);
+		binHeads[bin] = node.binNext;
+		if(node.binNext == NONE) {
+			usedBins[bin >> MANTISSA_BITS] &= ~(1 << (bin & MANTISSA_MASK));
+			if(usedBins[bin >> MANTISSA_BITS] == 0) {
+				usedBinsTop &= ~(1u << (bin >> MANTISSA_BITS));
+			}
+		}
+	}
+	if(node.binNext != NONE) {
+		nodes[node.binNext].binPrev = node.binPrev;
+	}
+	freeBlockCount--;
+}
+
+bool OffsetAllocator::allocate(unsigned request, Allocation &a)
+{
+	if(request == 0 || request > size - used) {
+		return false;
+	}
+	// Smallest non-empty bin whose blocks all fit the request: first within
+	// the request's top-level bin, then in the next non-empty top-level bin
+	unsigned minBin = sizeToBin(request, true);
+	unsigned top = minBin >> MANTISSA_BITS;
+	unsigned leaf = NONE;
+	if(top < 32 && (usedBinsTop & (1u << top))) {
+		leaf = lowestBitFrom(usedBins[top], minBin & MANTISSA_MASK);
+	}
+	if(leaf == NONE) {
+		top = lowestBitFrom(usedBinsTop, top + 1);
+		if(top == NONE) {
+			return false;
+		}
+		leaf = lowestBit(usedBins[top]);
+	}
+	unsigned bin = (top << MANTISSA_BITS) | leaf;
+
+	unsigned n = binHeads[bin];
+	removeFree(n);
+	nodes[n].used = true;
+
+	// Return the rest of the block to the free lists
+	if(nodes[n].size > request) {
+		unsigned rest = newNode(nodes[n].offset + request, nodes[n].size - request);
+		Node &node = nodes[n];
+		node.size = request;
+		nodes[rest].neighborPrev = n;
+		nodes[rest].neighborNext = node.neighborNext;
+		if(node.neighborNext != NONE) {
+			nodes[node.neighborNext].neighborPrev = rest;
+		}
+		node.neighborNext = rest;
+		insertFree(rest);
+	}
+
+	used += request;
+	allocationCount++;
+	a.offset = nodes[n].offset;
+	a.node = n;
+	return true;
+}
+
+void OffsetAllocator::free(const Allocation &a)
+{
+	unsigned n = a.node;
+	assert(n < nodes.size() && nodes[n].used);
+	used -= nodes[n].size;
+	allocationCount--;
+
+	// Merge with the free blocks on either side
+	unsigned prev = nodes[n].neighborPrev;
+	if(prev != NONE && !nodes[prev].used) {
+		removeFree(prev);
+		nodes[prev].size += nodes[n].size;
+		nodes[prev].neighborNext = nodes[n].neighborNext;
+		if(nodes[n].neighborNext != NONE) {
+			nodes[nodes[n].neighborNext].neighborPrev = prev;
+		}
+		freeNodes.push_back(n);
+		n = prev;
+	}
+	unsigned next = nodes[n].neighborNext;
+	if(next != NONE && !nodes[next].used) {
+		removeFree(next);
+		nodes[n].size += nodes[next].size;
+		nodes[n].neighborNext = nodes[next].neighborNext;
+		if(nodes[next].neighborNext != NONE) {
+			nodes[nodes[next].neighborNext].neighborPrev = n;
+		}
+		freeNodes.push_back(next);
+	}
+	insertFree(n);
+}
+
+unsigned OffsetAllocator::getLargestFree() const
+{
+	// The largest block is in the highest non-empty bin
+	if(usedBinsTop == 0) {
+		return 0;
+	}
+	unsigned top = highestBit(usedBinsTop);
+	unsigned bin = (top << MANTISSA_BITS) | highestBit(usedBins[top]);
+	unsigned largest = 0;
+	for(unsigned n = binHeads[bin]; n != NONE; n = nodes[n].binNext) {
+		largest = max(largest, nodes[n].size);
+	}
+	return largest;
+}
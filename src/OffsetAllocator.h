@@ -0,0 +1,64 @@
+#pragma once
+#ifndef OFFSETALLOCATOR_H
+#define OFFSETALLOCATOR_H
+
+#include <vector>
+
+/**
+ * Two-level segregated fit (TLSF) allocator for ranges of a buffer that is
+ * stored elsewhere, such as a GPU buffer object. Sizes and offsets are in
+ * whatever unit the caller uses (vertices, indices, bytes), so every range is
+ * aligned to that unit. Free blocks are kept in 256 size classes spaced like
+ * a float with a 3-bit mantissa, found through a two-level bitmask, so
+ * allocate() and free() take constant time. Freed blocks are merged with free
+ * neighbors right away.
+ */
+class OffsetAllocator
+{
+public:
+	struct Allocation {
+		unsigned offset;
+		unsigned node; // for free()
+	};
+
+	OffsetAllocator(unsigned size = 0);
+	virtual ~OffsetAllocator();
+	// Frees everything and sets the total size
+	void reset(unsigned size);
+	// Returns false if there is no free block of at least size units
+	bool allocate(unsigned size, Allocation &a);
+	void free(const Allocation &a);
+
+	unsigned getSize() const { return size; }
+	unsigned getUsed() const { return used; }
+	unsigned getAllocationCount() const { return allocationCount; }
+	unsigned getFreeBlockCount() const { return freeBlockCount; }
+	unsigned getLargestFree() const;
+
+private:
+	struct Node {
+		unsigned offset;
+		unsigned size;
+		unsigned binPrev; // free blocks in the same size class
+		unsigned binNext;
+		unsigned neighborPrev; // blocks next to this one in the buffer
+		unsigned neighborNext;
+		bool used;
+	};
+
+	unsigned newNode(unsigned offset, unsigned size);
+	void insertFree(unsigned node);
+	void removeFree(unsigned node);
+
+	unsigned size;
+	unsigned used;
+	unsigned allocationCount;
+	unsigned freeBlockCount;
+	unsigned usedBinsTop; // bit i is set if usedBins[i] != 0
+	unsigned char usedBins[32]; // bit j of usedBins[i] is set if bin 8*i + j has blocks
+	unsigned binHeads[256];
+	std::vector<Node> nodes;
+	std::vector<unsigned> freeNodes; // unused entries of nodes
+};
+
+#endif
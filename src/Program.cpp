@@ -1,17 +1,91 @@
 #include "Program.h"
 
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <unordered_map>
 #include <cassert>
+#include <cstdlib>
 
 #include "GLSL.h"
+#include "GLState.h"
+#include "ProgramCache.h"
 
 using namespace std;
 
+namespace {
+
+// Uniform names by index, and indices by name hash
+struct UniformRegistry {
+	vector<string> names;
+	unordered_map<unsigned, unsigned> indices;
+	vector<bool> requested; // registered by a caller of Program::uniform()
+	vector<bool> active; // in at least one linked program
+};
+
+// Last Program::serial handed out
+unsigned lastSerial = 0;
+
+UniformRegistry &getRegistry()
+{
+	static UniformRegistry registry;
+	return registry;
+}
+
+// Appends the file to source, replacing each #include "name" line with the
+// named file, which is looked up next to the including one. A file that was
+// already included is skipped.
+void readSource(const string &filename, string &source, set<string> &included)
+{
+	if(!included.insert(filename).second) {
+		return;
+	}
+	char *text = GLSL::textFileRead(filename.c_str());
+	if(text == NULL) {
+		return;
+	}
+	string dir = filename.substr(0, filename.find_last_of("/\\") + 1);
+	istringstream lines(text);
+	free(text);
+	string line;
+	while(getline(lines, line)) {
+		size_t start = line.find_first_not_of(" \t");
+		size_t open = line.find('"');
+		size_t close = line.rfind('"');
+		if(start != string::npos && line.compare(start, 8, "#include") == 0 && open < close) {
+			readSource(dir + line.substr(open + 1, close - open - 1), source, included);
+		} else {
+			source += line;
+			source += '\n';
+		}
+	}
+}
+
+// Reads a shader with its includes, and puts the defines right after the
+// #version line, which must come first
+string loadShader(const string &filename, const string &defines)
+{
+	string source;
+	set<string> included;
+	readSource(filename, source, included);
+	size_t version = source.find("#version");
+	size_t insert = version == string::npos ? 0 : source.find('\n', version);
+	insert = insert == string::npos ? source.size() : insert + 1;
+	source.insert(insert, defines);
+	return source;
+}
+
+}
+
 Program::Program() :
 	vShaderName(""),
 	fShaderName(""),
-	pid(0),
-	verbose(true)
+	serial(0),
+	verbose(true),
+	status(NONE),
+	cacheKey(0),
+	fromBinaryCache(false),
+	binaryPending(false)
 {
 	
 }
@@ -29,85 +103,296 @@ void Program::setShaderNames(const string &v, const string &f)
 
 bool Program::init()
 {
-	GLint rc;
+	start();
+	return finish();
+}
+
+void Program::start()
+{
+	// Read shader sources
+	string defineText = getDefineText(defines);
+	string vsrc = loadShader(vShaderName, defineText);
+	string fsrc = loadShader(fShaderName, defineText);
 	
-	// Create shader handles
-	GLuint VS = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FS = glCreateShader(GL_FRAGMENT_SHADER);
+	serial = ++lastSerial;
 	
-	// Read shader sources
-	const char *vshader = GLSL::textFileRead(vShaderName.c_str());
-	const char *fshader = GLSL::textFileRead(fShaderName.c_str());
+	// Use the binary from an earlier run if the sources and driver match
+	fromBinaryCache = false;
+	binaryPending = false;
+	cacheKey = 0;
+	if(!binaryCacheName.empty() && ProgramCache::isSupported()) {
+		cacheKey = ProgramCache::makeKey(vsrc, fsrc, defineText);
+		GLHandle cached = GLHandle::createProgram();
+		if(ProgramCache::load(binaryCacheName, cacheKey, cached.get())) {
+			program = move(cached);
+			fromBinaryCache = true;
+			status = COMPILING;
+			return;
+		}
+	}
+	compile(vsrc, fsrc);
+}
+
+void Program::compile(const string &vsrc, const string &fsrc)
+{
+	// Compile and link without asking for the results, which would wait for
+	// the driver. The shaders are kept until finish() checks them.
+	vertexShader = GLHandle::createShader(GL_VERTEX_SHADER);
+	fragmentShader = GLHandle::createShader(GL_FRAGMENT_SHADER);
+	GLuint VS = vertexShader.get();
+	GLuint FS = fragmentShader.get();
+	const char *vshader = vsrc.c_str();
+	const char *fshader = fsrc.c_str();
 	glShaderSource(VS, 1, &vshader, NULL);
 	glShaderSource(FS, 1, &fshader, NULL);
-	
-	// Compile vertex shader
 	glCompileShader(VS);
-	glGetShaderiv(VS, GL_COMPILE_STATUS, &rc);
-	if(!rc) {
-		if(isVerbose()) {
-			GLSL::printShaderInfoLog(VS);
-			cout << "Error compiling vertex shader " << vShaderName << endl;
-		}
-		return false;
-	}
-	
-	// Compile fragment shader
 	glCompileShader(FS);
-	glGetShaderiv(FS, GL_COMPILE_STATUS, &rc);
-	if(!rc) {
-		if(isVerbose()) {
-			GLSL::printShaderInfoLog(FS);
-			cout << "Error compiling fragment shader " << fShaderName << endl;
-		}
-		return false;
-	}
 	
-	// Create the program and link
-	pid = glCreateProgram();
+	// Create the program and link. Replacing the handle releases the
+	// program of an earlier init().
+	program = GLHandle::createProgram();
+	GLuint pid = program.get();
 	glAttachShader(pid, VS);
 	glAttachShader(pid, FS);
+	if(cacheKey) {
+		glProgramParameteri(pid, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
 	glLinkProgram(pid);
-	glGetProgramiv(pid, GL_LINK_STATUS, &rc);
-	if(!rc) {
-		if(isVerbose()) {
-			GLSL::printProgramInfoLog(pid);
-			cout << "Error linking shaders " << vShaderName << " and " << fShaderName << endl;
-		}
+	status = COMPILING;
+}
+
+bool Program::isCompiling() const
+{
+	if(status != COMPILING) {
 		return false;
 	}
+	if(!isParallelCompileSupported()) {
+		// finish() may wait, but the driver has most likely compiled already
+		return false;
+	}
+	GLint done = GL_TRUE;
+	glGetProgramiv(program.get(), GL_COMPLETION_STATUS_KHR, &done);
+	return !done;
+}
+
+bool Program::finish()
+{
+	if(status != COMPILING) {
+		return status == LINKED;
+	}
+	status = FAILED;
+	GLint rc;
+	if(fromBinaryCache) {
+		glGetProgramiv(program.get(), GL_LINK_STATUS, &rc);
+		if(!rc) {
+			// The driver rejected the binary (an unknown format also raises
+			// GL_INVALID_ENUM). Build from source instead, which replaces the
+			// file once saveBinary() is called.
+			glGetError();
+			fromBinaryCache = false;
+			string defineText = getDefineText(defines);
+			compile(loadShader(vShaderName, defineText), loadShader(fShaderName, defineText));
+		}
+	}
+	GLuint pid = program.get();
+	if(!fromBinaryCache) {
+		GLuint VS = vertexShader.get();
+		GLuint FS = fragmentShader.get();
+		// The shaders are only needed until the program is linked
+		GLHandle vs = move(vertexShader);
+		GLHandle fs = move(fragmentShader);
+		glDetachShader(pid, VS);
+		glDetachShader(pid, FS);
+		
+		// Check vertex shader
+		glGetShaderiv(VS, GL_COMPILE_STATUS, &rc);
+		if(!rc) {
+			if(isVerbose()) {
+				GLSL::printShaderInfoLog(VS);
+				cout << "Error compiling vertex shader " << vShaderName << endl;
+			}
+			return false;
+		}
+		
+		// Check fragment shader
+		glGetShaderiv(FS, GL_COMPILE_STATUS, &rc);
+		if(!rc) {
+			if(isVerbose()) {
+				GLSL::printShaderInfoLog(FS);
+				cout << "Error compiling fragment shader " << fShaderName << endl;
+			}
+			return false;
+		}
+		
+		// Check the link
+		glGetProgramiv(pid, GL_LINK_STATUS, &rc);
+		if(!rc) {
+			if(isVerbose()) {
+				GLSL::printProgramInfoLog(pid);
+				cout << "Error linking shaders " << vShaderName << " and " << fShaderName << endl;
+			}
+			return false;
+		}
+		binaryPending = cacheKey != 0;
+	}
+	status = LINKED;
+	reflect();
 	
 	GLSL::checkError(GET_FILE_LINE);
 	return true;
 }
 
+void Program::reflect()
+{
+	GLuint pid = program.get();
+	attributes.clear();
+	uniforms.clear();
+	uniformBlocks.clear();
+	uniformLocations.clear();
+	missing.clear();
+	GLenum interfaces[] = { GL_PROGRAM_INPUT, GL_UNIFORM, GL_UNIFORM_BLOCK };
+	if(GLEW_VERSION_4_3 || GLEW_ARB_program_interface_query) {
+		for(GLenum iface : interfaces) {
+			GLint count = 0, maxLength = 0;
+			glGetProgramInterfaceiv(pid, iface, GL_ACTIVE_RESOURCES, &count);
+			glGetProgramInterfaceiv(pid, iface, GL_MAX_NAME_LENGTH, &maxLength);
+			vector<char> name(maxLength + 1, 0);
+			for(GLint i = 0; i < count; ++i) {
+				glGetProgramResourceName(pid, iface, i, (GLsizei)name.size(), NULL, name.data());
+				GLint location = iface == GL_UNIFORM_BLOCK ? i : glGetProgramResourceLocation(pid, iface, name.data());
+				addResource(iface, name.data(), location);
+			}
+		}
+	} else {
+		// The same through the GL 3.1 queries
+		GLenum counts[] = { GL_ACTIVE_ATTRIBUTES, GL_ACTIVE_UNIFORMS, GL_ACTIVE_UNIFORM_BLOCKS };
+		GLenum lengths[] = { GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, GL_ACTIVE_UNIFORM_MAX_LENGTH, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH };
+		for(int k = 0; k < 3; ++k) {
+			GLint count = 0, maxLength = 0;
+			glGetProgramiv(pid, counts[k], &count);
+			glGetProgramiv(pid, lengths[k], &maxLength);
+			vector<char> name(maxLength + 1, 0);
+			for(GLint i = 0; i < count; ++i) {
+				GLint size;
+				GLenum type;
+				GLint location = i;
+				if(k == 0) {
+					glGetActiveAttrib(pid, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+					location = glGetAttribLocation(pid, name.data());
+				} else if(k == 1) {
+					glGetActiveUniform(pid, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+					location = glGetUniformLocation(pid, name.data());
+				} else {
+					glGetActiveUniformBlockName(pid, i, (GLsizei)name.size(), NULL, name.data());
+				}
+				addResource(interfaces[k], name.data(), location);
+			}
+		}
+	}
+}
+
+void Program::addResource(GLenum iface, string name, GLint location)
+{
+	// Built-in inputs have no location
+	if(name.compare(0, 3, "gl_") == 0) {
+		return;
+	}
+	// Arrays are listed by their first element
+	if(name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0) {
+		name.erase(name.size() - 3);
+	}
+	if(iface == GL_PROGRAM_INPUT) {
+		attributes[name] = location;
+	} else if(iface == GL_UNIFORM_BLOCK) {
+		uniformBlocks[name] = (GLuint)location;
+	} else if(location != -1) {
+		// Uniforms in blocks have no location, and are set through the block
+		uniforms[name] = location;
+		Uniform u = uniform(hashName(name.c_str()), name.c_str(), false);
+		getRegistry().active[u.index] = true;
+		if(u.index >= uniformLocations.size()) {
+			uniformLocations.resize(u.index + 1, -1);
+		}
+		uniformLocations[u.index] = location;
+	}
+}
+
+string Program::getDefineText(const Defines &defines)
+{
+	string text;
+	for(const auto &define : defines) {
+		text += "#define " + define.first + " " + to_string(define.second) + "\n";
+	}
+	return text;
+}
+
+void Program::saveBinary()
+{
+	if(!binaryPending) {
+		return;
+	}
+	binaryPending = false;
+	if(!ProgramCache::save(binaryCacheName, cacheKey, program.get())) {
+		cout << "Could not write program cache " << binaryCacheName << endl;
+	}
+}
+
+bool Program::isParallelCompileSupported()
+{
+	return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+}
+
 void Program::bind()
 {
-	glUseProgram(pid);
+	GLState::useProgram(program.get());
 }
 
 void Program::unbind()
 {
-	glUseProgram(0);
+	GLState::useProgram(0);
 }
 
-void Program::addAttribute(const string &name)
+Program::Uniform Program::uniform(unsigned hash, const char *name, bool requested)
 {
-	attributes[name] = glGetAttribLocation(pid, name.c_str());
+	UniformRegistry &registry = getRegistry();
+	// Probe past hashes taken by other names
+	for(;;) {
+		auto found = registry.indices.find(hash);
+		if(found == registry.indices.end()) {
+			break;
+		}
+		if(registry.names[found->second] == name) {
+			Uniform u = { found->second };
+			if(requested) {
+				registry.requested[u.index] = true;
+			}
+			return u;
+		}
+		++hash;
+	}
+	Uniform u = { (unsigned)registry.names.size() };
+	registry.names.push_back(name);
+	registry.indices[hash] = u.index;
+	registry.requested.push_back(requested);
+	registry.active.push_back(false);
+	return u;
 }
 
-void Program::addUniform(const string &name)
+void Program::checkUniforms()
 {
-	uniforms[name] = glGetUniformLocation(pid, name.c_str());
+	const UniformRegistry &registry = getRegistry();
+	for(size_t i = 0; i < registry.names.size(); ++i) {
+		if(registry.requested[i] && !registry.active[i]) {
+			cout << registry.names[i] << " is not a uniform variable of any program" << endl;
+		}
+	}
 }
 
 GLint Program::getAttribute(const string &name) const
 {
-	map<string,GLint>::const_iterator attribute = attributes.find(name.c_str());
+	map<string,GLint>::const_iterator attribute = attributes.find(name);
 	if(attribute == attributes.end()) {
-		if(isVerbose()) {
-			cout << name << " is not an attribute variable" << endl;
-		}
+		reportMissing(name, " is not an attribute variable");
 		return -1;
 	}
 	return attribute->second;
@@ -115,12 +400,28 @@ GLint Program::getAttribute(const string &name) const
 
 GLint Program::getUniform(const string &name) const
 {
-	map<string,GLint>::const_iterator uniform = uniforms.find(name.c_str());
+	map<string,GLint>::const_iterator uniform = uniforms.find(name);
 	if(uniform == uniforms.end()) {
-		if(isVerbose()) {
-			cout << name << " is not a uniform variable" << endl;
-		}
+		reportMissing(name, " is not a uniform variable");
 		return -1;
 	}
 	return uniform->second;
 }
+
+GLuint Program::getUniformBlock(const string &name) const
+{
+	map<string,GLuint>::const_iterator block = uniformBlocks.find(name);
+	if(block == uniformBlocks.end()) {
+		reportMissing(name, " is not a uniform block");
+		return GL_INVALID_INDEX;
+	}
+	return block->second;
+}
+
+void Program::reportMissing(const string &name, const char *what) const
+{
+	// Only the first lookup of each name is reported
+	if(isVerbose() && missing.insert(name).second) {
+		cout << name << what << " in " << vShaderName << " and " << fShaderName << endl;
+	}
+}
@@ -2,18 +2,47 @@
 #ifndef PROGRAM_H
 #define PROGRAM_H
 
+#include <cstdint>
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
 
+#include "GLHandle.h"
+
 /**
  * An OpenGL Program (vertex and fragment shaders)
+ * Once linked, the active attributes, uniforms, and uniform blocks are
+ * listed from the program itself. Uniforms can be looked up by name, or
+ * through a Uniform handle: a dense index shared by every program, so
+ * getUniform(handle) is an array lookup.
+ * Handles are registered once with Program::uniform(). The name's hash is a
+ * constexpr, so it is folded at compile time for literal names.
+ * init() compiles and links before returning. Alternatively, start() only
+ * issues the work, isCompiling() polls it (with KHR_parallel_shader_compile
+ * the driver compiles on its own threads), and finish() checks the results.
+ * Shader files may #include "name" files from their own directory, and the
+ * defines set with setDefines() are inserted after their #version line.
  */
 class Program
 {
 public:
+	// Index of a uniform name, the same in every program
+	struct Uniform {
+		unsigned index;
+	};
+	// Preprocessor symbols and their values, see ShaderVariants
+	typedef std::map<std::string, int> Defines;
+	enum Status {
+		NONE, // not started
+		COMPILING, // until finish()
+		LINKED,
+		FAILED
+	};
+	
 	Program();
 	virtual ~Program();
 	
@@ -21,24 +50,88 @@ public:
 	bool isVerbose() const { return verbose; }
 	
 	void setShaderNames(const std::string &v, const std::string &f);
+	// Used by the next start()
+	void setDefines(const Defines &d) { defines = d; }
+	const Defines &getDefines() const { return defines; }
+	// "#define NAME value" lines, in the order of the names
+	static std::string getDefineText(const Defines &defines);
+	// File for the linked binary, see ProgramCache. Not used if empty.
+	void setBinaryCacheName(const std::string &name) { binaryCacheName = name; }
+	// Whether the program came from its binary instead of being compiled.
+	// finish() clears it if the driver rejected the binary.
+	bool isFromBinaryCache() const { return fromBinaryCache; }
+	// Writes the binary of a program that finish() linked from source to
+	// its cache file. finish() leaves this to the caller, so that a program
+	// first used in the middle of a frame does not write a file there.
+	void saveBinary();
 	virtual bool init();
+	void start();
+	// False once finish() would not wait for the driver
+	bool isCompiling() const;
+	// Waits for the driver if needed. Returns whether the program linked.
+	bool finish();
+	Status getStatus() const { return status; }
+	// Whether the driver can report compile completion without waiting
+	static bool isParallelCompileSupported();
 	virtual void bind();
 	virtual void unbind();
+	GLuint getPID() const { return program.get(); }
+	// Changes with every start(). Unlike the PID, which the driver may hand
+	// to a later program, it is never reused, so it can key state recorded
+	// for one link of one program.
+	unsigned getSerial() const { return serial; }
 
-	void addAttribute(const std::string &name);
-	void addUniform(const std::string &name);
+	// -1 (GL_INVALID_INDEX for blocks) if the program has no such active
+	// variable. In verbose mode the first miss of each name is printed.
 	GLint getAttribute(const std::string &name) const;
 	GLint getUniform(const std::string &name) const;
+	GLuint getUniformBlock(const std::string &name) const;
+	// -1 if the program has no such active uniform
+	GLint getUniform(Uniform u) const { return u.index < uniformLocations.size() ? uniformLocations[u.index] : -1; }
+	
+	// Returns the handle of a uniform name, registering it on first use
+	static Uniform uniform(const char *name) { return uniform(hashName(name), name, true); }
+	// Reports each name registered with uniform() that no program linked so
+	// far has as an active uniform, such as a misspelled one. Call it once
+	// the programs the names are meant for have linked, rather than wait for
+	// a lookup in some rarely drawn case to miss.
+	static void checkUniforms();
+	// 32-bit FNV-1a
+	static constexpr unsigned hashName(const char *name, unsigned h = 2166136261u)
+	{
+		return *name ? hashName(name + 1, (h ^ (unsigned char)*name)*16777619u) : h;
+	}
 	
 protected:
 	std::string vShaderName;
 	std::string fShaderName;
 	
 private:
-	GLuint pid;
+	GLHandle program;
+	unsigned serial;
 	std::map<std::string,GLint> attributes;
 	std::map<std::string,GLint> uniforms;
+	std::map<std::string,GLuint> uniformBlocks;
+	std::vector<GLint> uniformLocations; // by Uniform::index
+	mutable std::set<std::string> missing; // names already reported
 	bool verbose;
+	Defines defines;
+	Status status;
+	GLHandle vertexShader; // until finish()
+	GLHandle fragmentShader;
+	std::string binaryCacheName;
+	uint64_t cacheKey; // 0 if the binary cache is not used
+	bool fromBinaryCache;
+	bool binaryPending; // linked, but not saved yet
+	
+	// Lists the active variables after linking
+	// Issues the compile and link of the given sources
+	void compile(const std::string &vsrc, const std::string &fsrc);
+	void reflect();
+	void addResource(GLenum iface, std::string name, GLint location);
+	void reportMissing(const std::string &name, const char *what) const;
+	// requested is false for the names that reflect() adds
+	static Uniform uniform(unsigned hash, const char *name, bool requested);
 };
 
 #endif
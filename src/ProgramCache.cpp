@@ -0,0 +1,122 @@
+#include "ProgramCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "MappedFile.h"
+
+using namespace std;
+
+namespace {
+
+const char MAGIC[4] = { 'A', '3', 'P', 'B' };
+// Bump whenever the header changes
+const uint32_t VERSION = 1;
+
+struct Header {
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	uint32_t format; // binaryFormat of glProgramBinary
+	uint32_t size; // of the binary, which follows the header
+};
+
+// 64-bit FNV-1a, continuing from hash
+uint64_t hashString(const char *s, uint64_t hash)
+{
+	for(const unsigned char *p = (const unsigned char *)s; *p; ++p) {
+		hash = (hash ^ *p) * 1099511628211ull;
+	}
+	// Separate the strings, so that moving text between them changes the key
+	return (hash ^ 0xff) * 1099511628211ull;
+}
+
+}
+
+namespace ProgramCache {
+
+bool isSupported()
+{
+	if(!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary) {
+		return false;
+	}
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+uint64_t makeKey(const string &vsrc, const string &fsrc, const string &defines)
+{
+	uint64_t hash = 14695981039346656037ull;
+	hash = hashString(vsrc.c_str(), hash);
+	hash = hashString(fsrc.c_str(), hash);
+	hash = hashString(defines.c_str(), hash);
+	// A driver update can change or invalidate the binary format
+	GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for(GLenum name : strings) {
+		const char *s = (const char *)glGetString(name);
+		hash = hashString(s ? s : "", hash);
+	}
+	return hash;
+}
+
+bool load(const string &cacheName, uint64_t key, GLuint program)
+{
+	MappedFile file;
+	if(!file.open(cacheName) || file.size() < sizeof(Header)) {
+		return false;
+	}
+	Header header;
+	memcpy(&header, file.data(), sizeof(header));
+	if(memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION ||
+	   header.key != key || header.size != file.size() - sizeof(Header)) {
+		return false;
+	}
+	// The driver may still reject the binary. Asking now would wait for it,
+	// so the caller checks GL_LINK_STATUS later.
+	glProgramBinary(program, header.format, file.data() + sizeof(Header), header.size);
+	return true;
+}
+
+bool save(const string &cacheName, uint64_t key, GLuint program)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if(length <= 0) {
+		return false;
+	}
+	vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, binary.data());
+	if(length <= 0) {
+		return false;
+	}
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.key = key;
+	header.format = format;
+	header.size = (uint32_t)length;
+
+	// Write to a temporary file first so a partially written cache is never loaded.
+	string tmpName = cacheName + ".tmp";
+	FILE *fp = fopen(tmpName.c_str(), "wb");
+	if(fp == NULL) {
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = ok && fwrite(binary.data(), 1, length, fp) == (size_t)length;
+	ok = (fclose(fp) == 0) && ok;
+	if(ok) {
+		remove(cacheName.c_str());
+		ok = rename(tmpName.c_str(), cacheName.c_str()) == 0;
+	}
+	if(!ok) {
+		remove(tmpName.c_str());
+	}
+	return ok;
+}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <cstdint>
+#include <string>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+/**
+ * Linked program binaries on disk (glGetProgramBinary), so that later runs
+ * skip compiling and linking. Each file holds a key hashed from the shader
+ * sources, the preprocessor defines, and the driver's vendor, renderer, and
+ * version strings. A file whose key differs, or whose binary the driver
+ * rejects, is ignored, and is replaced once the program is built from source.
+ */
+namespace ProgramCache {
+
+	// Needs GL 4.1 or ARB_get_program_binary, and a driver with at least one
+	// binary format
+	bool isSupported();
+	uint64_t makeKey(const std::string &vsrc, const std::string &fsrc, const std::string &defines);
+	// Loads the binary into program. Returns false if the file is missing or
+	// was made for a different key. Whether the driver accepted the binary
+	// is known from GL_LINK_STATUS.
+	bool load(const std::string &cacheName, uint64_t key, GLuint program);
+	// The program must have been linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+	bool save(const std::string &cacheName, uint64_t key, GLuint program);
+
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include "RenderQueue.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+const int PROGRAM_SHIFT = 52;
+const int MATERIAL_SHIFT = 44;
+const int SHAPE_SHIFT = 32;
+
+// Counts the items whose program or material differs from the previous one
+void countChanges(const vector<RenderQueue::Item> &items, size_t &programChanges, size_t &materialChanges)
+{
+	programChanges = 0;
+	materialChanges = 0;
+	for(size_t i = 0; i < items.size(); ++i) {
+		uint64_t key = items[i].key;
+		uint64_t prev = i > 0 ? items[i - 1].key : ~key;
+		programChanges += (key >> PROGRAM_SHIFT) != (prev >> PROGRAM_SHIFT) ? 1 : 0;
+		materialChanges += ((key >> MATERIAL_SHIFT) & 0xff) != ((prev >> MATERIAL_SHIFT) & 0xff) ? 1 : 0;
+	}
+}
+
+}
+
+RenderQueue::RenderQueue()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+RenderQueue::~RenderQueue()
+{
+}
+
+uint64_t RenderQueue::makeKey(unsigned program, unsigned material, unsigned shape, float depth)
+{
+	// The bits of a non-negative float sort in the same order as its value
+	uint32_t depthBits = 0;
+	if(depth > 0.0f) {
+		memcpy(&depthBits, &depth, sizeof(depthBits));
+	}
+	return ((uint64_t)(program & 0xfff) << PROGRAM_SHIFT) |
+	       ((uint64_t)(material & 0xff) << MATERIAL_SHIFT) |
+	       ((uint64_t)(shape & 0xfff) << SHAPE_SHIFT) |
+	       depthBits;
+}
+
+void RenderQueue::clear()
+{
+	items.clear();
+}
+
+void RenderQueue::sort()
+{
+	stats.items = items.size();
+	countChanges(items, stats.unsortedProgramChanges, stats.unsortedMaterialChanges);
+
+	// One byte per pass, with the histograms of all eight passes counted in
+	// a single read of the keys
+	size_t n = items.size();
+	size_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for(const Item &item : items) {
+		for(int pass = 0; pass < 8; ++pass) {
+			counts[pass][(item.key >> (8*pass)) & 0xff]++;
+		}
+	}
+	scratch.resize(n);
+	Item *src = items.data();
+	Item *dst = scratch.data();
+	for(int pass = 0; pass < 8 && n > 1; ++pass) {
+		int shift = 8*pass;
+		// Skip the pass if every key has the same byte here
+		if(counts[pass][(src[0].key >> shift) & 0xff] == n) {
+			continue;
+		}
+		size_t offset = 0;
+		for(int d = 0; d < 256; ++d) {
+			size_t count = counts[pass][d];
+			counts[pass][d] = offset;
+			offset += count;
+		}
+		for(size_t i = 0; i < n; ++i) {
+			dst[counts[pass][(src[i].key >> shift) & 0xff]++] = src[i];
+		}
+		swap(src, dst);
+	}
+	if(src != items.data()) {
+		items.swap(scratch);
+	}
+
+	countChanges(items, stats.programChanges, stats.materialChanges);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * The visible draws of a frame, each with a 64-bit sort key and the index of
+ * the caller's draw record. The key packs, from the most significant bits,
+ * the program, the material, the shape, and the view depth, so that sorting
+ * groups draws by program and then material, and draws each group front to
+ * back for early depth rejection. Keys are sorted with an LSD radix sort.
+ */
+class RenderQueue
+{
+public:
+	struct Item {
+		uint64_t key;
+		unsigned index;
+	};
+	// Changes of program and of material between consecutive items, in the
+	// order they were pushed and in sorted order
+	struct Stats {
+		size_t items;
+		size_t programChanges;
+		size_t materialChanges;
+		size_t unsortedProgramChanges;
+		size_t unsortedMaterialChanges;
+	};
+
+	RenderQueue();
+	virtual ~RenderQueue();
+
+	// Fields wider than the key (12 bits of program, 8 of material, 12 of
+	// shape) wrap around, which only costs batching. depth is the distance
+	// in front of the camera; negative depths sort as 0.
+	static uint64_t makeKey(unsigned program, unsigned material, unsigned shape, float depth);
+	void clear();
+	void push(uint64_t key, unsigned index) { items.push_back({ key, index }); }
+	// Items prepared elsewhere, for example by worker threads
+	void append(const std::vector<Item> &other) { items.insert(items.end(), other.begin(), other.end()); }
+	void sort();
+	const std::vector<Item> &getItems() const { return items; }
+	// Of the last sort()
+	const Stats &getStats() const { return stats; }
+
+private:
+	std::vector<Item> items;
+	std::vector<Item> scratch;
+	Stats stats;
+};
+
+#endif
@@ -0,0 +1,242 @@
+#include "Scene.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include "MatrixStack.h"
+
+using namespace std;
+
+namespace {
+
+// Reads count floats from tokens, starting at i. Returns false if a token is
+// missing or not a number.
+bool parseFloats(const vector<string> &tokens, size_t &i, float *values, int count)
+{
+	for(int k = 0; k < count; ++k, ++i) {
+		if(i >= tokens.size()) {
+			return false;
+		}
+		char *end;
+		values[k] = strtof(tokens[i].c_str(), &end);
+		if(*end != '\0' || end == tokens[i].c_str()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool isNumber(const string &token)
+{
+	char *end;
+	strtof(token.c_str(), &end);
+	return *end == '\0' && end != token.c_str();
+}
+
+}
+
+Scene::Scene()
+{
+}
+
+Scene::~Scene()
+{
+}
+
+bool Scene::load(const string &fileName)
+{
+	ifstream in(fileName);
+	if(!in) {
+		cerr << "Cannot open scene " << fileName << endl;
+		return false;
+	}
+	string dir = fileName.substr(0, fileName.find_last_of("/\\") + 1);
+	meshes.clear();
+	materialNames.clear();
+	materials.clear();
+	lights.clear();
+	modes.clear();
+	objects.clear();
+	ops.clear();
+
+	string line;
+	int lineNumber = 0;
+	string error;
+	while(error.empty() && getline(in, line)) {
+		lineNumber++;
+		line = line.substr(0, line.find('#'));
+		vector<string> tokens;
+		istringstream words(line);
+		string word;
+		while(words >> word) {
+			tokens.push_back(word);
+		}
+		if(tokens.empty()) {
+			continue;
+		}
+		const string &type = tokens[0];
+		size_t i = 1;
+		if(type == "mesh") {
+			if(tokens.size() != 3) {
+				error = "expected mesh NAME FILE";
+				continue;
+			}
+			Mesh mesh = { tokens[1], dir + tokens[2] };
+			meshes.push_back(mesh);
+		} else if(type == "material") {
+			float v[10];
+			i = 2;
+			if(tokens.size() != 12 || !parseFloats(tokens, i, v, 10)) {
+				error = "expected material NAME KA KD KS S";
+				continue;
+			}
+			Material m = { v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9] };
+			materialNames.push_back(tokens[1]);
+			materials.push_back(m);
+		} else if(type == "light") {
+			float v[6];
+			if(tokens.size() != 7 || !parseFloats(tokens, i, v, 6)) {
+				error = "expected light POS COLOR";
+				continue;
+			}
+			Light l = { v[0], v[1], v[2], v[3], v[4], v[5] };
+			lights.push_back(l);
+		} else if(type == "mode") {
+			if(tokens.size() < 3) {
+				error = "expected mode NAME SHADER [DEFINE[=VALUE] ...]";
+				continue;
+			}
+			Mode mode;
+			mode.name = tokens[1];
+			mode.shader = dir + tokens[2];
+			for(i = 3; i < tokens.size(); ++i) {
+				size_t eq = tokens[i].find('=');
+				mode.defines[tokens[i].substr(0, eq)] = eq == string::npos ? 1 : atoi(tokens[i].c_str() + eq + 1);
+			}
+			modes.push_back(mode);
+		} else if(type == "object") {
+			if(tokens.size() < 3) {
+				error = "expected object MESH MATERIAL [OP ...]";
+				continue;
+			}
+			Object object;
+			object.mesh = -1;
+			for(size_t m = 0; m < meshes.size(); ++m) {
+				if(meshes[m].name == tokens[1]) {
+					object.mesh = (int)m;
+				}
+			}
+			auto material = find(materialNames.begin(), materialNames.end(), tokens[2]);
+			object.material = material == materialNames.end() ? -1 : (int)(material - materialNames.begin());
+			if(object.mesh < 0 || object.material < 0) {
+				error = "undefined mesh or material";
+				continue;
+			}
+			object.firstOp = (unsigned)ops.size();
+			for(i = 3; error.empty() && i < tokens.size(); ) {
+				const string &name = tokens[i++];
+				Op op;
+				int count = 4;
+				if(name == "translate") {
+					op.type = Op::TRANSLATE;
+					count = 3;
+				} else if(name == "rotate") {
+					op.type = Op::ROTATE;
+				} else if(name == "scale") {
+					op.type = Op::SCALE;
+					// One factor, or one per axis
+					count = (i + 1 < tokens.size() && isNumber(tokens[i + 1])) ? 3 : 1;
+				} else if(name == "spin") {
+					op.type = Op::SPIN;
+				} else if(name == "shear") {
+					op.type = Op::SHEAR;
+					count = 1;
+				} else {
+					error = "unknown transform " + name;
+					break;
+				}
+				if(!parseFloats(tokens, i, op.v, count)) {
+					error = "expected " + to_string(count) + " numbers after " + name;
+					break;
+				}
+				if(op.type == Op::SCALE && count == 1) {
+					op.v[1] = op.v[2] = op.v[0];
+				}
+				ops.push_back(op);
+			}
+			object.opCount = (unsigned)ops.size() - object.firstOp;
+			objects.push_back(object);
+		} else {
+			error = "unknown record " + type;
+		}
+	}
+	if(!error.empty()) {
+		cerr << fileName << ":" << lineNumber << ": " << error << endl;
+		return false;
+	}
+	if(modes.empty() || objects.empty()) {
+		cerr << fileName << ": needs at least one mode and one object" << endl;
+		return false;
+	}
+	return true;
+}
+
+void Scene::applyTransform(int object, double t, MatrixStack &M) const
+{
+	apply(object, t, M, true);
+}
+
+void Scene::applyPose(int object, double t, MatrixStack &M) const
+{
+	apply(object, t, M, false);
+}
+
+void Scene::apply(int object, double t, MatrixStack &M, bool translate) const
+{
+	const Object &o = objects[object];
+	for(unsigned k = o.firstOp; k < o.firstOp + o.opCount; ++k) {
+		const Op &op = ops[k];
+		switch(op.type) {
+			case Op::TRANSLATE:
+				if(translate) {
+					M.translate(op.v[0], op.v[1], op.v[2]);
+				}
+				break;
+			case Op::ROTATE:
+				M.rotate(op.v[0], op.v[1], op.v[2], op.v[3]);
+				break;
+			case Op::SCALE:
+				M.scale(op.v[0], op.v[1], op.v[2]);
+				break;
+			case Op::SPIN:
+				M.rotate(op.v[0]*(float)t, op.v[1], op.v[2], op.v[3]);
+				break;
+			case Op::SHEAR:
+			{
+				glm::mat4 S(1.0f);
+				S[0][1] = op.v[0]*cos((float)t);
+				M.multMatrix(S);
+				break;
+			}
+		}
+	}
+}
+
+float Scene::getRadiusScale(int object) const
+{
+	const Object &o = objects[object];
+	float scale = 1.0f;
+	for(unsigned k = o.firstOp; k < o.firstOp + o.opCount; ++k) {
+		if(ops[k].type == Op::SCALE) {
+			scale *= max(fabs(ops[k].v[0]), max(fabs(ops[k].v[1]), fabs(ops[k].v[2])));
+		}
+	}
+	return scale;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Light.h"
+#include "Material.h"
+
+class MatrixStack;
+
+/**
+ * The meshes, materials, lights, shader modes, and objects of a scene, read
+ * from a text file (see resources/scene.txt) into flat arrays. Objects refer
+ * to meshes and materials by index. An object's transform is a run of
+ * operations in the shared ops array, some of them animated.
+ */
+class Scene
+{
+public:
+	struct Mesh {
+		std::string name;
+		std::string fileName; // with the scene file's directory in front
+	};
+	struct Mode {
+		std::string name;
+		std::string shader; // path of the shader files without _vert.glsl and _frag.glsl
+		std::map<std::string, int> defines;
+	};
+	struct Op {
+		enum Type {
+			TRANSLATE, // v = x, y, z
+			ROTATE, // v = angle in radians, axis
+			SCALE, // v = x, y, z
+			SPIN, // v = radians per second, axis
+			SHEAR // v[0] = amplitude of the x shear along y, which swings with cos(t)
+		};
+		Type type;
+		float v[4];
+	};
+	struct Object {
+		int mesh;
+		int material;
+		unsigned firstOp;
+		unsigned opCount;
+	};
+
+	Scene();
+	virtual ~Scene();
+	// Prints the first error, with its line number, and returns false if the
+	// file cannot be read or refers to names it does not define.
+	bool load(const std::string &fileName);
+
+	// Right multiplies M by the object's transform at time t
+	void applyTransform(int object, double t, MatrixStack &M) const;
+	// The same without the translations, for placing copies of the object
+	void applyPose(int object, double t, MatrixStack &M) const;
+	// Largest factor of the object's scales, by which its bounding sphere
+	// grows. Shears are not accounted for.
+	float getRadiusScale(int object) const;
+
+	const std::vector<Mesh> &getMeshes() const { return meshes; }
+	const std::vector<Material> &getMaterials() const { return materials; }
+	const std::vector<Light> &getLights() const { return lights; }
+	std::vector<Light> &getLights() { return lights; }
+	const std::vector<Mode> &getModes() const { return modes; }
+	const std::vector<Object> &getObjects() const { return objects; }
+
+private:
+	void apply(int object, double t, MatrixStack &M, bool translate) const;
+
+	std::vector<Mesh> meshes;
+	std::vector<std::string> materialNames;
+	std::vector<Material> materials;
+	std::vector<Light> lights;
+	std::vector<Mode> modes;
+	std::vector<Object> objects;
+	std::vector<Op> ops;
+};
+
+#endif
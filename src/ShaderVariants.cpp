@@ -0,0 +1,49 @@
+#include "ShaderVariants.h"
+
+#include <cstdio>
+
+using namespace std;
+
+ShaderVariants::ShaderVariants()
+{
+}
+
+ShaderVariants::~ShaderVariants()
+{
+}
+
+void ShaderVariants::setShaderNames(const string &v, const string &f)
+{
+	vShaderName = v;
+	fShaderName = f;
+}
+
+shared_ptr<Program> ShaderVariants::get(const Program::Defines &defines)
+{
+	string key = Program::getDefineText(defines);
+	auto found = variants.find(key);
+	if(found != variants.end()) {
+		return found->second;
+	}
+	auto prog = make_shared<Program>();
+	prog->setShaderNames(vShaderName, fShaderName);
+	prog->setDefines(defines);
+	if(!binaryCacheName.empty()) {
+		// One file per variant, named by the hash of its defines
+		char suffix[16];
+		snprintf(suffix, sizeof(suffix), "-%08x", Program::hashName(key.c_str()));
+		prog->setBinaryCacheName(binaryCacheName + suffix + ".a3prog");
+	}
+	prog->setVerbose(true);
+	prog->start();
+	prog->setVerbose(false);
+	variants[key] = prog;
+	return prog;
+}
+
+void ShaderVariants::saveBinaries()
+{
+	for(const auto &variant : variants) {
+		variant.second->saveBinary();
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#ifndef SHADERVARIANTS_H
+#define SHADERVARIANTS_H
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "Program.h"
+
+/**
+ * The specializations of one vertex and fragment shader pair, such as the
+ * instanced variant or one for a particular vertex format. Each set of
+ * defines gets its own Program, which is started the first time get() asks
+ * for it and kept by the define text, so every draw runs a shader compiled
+ * for exactly its case instead of branching on uniforms.
+ */
+class ShaderVariants
+{
+public:
+	ShaderVariants();
+	virtual ~ShaderVariants();
+	void setShaderNames(const std::string &v, const std::string &f);
+	// Prefix of the variants' binary cache files. Not used if empty.
+	void setBinaryCacheName(const std::string &name) { binaryCacheName = name; }
+	
+	// Returns the variant for defines, starting it if it is new. It may still
+	// be compiling (see Program::isCompiling()).
+	std::shared_ptr<Program> get(const Program::Defines &defines);
+	// Variants started so far, by define text
+	const std::map<std::string, std::shared_ptr<Program> > &getVariants() const { return variants; }
+	// Writes the binaries of the variants linked since the last call
+	void saveBinaries();
+	
+private:
+	std::string vShaderName;
+	std::string fShaderName;
+	std::string binaryCacheName;
+	std::map<std::string, std::shared_ptr<Program> > variants;
+};
+
+#endif
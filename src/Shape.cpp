@@ -1,89 +1,574 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
 #include "Shape.h"
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <iostream>
+#include <unordered_map>
 
+#include "Frustum.h"
+#include "GeometryArena.h"
 #include "GLSL.h"
+#include "GLState.h"
+#include "MeshCache.h"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "ObjParser.h"
 #include "Program.h"
+#include "VertexFormat.h"
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
-
 using namespace std;
 
+namespace {
+
+// The vertex shaders' decode uniforms
+const Program::Uniform POS_SCALE = Program::uniform("posScale");
+const Program::Uniform POS_OFFSET = Program::uniform("posOffset");
+
+unsigned short quantizeUnorm16(float x)
+{
+	return (unsigned short)lround(glm::clamp(x, 0.0f, 1.0f)*65535.0f);
+}
+
+short quantizeSnorm16(float x)
+{
+	return (short)lround(glm::clamp(x, -1.0f, 1.0f)*32767.0f);
+}
+
+// Maps a unit vector onto the octahedron and unfolds it into [-1, 1]^2
+glm::vec2 octEncode(glm::vec3 n)
+{
+	n /= fabs(n.x) + fabs(n.y) + fabs(n.z);
+	glm::vec2 e(n.x, n.y);
+	if(n.z < 0.0f) {
+		e.x = (1.0f - fabs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+		e.y = (1.0f - fabs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return e;
+}
+
+// Same as octDecode() in the vertex shaders
+glm::vec3 octDecode(glm::vec2 e)
+{
+	glm::vec3 n(e.x, e.y, 1.0f - fabs(e.x) - fabs(e.y));
+	if(n.z < 0.0f) {
+		float x = n.x;
+		n.x = (1.0f - fabs(n.y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		n.y = (1.0f - fabs(x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return glm::normalize(n);
+}
+
+unsigned short floatToHalf(float f)
+{
+	unsigned int x;
+	memcpy(&x, &f, sizeof(x));
+	unsigned int sign = (x >> 16) & 0x8000;
+	int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = x & 0x7fffff;
+	if(exponent >= 31) {
+		// Overflow, infinity, and NaN
+		return (unsigned short)(sign | 0x7c00 | (((x >> 23) & 0xff) == 0xff && mantissa ? 0x200 : 0));
+	}
+	if(exponent <= 0) {
+		// Subnormal or zero
+		if(exponent < -10) {
+			return (unsigned short)sign;
+		}
+		mantissa |= 0x800000;
+		unsigned int shift = (unsigned int)(14 - exponent);
+		unsigned int half = mantissa >> shift;
+		unsigned int rest = mantissa & ((1u << shift) - 1);
+		unsigned int mid = 1u << (shift - 1);
+		if(rest > mid || (rest == mid && (half & 1))) {
+			++half;
+		}
+		return (unsigned short)(sign | half);
+	}
+	// Round to nearest even; a carry into the exponent is still correct
+	unsigned int half = ((unsigned int)exponent << 10) | (mantissa >> 13);
+	unsigned int rest = mantissa & 0x1fff;
+	if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+		++half;
+	}
+	return (unsigned short)(sign | half);
+}
+
+float halfToFloat(unsigned short h)
+{
+	int exponent = (h >> 10) & 0x1f;
+	int mantissa = h & 0x3ff;
+	float f;
+	if(exponent == 0) {
+		f = ldexp((float)mantissa, -24);
+	} else if(exponent == 31) {
+		f = mantissa ? NAN : INFINITY;
+	} else {
+		f = ldexp((float)(mantissa | 0x400), exponent - 25);
+	}
+	return (h & 0x8000) ? -f : f;
+}
+
+}
+
 Shape::Shape() :
-	posBufID(0),
-	norBufID(0),
-	texBufID(0)
+	arenaHandle(0),
+	vertexFormat(FORMAT_PN),
+	vertBufID(0),
+	eleBufID(0),
+	eleType(GL_UNSIGNED_INT),
+	useVAO(true),
+	compressed(false),
+	instancing(false),
+	sphereRadius(0.0f)
 {
+	for(int k = 0; k < 3; ++k) {
+		posScale[k] = 1.0f;
+		posOffset[k] = 0.0f;
+		boundsMin[k] = 0.0f;
+		boundsMax[k] = 0.0f;
+		sphereCenter[k] = 0.0f;
+	}
+	resetCullStats();
 }
 
 Shape::~Shape()
 {
+	// Let other shapes use this one's part of the arena. The buffers and
+	// VAOs are released by their handles.
+	if(arena) {
+		arena->free(arenaHandle);
+	}
+}
+
+void Shape::setUseVAO(bool b)
+{
+	useVAO = b || GLSL::isCoreProfile();
 }
 
 void Shape::loadMesh(const string &meshName)
 {
+	// Try the binary cache first
+	string cacheName = meshName + ".a3mesh";
+	auto start = chrono::steady_clock::now();
+	auto mc = make_shared<MeshCache>();
+	bool cached = false;
+	if(mc->load(cacheName, meshName, sizeof(Lod), sizeof(MeshOptimizer::Cluster))) {
+		uint64_t lodSize = 0;
+		const Lod *lodData = (const Lod *)mc->getSection(MeshCache::LOD, &lodSize);
+		lods.assign(lodData, lodData + lodSize/sizeof(Lod));
+		uint64_t clusterSize = 0;
+		const MeshOptimizer::Cluster *clusterData = (const MeshOptimizer::Cluster *)mc->getSection(MeshCache::CLUSTER, &clusterSize);
+		clusters.assign(clusterData, clusterData + clusterSize/sizeof(MeshOptimizer::Cluster));
+		cached = checkRanges(mc->getInfo().nelems);
+		if(!cached) {
+			cerr << cacheName << ": index ranges out of bounds, ignoring the cache" << endl;
+			lods.clear();
+			clusters.clear();
+		}
+	}
+	if(cached) {
+		cache = mc;
+		vertexFormat = cache->getInfo().vertexFormat;
+		updateBounds();
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		double parseTime = cache->getInfo().parseTime;
+		cout << meshName << ": loaded from cache in " << 1000.0*elapsed << " ms (";
+		cout << 1000.0*(parseTime - elapsed) << " ms saved)" << endl;
+		return;
+	}
+	
 	// Load geometry
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
+	ObjParser parser;
 	string errStr;
-	bool rc = tinyobj::LoadObj(&attrib, &shapes, &materials, &errStr, meshName.c_str());
+	bool rc = parser.parse(meshName, errStr);
 	if(!rc) {
 		cerr << errStr << endl;
 	} else {
 		// Some OBJ files have different indices for vertex positions, normals,
 		// and texture coordinates. For example, a cube corner vertex may have
-		// three different normals. Here, we are going to duplicate all such
-		// vertices.
-		// Loop over shapes
-		for(size_t s = 0; s < shapes.size(); s++) {
-			// Loop over faces (polygons)
-			size_t index_offset = 0;
-			for(size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-				size_t fv = shapes[s].mesh.num_face_vertices[f];
-				// Loop over vertices in the face.
-				for(size_t v = 0; v < fv; v++) {
-					// access to vertex
-					tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-					posBuf.push_back(attrib.vertices[3*idx.vertex_index+0]);
-					posBuf.push_back(attrib.vertices[3*idx.vertex_index+1]);
-					posBuf.push_back(attrib.vertices[3*idx.vertex_index+2]);
-					if(!attrib.normals.empty()) {
-						norBuf.push_back(attrib.normals[3*idx.normal_index+0]);
-						norBuf.push_back(attrib.normals[3*idx.normal_index+1]);
-						norBuf.push_back(attrib.normals[3*idx.normal_index+2]);
-					}
-					if(!attrib.texcoords.empty()) {
-						texBuf.push_back(attrib.texcoords[2*idx.texcoord_index+0]);
-						texBuf.push_back(attrib.texcoords[2*idx.texcoord_index+1]);
-					}
+		// three different normals. Here, we weld face corners that share the
+		// same (position, normal, texcoord) index triple into one vertex, and
+		// reference it through the element buffer.
+		struct CornerHash {
+			size_t operator()(const ObjParser::Index &idx) const {
+				size_t h = (size_t)idx.v * 73856093u;
+				h ^= (size_t)idx.vn * 19349663u;
+				h ^= (size_t)idx.vt * 83492791u;
+				return h;
+			}
+		};
+		struct CornerEqual {
+			bool operator()(const ObjParser::Index &a, const ObjParser::Index &b) const {
+				return a.v == b.v && a.vn == b.vn && a.vt == b.vt;
+			}
+		};
+		const vector<float> &vertices = parser.getVertices();
+		const vector<float> &normals = parser.getNormals();
+		const vector<float> &texcoords = parser.getTexcoords();
+		const vector<ObjParser::Index> &indices = parser.getIndices();
+		size_t ncorners = indices.size();
+		unordered_map<ObjParser::Index, unsigned int, CornerHash, CornerEqual> welded;
+		welded.reserve(ncorners);
+		eleBuf.reserve(ncorners);
+		// Loop over triangle corners
+		for(size_t i = 0; i < ncorners; i++) {
+			const ObjParser::Index &idx = indices[i];
+			auto found = welded.find(idx);
+			if(found != welded.end()) {
+				eleBuf.push_back(found->second);
+				continue;
+			}
+			unsigned int vid = (unsigned int)(posBuf.size()/3);
+			welded[idx] = vid;
+			eleBuf.push_back(vid);
+			posBuf.push_back(vertices[3*idx.v+0]);
+			posBuf.push_back(vertices[3*idx.v+1]);
+			posBuf.push_back(vertices[3*idx.v+2]);
+			if(!normals.empty()) {
+				bool has = idx.vn >= 0;
+				norBuf.push_back(has ? normals[3*idx.vn+0] : 0.0f);
+				norBuf.push_back(has ? normals[3*idx.vn+1] : 0.0f);
+				norBuf.push_back(has ? normals[3*idx.vn+2] : 0.0f);
+			}
+			if(!texcoords.empty()) {
+				bool has = idx.vt >= 0;
+				texBuf.push_back(has ? texcoords[2*idx.vt+0] : 0.0f);
+				texBuf.push_back(has ? texcoords[2*idx.vt+1] : 0.0f);
+			}
+		}
+		
+		// Report how much the welding saved compared to one vertex per corner.
+		size_t nverts = posBuf.size()/3;
+		size_t floatsPerVert = 3 + (norBuf.empty() ? 0 : 3) + (texBuf.empty() ? 0 : 2);
+		size_t indexSize = nverts <= 65536 ? sizeof(unsigned short) : sizeof(unsigned int);
+		size_t before = ncorners*floatsPerVert*sizeof(float);
+		size_t after = nverts*floatsPerVert*sizeof(float) + eleBuf.size()*indexSize;
+		cout << meshName << ": " << ncorners << " -> " << nverts << " vertices, ";
+		cout << before << " -> " << after << " bytes (" << 8*indexSize << "-bit indices)" << endl;
+		
+		optimize(meshName);
+		buildLODs(meshName);
+		updateBounds();
+		vertexFormat = texBuf.empty() ? FORMAT_PN : FORMAT_PNT;
+		double parseTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		saveCache(cacheName, meshName, parseTime);
+	}
+}
+
+void Shape::optimize(const string &meshName)
+{
+	// Reorder triangles for the post-transform cache, then for overdraw,
+	// group them into clusters for culling, and finally renumber the
+	// vertices in the order they are fetched.
+	size_t nverts = posBuf.size()/3;
+	MeshOptimizer::CacheStats before = MeshOptimizer::analyzeVertexCache(eleBuf, nverts);
+	MeshOptimizer::optimizeVertexCache(eleBuf, nverts);
+	MeshOptimizer::optimizeOverdraw(eleBuf, posBuf);
+	clusters = MeshOptimizer::buildClusters(eleBuf, posBuf);
+	vector<unsigned int> remap = MeshOptimizer::optimizeVertexFetch(eleBuf, nverts);
+	MeshOptimizer::remapVertices(posBuf, remap, 3);
+	MeshOptimizer::remapVertices(norBuf, remap, 3);
+	MeshOptimizer::remapVertices(texBuf, remap, 2);
+	MeshOptimizer::CacheStats after = MeshOptimizer::analyzeVertexCache(eleBuf, nverts);
+	cout << meshName << ": ACMR " << before.acmr << " -> " << after.acmr;
+	cout << ", ATVR " << before.atvr << " -> " << after.atvr;
+	cout << ", " << clusters.size() << " clusters" << endl;
+}
+
+void Shape::buildLODs(const string &meshName)
+{
+	// Each level is simplified from the full mesh, so its error is measured
+	// against the original surface. Stop early once a mesh cannot be reduced
+	// any further (e.g., a cube).
+	const float fractions[] = { 0.5f, 0.25f, 0.1f, 0.05f };
+	size_t nverts = posBuf.size()/3;
+	vector<unsigned int> full = eleBuf;
+	float bmin[3], bmax[3];
+	computeBounds(bmin, bmax);
+	float radius = 0.5f*glm::length(glm::vec3(bmax[0] - bmin[0], bmax[1] - bmin[1], bmax[2] - bmin[2]));
+	lods.clear();
+	lods.push_back({ 0, (unsigned)full.size(), 0.0f, 0, (unsigned)clusters.size() });
+	auto start = chrono::steady_clock::now();
+	for(float f : fractions) {
+		vector<unsigned int> indices = full;
+		size_t target = 3*(size_t)(f*full.size()/3);
+		float error = MeshSimplifier::simplify(indices, posBuf, target);
+		if(indices.size() >= lods.back().count) {
+			break;
+		}
+		MeshOptimizer::optimizeVertexCache(indices, nverts);
+		vector<MeshOptimizer::Cluster> levelClusters = MeshOptimizer::buildClusters(indices, posBuf, (unsigned)eleBuf.size());
+		lods.push_back({ (unsigned)eleBuf.size(), (unsigned)indices.size(), radius > 0.0f ? error/radius : 0.0f, (unsigned)clusters.size(), (unsigned)levelClusters.size() });
+		eleBuf.insert(eleBuf.end(), indices.begin(), indices.end());
+		clusters.insert(clusters.end(), levelClusters.begin(), levelClusters.end());
+	}
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << meshName << ": " << lods.size() << " levels of detail in " << 1000.0*elapsed << " ms" << endl;
+	for(size_t i = 1; i < lods.size(); ++i) {
+		cout << "  LOD " << i << ": " << lods[i].count/3 << " triangles, " << lods[i].clusterCount << " clusters, error ";
+		cout << 100.0f*lods[i].error << "% of radius" << endl;
+	}
+}
+
+int Shape::selectLOD(float pixelRadius, int current) const
+{
+	// A level is good enough while its error covers at most LOD_PIXEL_ERROR
+	// pixels. Switching to a coarser level needs some margin, so a shape
+	// sitting near a threshold does not flicker between two levels.
+	const float LOD_PIXEL_ERROR = 1.0f;
+	const float LOD_HYSTERESIS = 0.75f;
+	int nlods = (int)lods.size();
+	int lod = min(max(current, 0), max(nlods - 1, 0));
+	while(lod > 0 && lods[lod].error*pixelRadius > LOD_PIXEL_ERROR) {
+		--lod;
+	}
+	while(lod + 1 < nlods && lods[lod+1].error*pixelRadius <= LOD_HYSTERESIS*LOD_PIXEL_ERROR) {
+		++lod;
+	}
+	return lod;
+}
+
+void Shape::getBounds(float bmin[3], float bmax[3]) const
+{
+	for(int k = 0; k < 3; ++k) {
+		bmin[k] = boundsMin[k];
+		bmax[k] = boundsMax[k];
+	}
+}
+
+void Shape::getBoundingSphere(float center[3], float &radius) const
+{
+	for(int k = 0; k < 3; ++k) {
+		center[k] = sphereCenter[k];
+	}
+	radius = sphereRadius;
+}
+
+void Shape::updateBounds()
+{
+	if(cache) {
+		memcpy(boundsMin, cache->getInfo().bmin, sizeof(boundsMin));
+		memcpy(boundsMax, cache->getInfo().bmax, sizeof(boundsMax));
+	} else {
+		computeBounds(boundsMin, boundsMax);
+	}
+	// The sphere around the box is looser than the tightest one, but cheap,
+	// and it is only a culling and LOD estimate
+	for(int k = 0; k < 3; ++k) {
+		sphereCenter[k] = 0.5f*(boundsMin[k] + boundsMax[k]);
+	}
+	sphereRadius = 0.5f*glm::length(glm::vec3(boundsMax[0] - boundsMin[0], boundsMax[1] - boundsMin[1], boundsMax[2] - boundsMin[2]));
+}
+
+void Shape::resetCullStats()
+{
+	cullStats.clusters = 0;
+	cullStats.frustumCulled = 0;
+	cullStats.backfaceCulled = 0;
+	cullStats.triangles = 0;
+	cullStats.trianglesDrawn = 0;
+}
+
+void Shape::packVertices(vector<unsigned char> &vertData) const
+{
+	// Interleave the CPU-side buffers. Missing normals are left as zero.
+	size_t nverts = posBuf.size()/3;
+	vertData.assign(nverts*VertexFormat::get(vertexFormat).stride, 0);
+	if(vertexFormat == FORMAT_PNT) {
+		VertexPNT *verts = (VertexPNT *)vertData.data();
+		for(size_t i = 0; i < nverts; ++i) {
+			memcpy(verts[i].pos, &posBuf[3*i], sizeof(verts[i].pos));
+			if(!norBuf.empty()) {
+				memcpy(verts[i].nor, &norBuf[3*i], sizeof(verts[i].nor));
+			}
+			memcpy(verts[i].tex, &texBuf[2*i], sizeof(verts[i].tex));
+		}
+	} else if(vertexFormat == FORMAT_PN) {
+		VertexPN *verts = (VertexPN *)vertData.data();
+		for(size_t i = 0; i < nverts; ++i) {
+			memcpy(verts[i].pos, &posBuf[3*i], sizeof(verts[i].pos));
+			if(!norBuf.empty()) {
+				memcpy(verts[i].nor, &norBuf[3*i], sizeof(verts[i].nor));
+			}
+		}
+	} else {
+		// QPN is a prefix of QPNT, so both are written through VertexQPNT
+		size_t stride = VertexFormat::get(vertexFormat).stride;
+		for(size_t i = 0; i < nverts; ++i) {
+			VertexQPNT *v = (VertexQPNT *)(vertData.data() + i*stride);
+			for(int k = 0; k < 3; ++k) {
+				v->pos[k] = quantizeUnorm16((posBuf[3*i+k] - posOffset[k]) / posScale[k]);
+			}
+			if(!norBuf.empty()) {
+				glm::vec3 n(norBuf[3*i], norBuf[3*i+1], norBuf[3*i+2]);
+				if(glm::dot(n, n) > 0.0f) {
+					glm::vec2 e = octEncode(n);
+					v->nor[0] = quantizeSnorm16(e.x);
+					v->nor[1] = quantizeSnorm16(e.y);
 				}
-				index_offset += fv;
-				// per-face material (IGNORE)
-				shapes[s].mesh.material_ids[f];
 			}
+			if(vertexFormat == FORMAT_QPNT) {
+				v->tex[0] = floatToHalf(texBuf[2*i]);
+				v->tex[1] = floatToHalf(texBuf[2*i+1]);
+			}
+		}
+	}
+}
+
+void Shape::computeBounds(float bmin[3], float bmax[3]) const
+{
+	for(int k = 0; k < 3; ++k) {
+		bmin[k] = posBuf.empty() ? 0.0f : posBuf[k];
+		bmax[k] = bmin[k];
+	}
+	for(size_t i = 0; i < posBuf.size(); i += 3) {
+		for(int k = 0; k < 3; ++k) {
+			bmin[k] = min(bmin[k], posBuf[i+k]);
+			bmax[k] = max(bmax[k], posBuf[i+k]);
+		}
+	}
+}
+
+void Shape::reportQuantizationError(const vector<unsigned char> &vertData) const
+{
+	// Decode the packed vertices the way the shaders do and compare them
+	// against the float data
+	size_t nverts = posBuf.size()/3;
+	size_t stride = VertexFormat::get(vertexFormat).stride;
+	float extent = max(posScale[0], max(posScale[1], posScale[2]));
+	double posMax = 0.0, posSum = 0.0, norMax = 0.0, norSum = 0.0, texMax = 0.0;
+	for(size_t i = 0; i < nverts; ++i) {
+		const VertexQPNT *v = (const VertexQPNT *)(vertData.data() + i*stride);
+		double d2 = 0.0;
+		for(int k = 0; k < 3; ++k) {
+			double p = v->pos[k]/65535.0*posScale[k] + posOffset[k];
+			d2 += (p - posBuf[3*i+k])*(p - posBuf[3*i+k]);
+		}
+		posMax = max(posMax, sqrt(d2));
+		posSum += sqrt(d2);
+		if(!norBuf.empty()) {
+			glm::vec3 n(norBuf[3*i], norBuf[3*i+1], norBuf[3*i+2]);
+			if(glm::dot(n, n) > 0.0f) {
+				glm::vec3 d = octDecode(glm::vec2(v->nor[0]/32767.0f, v->nor[1]/32767.0f));
+				double c = glm::clamp(glm::dot(glm::normalize(n), d), -1.0f, 1.0f);
+				double angle = acos(c)*180.0/M_PI;
+				norMax = max(norMax, angle);
+				norSum += angle;
+			}
+		}
+		if(vertexFormat == FORMAT_QPNT) {
+			for(int k = 0; k < 2; ++k) {
+				texMax = max(texMax, (double)fabs(halfToFloat(v->tex[k]) - texBuf[2*i+k]));
+			}
+		}
+	}
+	size_t floatStride = VertexFormat::get(vertexFormat == FORMAT_QPNT ? FORMAT_PNT : FORMAT_PN).stride;
+	cout << "Quantized " << nverts << " vertices: " << floatStride << " -> " << stride << " bytes/vertex" << endl;
+	cout << "  position error max " << posMax << " (" << 100.0*posMax/extent << "% of extent), mean " << posSum/max(nverts, (size_t)1) << endl;
+	cout << "  normal error max " << norMax << " deg, mean " << norSum/max(nverts, (size_t)1) << " deg" << endl;
+	if(vertexFormat == FORMAT_QPNT) {
+		cout << "  texcoord error max " << texMax << endl;
+	}
+}
+
+unsigned Shape::packElements(vector<unsigned char> &eleData) const
+{
+	// 16-bit indices when they fit
+	if(posBuf.size()/3 <= 65536) {
+		eleData.resize(eleBuf.size()*sizeof(unsigned short));
+		unsigned short *ele16 = (unsigned short *)eleData.data();
+		for(size_t i = 0; i < eleBuf.size(); ++i) {
+			ele16[i] = (unsigned short)eleBuf[i];
+		}
+		return sizeof(unsigned short);
+	}
+	eleData.resize(eleBuf.size()*sizeof(unsigned int));
+	memcpy(eleData.data(), eleBuf.data(), eleData.size());
+	return sizeof(unsigned int);
+}
+
+bool Shape::checkRanges(size_t nelems) const
+{
+	for(const Lod &level : lods) {
+		if((uint64_t)level.first + level.count > nelems ||
+		   (uint64_t)level.firstCluster + level.clusterCount > clusters.size()) {
+			return false;
+		}
+	}
+	for(const MeshOptimizer::Cluster &cluster : clusters) {
+		if((uint64_t)cluster.first + cluster.count > nelems) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Shape::saveCache(const string &cacheName, const string &meshName, double parseTime) const
+{
+	MeshCache::Info info;
+	info.nverts = (uint32_t)(posBuf.size()/3);
+	info.nelems = (uint32_t)eleBuf.size();
+	info.vertexFormat = vertexFormat;
+	info.parseTime = parseTime;
+	computeBounds(info.bmin, info.bmax);
+	
+	// Store the arrays exactly as they will be uploaded
+	vector<unsigned char> vertData, eleData;
+	packVertices(vertData);
+	info.indexSize = packElements(eleData);
+	vector<MeshCache::SectionData> sections;
+	sections.push_back({ MeshCache::VERTEX, vertData.data(), vertData.size() });
+	sections.push_back({ MeshCache::ELEMENT, eleData.data(), eleData.size() });
+	sections.push_back({ MeshCache::LOD, lods.data(), lods.size()*sizeof(Lod) });
+	sections.push_back({ MeshCache::CLUSTER, clusters.data(), clusters.size()*sizeof(MeshOptimizer::Cluster) });
+	if(!MeshCache::save(cacheName, meshName, info, sections)) {
+		cerr << "Could not write mesh cache " << cacheName << endl;
+	}
+}
+
+void Shape::detachCache()
+{
+	// Copy the mapped arrays into the CPU-side buffers so they can be modified
+	if(!cache) {
+		return;
+	}
+	const MeshCache::Info &info = cache->getInfo();
+	const unsigned char *vert = (const unsigned char *)cache->getSection(MeshCache::VERTEX);
+	const void *ele = cache->getSection(MeshCache::ELEMENT);
+	size_t stride = VertexFormat::get(vertexFormat).stride;
+	posBuf.resize(3*info.nverts);
+	norBuf.resize(3*info.nverts);
+	texBuf.resize(vertexFormat == FORMAT_PNT ? 2*info.nverts : 0);
+	for(size_t i = 0; i < info.nverts; ++i) {
+		const VertexPNT *v = (const VertexPNT *)(vert + i*stride);
+		memcpy(&posBuf[3*i], v->pos, sizeof(v->pos));
+		memcpy(&norBuf[3*i], v->nor, sizeof(v->nor));
+		if(vertexFormat == FORMAT_PNT) {
+			memcpy(&texBuf[2*i], v->tex, sizeof(v->tex));
 		}
 	}
+	if(info.indexSize == sizeof(unsigned short)) {
+		const unsigned short *ele16 = (const unsigned short *)ele;
+		eleBuf.assign(ele16, ele16 + info.nelems);
+	} else {
+		const unsigned int *ele32 = (const unsigned int *)ele;
+		eleBuf.assign(ele32, ele32 + info.nelems);
+	}
+	cache.reset();
 }
 
 void Shape::fitToUnitBox()
 {
+	detachCache();
 	// Scale the vertex positions so that they fit within [-1, +1] in all three dimensions.
-	glm::vec3 vmin(posBuf[0], posBuf[1], posBuf[2]);
-	glm::vec3 vmax(posBuf[0], posBuf[1], posBuf[2]);
-	for(int i = 0; i < (int)posBuf.size(); i += 3) {
-		glm::vec3 v(posBuf[i], posBuf[i+1], posBuf[i+2]);
-		vmin.x = min(vmin.x, v.x);
-		vmin.y = min(vmin.y, v.y);
-		vmin.z = min(vmin.z, v.z);
-		vmax.x = max(vmax.x, v.x);
-		vmax.y = max(vmax.y, v.y);
-		vmax.z = max(vmax.z, v.z);
-	}
+	glm::vec3 vmin(boundsMin[0], boundsMin[1], boundsMin[2]);
+	glm::vec3 vmax(boundsMax[0], boundsMax[1], boundsMax[2]);
 	glm::vec3 center = 0.5f*(vmin + vmax);
 	glm::vec3 diff = vmax - vmin;
 	float diffmax = diff.x;
@@ -95,72 +580,328 @@ void Shape::fitToUnitBox()
 		posBuf[i+1] = (posBuf[i+1] - center.y) * scale;
 		posBuf[i+2] = (posBuf[i+2] - center.z) * scale;
 	}
+	// The cluster bounds move with the vertices; a uniform scale keeps the
+	// normal cones as they are
+	for(size_t c = 0; c < clusters.size(); ++c) {
+		MeshOptimizer::Cluster &cluster = clusters[c];
+		for(int k = 0; k < 3; ++k) {
+			cluster.center[k] = (cluster.center[k] - center[k]) * scale;
+		}
+		cluster.radius *= scale;
+	}
+	updateBounds();
 }
 
 void Shape::init()
 {
-	// Send the position array to the GPU
-	glGenBuffers(1, &posBufID);
-	glBindBuffer(GL_ARRAY_BUFFER, posBufID);
-	glBufferData(GL_ARRAY_BUFFER, posBuf.size()*sizeof(float), &posBuf[0], GL_STATIC_DRAW);
+	if(lods.empty()) {
+		lods.push_back({ 0, (unsigned)eleBuf.size(), 0.0f, 0, 0 });
+	}
 	
-	// Send the normal array to the GPU
-	if(!norBuf.empty()) {
-		glGenBuffers(1, &norBufID);
-		glBindBuffer(GL_ARRAY_BUFFER, norBufID);
-		glBufferData(GL_ARRAY_BUFFER, norBuf.size()*sizeof(float), &norBuf[0], GL_STATIC_DRAW);
+	if(compressed) {
+		// The cache holds float vertices, so quantize from the CPU-side buffers
+		detachCache();
+		vertexFormat = texBuf.empty() ? FORMAT_QPN : FORMAT_QPNT;
+		for(int k = 0; k < 3; ++k) {
+			posOffset[k] = boundsMin[k];
+			posScale[k] = boundsMax[k] > boundsMin[k] ? boundsMax[k] - boundsMin[k] : 1.0f;
+		}
 	}
 	
-	// Send the texture array to the GPU
-	if(!texBuf.empty()) {
-		glGenBuffers(1, &texBufID);
-		glBindBuffer(GL_ARRAY_BUFFER, texBufID);
-		glBufferData(GL_ARRAY_BUFFER, texBuf.size()*sizeof(float), &texBuf[0], GL_STATIC_DRAW);
+	// Gather the arrays from either the mapped cache or the CPU-side buffers
+	const void *vert;
+	const void *ele;
+	uint64_t vertSize, eleSize;
+	vector<unsigned char> vertData, eleData;
+	unsigned indexSize;
+	if(cache) {
+		vert = cache->getSection(MeshCache::VERTEX, &vertSize);
+		ele = cache->getSection(MeshCache::ELEMENT, &eleSize);
+		indexSize = cache->getInfo().indexSize;
+	} else {
+		packVertices(vertData);
+		indexSize = packElements(eleData);
+		if(compressed) {
+			reportQuantizationError(vertData);
+		}
+		vert = vertData.data();
+		vertSize = vertData.size();
+		ele = eleData.data();
+		eleSize = eleData.size();
+	}
+	eleType = indexSize == sizeof(unsigned short) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	
+	// Vertex array objects need GL 3.0
+	useVAO = useVAO && (GLEW_VERSION_3_0 || GLEW_ARB_vertex_array_object);
+	if(useVAO) {
+		// Keep the upload below from changing a VAO that was left bound
+		GLState::bindVertexArray(0);
+	}
+	
+	// Copy the arrays into the arena's shared buffers if there is room
+	if(arena) {
+		float decode[6] = { posScale[0], posScale[1], posScale[2], posOffset[0], posOffset[1], posOffset[2] };
+		size_t nverts = vertSize/VertexFormat::get(vertexFormat).stride;
+		if(arena->add(vertexFormat, indexSize, decode, vert, nverts, ele, eleSize/indexSize, arenaHandle)) {
+			const GeometryArena::Allocation &a = arena->getAllocation(arenaHandle);
+			vertBufID = a.vertBufID;
+			eleBufID = a.eleBufID;
+		} else {
+			arena.reset();
+		}
+	}
+	
+	if(!arena) {
+		// Send the interleaved vertex array to the GPU
+		vertBufObj = GLHandle::createBuffer();
+		vertBufID = vertBufObj.get();
+		GLState::bindBuffer(GL_ARRAY_BUFFER, vertBufID);
+		glBufferData(GL_ARRAY_BUFFER, vertSize, vert, GL_STATIC_DRAW);
+		
+		// Send the element array to the GPU
+		eleBufObj = GLHandle::createBuffer();
+		eleBufID = eleBufObj.get();
+		GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, eleSize, ele, GL_STATIC_DRAW);
+	}
+	
+	// Per-instance attributes need GL 3.3. Their buffer is filled on each
+	// drawInstanced().
+	instancing = GLEW_VERSION_3_3;
+	if(instancing) {
+		instBufObj = GLHandle::createBuffer();
 	}
 	
 	// Unbind the arrays
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, 0);
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	
 	GLSL::checkError(GET_FILE_LINE);
 }
 
-void Shape::draw(const shared_ptr<Program> prog) const
+void Shape::setAttribPointers(const shared_ptr<Program> &prog, bool enable) const
 {
-	// Bind position buffer
-	int h_pos = prog->getAttribute("aPos");
-	glEnableVertexAttribArray(h_pos);
-	glBindBuffer(GL_ARRAY_BUFFER, posBufID);
-	glVertexAttribPointer(h_pos, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
-	
-	// Bind normal buffer
-	int h_nor = prog->getAttribute("aNor");
-	if(h_nor != -1 && norBufID != 0) {
-		glEnableVertexAttribArray(h_nor);
-		glBindBuffer(GL_ARRAY_BUFFER, norBufID);
-		glVertexAttribPointer(h_nor, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
+	VertexFormat::get(vertexFormat).setAttribPointers(prog, enable);
+}
+
+void Shape::setInstanceAttribPointers(const shared_ptr<Program> &prog, bool enable)
+{
+	// The model matrix takes four attribute locations, one per column. Both
+	// attributes advance once per instance.
+	int model = prog->getAttribute("iModel");
+	int material = prog->getAttribute("iMaterial");
+	if(model == -1) {
+		return;
+	}
+	for(int i = 0; i < 5; ++i) {
+		int h = i < 4 ? model + i : material;
+		if(h == -1) {
+			continue;
+		}
+		if(enable) {
+			size_t offset = i < 4 ? offsetof(Instance, model) + 4*i*sizeof(float) : offsetof(Instance, material);
+			glEnableVertexAttribArray(h);
+			glVertexAttribPointer(h, i < 4 ? 4 : 1, GL_FLOAT, GL_FALSE, sizeof(Instance), (const void *)offset);
+			glVertexAttribDivisor(h, 1);
+		} else {
+			glDisableVertexAttribArray(h);
+			glVertexAttribDivisor(h, 0);
+		}
+	}
+}
+
+void Shape::setDecodeUniforms(const ProgramBinding &b) const
+{
+	// Tell the vertex shader how the attributes are stored. The attributes
+	// are never enabled in this shape's VAOs, so they keep these values.
+	glUniform3fv(b.posScale, 1, posScale);
+	glUniform3fv(b.posOffset, 1, posOffset);
+	if(b.posScaleAttrib != -1) {
+		glVertexAttrib3fv(b.posScaleAttrib, posScale);
+	}
+	if(b.posOffsetAttrib != -1) {
+		glVertexAttrib3fv(b.posOffsetAttrib, posOffset);
+	}
+}
+
+const Shape::ProgramBinding &Shape::getBinding(const shared_ptr<Program> &prog) const
+{
+	auto found = bindings.find(prog->getSerial());
+	if(found != bindings.end() && (found->second.vao.get() || !useVAO)) {
+		return found->second;
+	}
+	// First draw with this program, or the first since VAOs were turned on:
+	// look up the decode uniforms and record the attribute setup in a new VAO
+	ProgramBinding &b = bindings[prog->getSerial()];
+	b.posScale = prog->getUniform(POS_SCALE);
+	b.posOffset = prog->getUniform(POS_OFFSET);
+	b.posScaleAttrib = prog->getAttribute("iPosScale");
+	b.posOffsetAttrib = prog->getAttribute("iPosOffset");
+	if(useVAO) {
+		b.vao = GLHandle::createVertexArray();
+		GLState::bindVertexArray(b.vao.get());
+		GLState::bindBuffer(GL_ARRAY_BUFFER, vertBufID);
+		GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
+		setAttribPointers(prog, true);
+		if(instancing) {
+			GLState::bindBuffer(GL_ARRAY_BUFFER, instBufObj.get());
+			setInstanceAttribPointers(prog, true);
+		}
+		GLState::bindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	return b;
+}
+
+void Shape::cullClusters(const Lod &level, const Frustum *frustum) const
+{
+	// Collect the index ranges to draw, merging clusters that are next to
+	// each other in the element buffer
+	size_t indexSize = eleType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+	unsigned baseIndex = getBaseIndex();
+	drawCounts.clear();
+	drawOffsets.clear();
+	cullStats.triangles += level.count/3;
+	if(!frustum || level.clusterCount == 0) {
+		drawCounts.push_back((int)level.count);
+		drawOffsets.push_back((const void *)((baseIndex + level.first)*indexSize));
+		cullStats.trianglesDrawn += level.count/3;
+		return;
+	}
+	unsigned end = ~0u;
+	for(unsigned c = level.firstCluster; c < level.firstCluster + level.clusterCount; ++c) {
+		const MeshOptimizer::Cluster &cluster = clusters[c];
+		cullStats.clusters++;
+		if(!frustum->intersectsSphere(cluster.center, cluster.radius)) {
+			cullStats.frustumCulled++;
+			continue;
+		}
+		if(frustum->isBackfacing(cluster.center, cluster.radius, cluster.coneAxis, cluster.coneCutoff)) {
+			cullStats.backfaceCulled++;
+			continue;
+		}
+		cullStats.trianglesDrawn += cluster.count/3;
+		if(cluster.first == end) {
+			drawCounts.back() += (int)cluster.count;
+		} else {
+			drawCounts.push_back((int)cluster.count);
+			drawOffsets.push_back((const void *)((baseIndex + cluster.first)*indexSize));
+		}
+		end = cluster.first + cluster.count;
+	}
+}
+
+int Shape::getBaseVertex() const
+{
+	return arena ? (int)arena->getAllocation(arenaHandle).baseVertex : 0;
+}
+
+unsigned Shape::getBaseIndex() const
+{
+	return arena ? arena->getAllocation(arenaHandle).firstIndex : 0;
+}
+
+void Shape::multiDraw() const
+{
+	GLsizei ndraws = (GLsizei)drawCounts.size();
+	int baseVertex = getBaseVertex();
+	if(baseVertex == 0) {
+		glMultiDrawElements(GL_TRIANGLES, drawCounts.data(), eleType, drawOffsets.data(), ndraws);
+		return;
+	}
+	// The vertices are somewhere in the middle of the arena's buffer
+	drawBaseVertices.assign(ndraws, baseVertex);
+	glMultiDrawElementsBaseVertex(GL_TRIANGLES, drawCounts.data(), eleType, drawOffsets.data(), ndraws, drawBaseVertices.data());
+}
+
+void Shape::draw(const shared_ptr<Program> prog, int lod, const Frustum *frustum) const
+{
+	cullClusters(lods[min(max(lod, 0), (int)lods.size() - 1)], frustum);
+	if(drawCounts.empty()) {
+		return;
 	}
+	const ProgramBinding &b = getBinding(prog);
+	setDecodeUniforms(b);
 	
-	// Bind texcoords buffer
-	int h_tex = prog->getAttribute("aTex");
-	if(h_tex != -1 && texBufID != 0) {
-		glEnableVertexAttribArray(h_tex);
-		glBindBuffer(GL_ARRAY_BUFFER, texBufID);
-		glVertexAttribPointer(h_tex, 2, GL_FLOAT, GL_FALSE, 0, (const void *)0);
+	if(useVAO) {
+		// The VAO is left bound; init() unbinds it before touching any buffers.
+		GLState::bindVertexArray(b.vao.get());
+		multiDraw();
+		GLSL::checkError(GET_FILE_LINE);
+		return;
 	}
 	
-	// Draw
-	int count = posBuf.size()/3; // number of indices to be rendered
-	glDrawArrays(GL_TRIANGLES, 0, count);
+	// No VAOs: set up the attributes on every draw, in the default VAO so
+	// that the last shape's one is left as it was recorded
+	GLState::bindVertexArray(0);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, vertBufID);
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
+	setAttribPointers(prog, true);
+	multiDraw();
+	setAttribPointers(prog, false);
 	
-	// Disable and unbind
-	if(h_tex != -1) {
-		glDisableVertexAttribArray(h_tex);
+	// The buffers stay bound, so the next draw of this shape skips binding
+	// them (see GLState)
+	GLSL::checkError(GET_FILE_LINE);
+}
+
+void Shape::drawInstanced(const shared_ptr<Program> prog, const vector<Instance> &instances, int lod) const
+{
+	if(!instancing || instances.empty()) {
+		return;
 	}
-	if(h_nor != -1) {
-		glDisableVertexAttribArray(h_nor);
+	const Lod &level = lods[min(max(lod, 0), (int)lods.size() - 1)];
+	size_t indexSize = eleType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+	const void *offset = (const void *)((getBaseIndex() + level.first)*indexSize);
+	int baseVertex = getBaseVertex();
+	GLsizei ninstances = (GLsizei)instances.size();
+	cullStats.triangles += (unsigned long long)level.count/3*ninstances;
+	cullStats.trianglesDrawn += (unsigned long long)level.count/3*ninstances;
+	
+	const ProgramBinding &b = getBinding(prog);
+	setDecodeUniforms(b);
+	
+	// Replace the instance data; the old contents may still be in use by the
+	// previous draw, so let the driver hand out new storage
+	GLState::bindBuffer(GL_ARRAY_BUFFER, instBufObj.get());
+	glBufferData(GL_ARRAY_BUFFER, instances.size()*sizeof(Instance), instances.data(), GL_STREAM_DRAW);
+	
+	if(useVAO) {
+		GLState::bindVertexArray(b.vao.get());
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, (GLsizei)level.count, eleType, offset, ninstances, baseVertex);
+		GLSL::checkError(GET_FILE_LINE);
+		return;
 	}
-	glDisableVertexAttribArray(h_pos);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	
+	GLState::bindVertexArray(0);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, vertBufID);
+	GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
+	setAttribPointers(prog, true);
+	GLState::bindBuffer(GL_ARRAY_BUFFER, instBufObj.get());
+	setInstanceAttribPointers(prog, true);
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, (GLsizei)level.count, eleType, offset, ninstances, baseVertex);
+	setInstanceAttribPointers(prog, false);
+	setAttribPointers(prog, false);
 	
 	GLSL::checkError(GET_FILE_LINE);
 }
+
+void Shape::queueDraw(const Instance &instance, int lod, const Frustum *frustum) const
+{
+	cullClusters(lods[min(max(lod, 0), (int)lods.size() - 1)], frustum);
+	if(drawCounts.empty()) {
+		return;
+	}
+	// One command per visible index range, all reading the same instance
+	size_t indexSize = eleType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+	unsigned baseInstance = arena->addInstance(instance, arenaHandle);
+	const GeometryArena::Allocation &a = arena->getAllocation(arenaHandle);
+	for(size_t i = 0; i < drawCounts.size(); ++i) {
+		GeometryArena::DrawCommand command;
+		command.count = (unsigned)drawCounts[i];
+		command.instanceCount = 1;
+		command.firstIndex = (unsigned)((size_t)drawOffsets[i]/indexSize);
+		command.baseVertex = (int)a.baseVertex;
+		command.baseInstance = baseInstance;
+		arena->addCommand(a.pool, command);
+	}
+}
@@ -2,18 +2,56 @@
 #ifndef SHAPE_H
 #define SHAPE_H
 
+#include <map>
 #include <string>
 #include <vector>
 #include <memory>
 
+#include "GLHandle.h"
+#include "MeshOptimizer.h"
+
+class Frustum;
+class GeometryArena;
+class MeshCache;
 class Program;
 
 /**
- * A shape defined by a list of triangles
- * - posBuf should be of length 3*ntris
- * - norBuf should be of length 3*ntris (if normals are available)
- * - texBuf should be of length 2*ntris (if texture coords are available)
- * posBufID, norBufID, and texBufID are OpenGL buffer identifiers.
+ * A shape defined by a list of indexed triangles
+ * - posBuf should be of length 3*nverts
+ * - norBuf should be of length 3*nverts (if normals are available)
+ * - texBuf should be of length 2*nverts (if texture coords are available)
+ * - eleBuf should be of length 3*ntris
+ * Vertices are welded on load, so each unique (position, normal, texcoord)
+ * combination is stored once, and the triangles and vertices are reordered
+ * for the post-transform cache, overdraw, and vertex fetch. On the GPU, the
+ * attributes are interleaved into a single vertex buffer (vertBufID) next to
+ * the element buffer (eleBufID).
+ * A vertex array object is recorded for each program the shape is drawn
+ * with, so a draw is one bind and one draw call.
+ * Coarser levels of detail (50, 25, 10, and 5% of the triangles) are built
+ * by quadric edge collapse on load. They reuse the vertices of the full mesh,
+ * and their index ranges follow it in the element buffer.
+ * Each level is split into clusters of up to 128 triangles with similar
+ * normals. Given a frustum, draw() skips the clusters that are outside of it
+ * or that face away from the camera, and submits the rest with
+ * glMultiDrawElements.
+ * drawInstanced() draws many copies of one level of detail in a single call.
+ * The per-instance model matrices and material indices are streamed into
+ * instBufObj and read by the iModel and iMaterial attributes of the
+ * INSTANCED shader variants.
+ * With setArena(), init() places the arrays in the shared buffers of a
+ * GeometryArena instead, and queueDraw() adds the visible clusters to the
+ * arena's next multi-draw indirect submission.
+ * With setCompressed(true), positions are stored as 16-bit fixed point inside
+ * the mesh bounds, normals as 2x16-bit octahedral vectors, and texcoords as
+ * half floats; the vertex shaders decode them using the posScale and posOffset
+ * uniforms that draw() sets, and need the define of getVertexFormat(). The
+ * INSTANCED variants read the decoding from the iPosScale and iPosOffset
+ * attributes instead, which drawInstanced() sets for all instances and the
+ * arena per draw.
+ * The welded mesh is cached next to the OBJ file (meshName + ".a3mesh"). When
+ * a valid cache exists, the arrays stay in the mapped cache file and the
+ * CPU-side buffers are left empty until something needs to modify them.
  */
 class Shape
 {
@@ -23,15 +61,126 @@ public:
 	void loadMesh(const std::string &meshName);
 	void fitToUnitBox();
 	void init();
-	void draw(const std::shared_ptr<Program> prog) const;
+	struct CullStats {
+		unsigned clusters;
+		unsigned frustumCulled;
+		unsigned backfaceCulled;
+		unsigned long long triangles;
+		unsigned long long trianglesDrawn;
+	};
+	// Per-instance data for drawInstanced()
+	struct Instance {
+		float model[16]; // column-major, applied before the view matrix
+		float material; // index into the program's material arrays
+	};
+	
+	// Draws the given level of detail, culling its clusters against frustum
+	// if one is given
+	void draw(const std::shared_ptr<Program> prog, int lod = 0, const Frustum *frustum = 0) const;
+	// Draws a copy of the given level of detail for each instance, without
+	// cluster culling. Needs a program with the iModel attribute.
+	void drawInstanced(const std::shared_ptr<Program> prog, const std::vector<Instance> &instances, int lod = 0) const;
+	// Queues the given level of detail, culled like draw(), for the next
+	// GeometryArena::submit(). The shape must have been placed in an arena.
+	void queueDraw(const Instance &instance, int lod = 0, const Frustum *frustum = 0) const;
+	int getLODCount() const { return (int)lods.size(); }
+	// Picks a level of detail for a shape whose bounding sphere covers
+	// pixelRadius pixels on screen, given the level used last frame.
+	int selectLOD(float pixelRadius, int current) const;
+	// Bounding box and sphere of the vertices
+	void getBounds(float bmin[3], float bmax[3]) const;
+	void getBoundingSphere(float center[3], float &radius) const;
+	// Cluster culling totals since the last reset
+	const CullStats &getCullStats() const { return cullStats; }
+	void resetCullStats();
+	// Set up the vertex attributes on every draw instead of using cached
+	// VAOs. Ignored with a core profile, which has no default VAO to set
+	// them in.
+	void setUseVAO(bool b);
+	bool isUsingVAO() const { return useVAO; }
+	// Use the quantized vertex format. Must be called before init().
+	void setCompressed(bool b) { compressed = b; }
+	bool isCompressed() const { return compressed; }
+	// FORMAT_PN etc., known after init()
+	unsigned getVertexFormat() const { return vertexFormat; }
+	// Put the arrays in a shared arena. Must be called before init().
+	void setArena(const std::shared_ptr<GeometryArena> &a) { arena = a; }
+	bool isInArena() const { return arena != nullptr; }
+	// Whether drawInstanced() is supported (GL 3.3, for the attribute divisors)
+	bool isInstancing() const { return instancing; }
+	// Points the program's iModel and iMaterial attributes at the Instance
+	// array bound to GL_ARRAY_BUFFER, or disables them
+	static void setInstanceAttribPointers(const std::shared_ptr<Program> &prog, bool enable);
 	
 private:
+	// Per-program state, created on the first draw with each program
+	struct ProgramBinding {
+		GLHandle vao;
+		int posScale;
+		int posOffset;
+		int posScaleAttrib; // of the INSTANCED variants
+		int posOffsetAttrib;
+	};
+	
+	// Index range of one level of detail in eleBuf, and its clusters
+	struct Lod {
+		unsigned first;
+		unsigned count;
+		float error; // relative to the bounding sphere radius
+		unsigned firstCluster;
+		unsigned clusterCount;
+	};
+	
+	void optimize(const std::string &meshName);
+	void buildLODs(const std::string &meshName);
+	void computeBounds(float bmin[3], float bmax[3]) const;
+	void updateBounds();
+	void reportQuantizationError(const std::vector<unsigned char> &vertData) const;
+	void packVertices(std::vector<unsigned char> &vertData) const;
+	unsigned packElements(std::vector<unsigned char> &eleData) const;
+	void cullClusters(const Lod &level, const Frustum *frustum) const;
+	void setAttribPointers(const std::shared_ptr<Program> &prog, bool enable) const;
+	void setDecodeUniforms(const ProgramBinding &b) const;
+	void multiDraw() const;
+	// Where the arrays start in the arena's buffers, 0 outside of an arena
+	int getBaseVertex() const;
+	unsigned getBaseIndex() const;
+	const ProgramBinding &getBinding(const std::shared_ptr<Program> &prog) const;
+	// Whether the levels and clusters index inside nelems elements
+	bool checkRanges(size_t nelems) const;
+	void saveCache(const std::string &cacheName, const std::string &meshName, double parseTime) const;
+	void detachCache();
+	
+	std::shared_ptr<MeshCache> cache;
+	std::shared_ptr<GeometryArena> arena;
+	unsigned arenaHandle;
 	std::vector<float> posBuf;
 	std::vector<float> norBuf;
 	std::vector<float> texBuf;
-	unsigned posBufID;
-	unsigned norBufID;
-	unsigned texBufID;
+	std::vector<unsigned int> eleBuf; // all levels of detail, finest first
+	std::vector<Lod> lods;
+	std::vector<MeshOptimizer::Cluster> clusters;
+	unsigned vertexFormat;
+	unsigned vertBufID; // vertBufObj and eleBufObj, or the arena's buffers
+	unsigned eleBufID;
+	GLHandle vertBufObj;
+	GLHandle eleBufObj;
+	GLHandle instBufObj;
+	unsigned eleType; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	bool useVAO;
+	bool compressed;
+	bool instancing;
+	float posScale[3];
+	float posOffset[3];
+	float boundsMin[3];
+	float boundsMax[3];
+	float sphereCenter[3];
+	float sphereRadius;
+	mutable std::map<unsigned, ProgramBinding> bindings; // by Program::getSerial()
+	mutable std::vector<int> drawCounts; // visible index ranges
+	mutable std::vector<const void *> drawOffsets;
+	mutable std::vector<int> drawBaseVertices;
+	mutable CullStats cullStats;
 };
 
 #endif
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * A fixed-size ring that one producer thread pushes to and one consumer
+ * thread pops from, without locks. Each side only writes its own index, and
+ * publishes it with release ordering after touching the slots it covers.
+ * The capacity is rounded up to a power of two.
+ */
+template<typename T>
+class SpscQueue
+{
+public:
+	SpscQueue(size_t capacity) :
+		head(0),
+		tail(0)
+	{
+		size_t size = 1;
+		while(size < capacity) {
+			size *= 2;
+		}
+		slots.resize(size);
+		mask = size - 1;
+	}
+
+	// Producer: returns false, and drops the value, if the ring is full
+	bool push(const T &value)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if(t - head.load(std::memory_order_acquire) == slots.size()) {
+			return false;
+		}
+		slots[t & mask] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer: returns false if the ring is empty
+	bool pop(T &value)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if(h == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = slots[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<T> slots;
+	size_t mask;
+	// On separate cache lines, so that the two threads do not share one
+	alignas(64) std::atomic<size_t> head; // next slot to pop
+	alignas(64) std::atomic<size_t> tail; // next slot to push
+};
+
+#endif
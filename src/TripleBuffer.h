@@ -0,0 +1,55 @@
+#pragma once
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+
+/**
+ * Hands the latest value from one writer thread to one reader thread without
+ * locks. The writer fills the back slot and publishes it by swapping it with
+ * the middle slot; the reader takes the middle slot, if it is newer than the
+ * one it holds, by swapping it with the front slot. Neither side ever waits,
+ * and values published between two reads are skipped.
+ */
+template<typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer() :
+		front(0),
+		middle(1),
+		back(2)
+	{
+	}
+
+	// Writer: the slot to fill, then publish()
+	T &getBack() { return slots[back]; }
+	void publish()
+	{
+		back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// Reader: takes the last published value, if there is a new one. Returns
+	// true if getFront() changed.
+	bool update()
+	{
+		if(!(middle.load(std::memory_order_relaxed) & FRESH)) {
+			return false;
+		}
+		front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+	const T &getFront() const { return slots[front]; }
+
+private:
+	// The middle index carries a flag set by publish() and cleared by update()
+	static const unsigned INDEX = 3;
+	static const unsigned FRESH = 4;
+
+	T slots[3];
+	unsigned front; // reader only
+	std::atomic<unsigned> middle;
+	unsigned back; // writer only
+};
+
+#endif
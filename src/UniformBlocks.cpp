@@ -0,0 +1,169 @@
+#include "UniformBlocks.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "GLSL.h"
+#include "GLState.h"
+#include "Light.h"
+#include "Material.h"
+#include "Program.h"
+
+using namespace std;
+
+namespace {
+
+const unsigned OBJECT_SLOTS = 256;
+
+size_t alignUp(size_t size, size_t alignment)
+{
+	return (size + alignment - 1)/alignment*alignment;
+}
+
+}
+
+UniformBlocks::UniformBlocks() :
+	materialOffset(0),
+	materialStride(0),
+	objectStride(0),
+	objectSlot(0),
+	objectSlots(OBJECT_SLOTS),
+	materialCount(0)
+{
+}
+
+UniformBlocks::~UniformBlocks()
+{
+}
+
+bool UniformBlocks::isSupported()
+{
+	return GLEW_VERSION_3_1;
+}
+
+void UniformBlocks::init()
+{
+	// Ranges bound with glBindBufferRange must start at a multiple of this
+	GLint alignment = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	alignment = max(alignment, 16);
+	materialOffset = alignUp(MAX_MATERIALS*sizeof(MaterialBlock), alignment);
+	materialStride = alignUp(sizeof(MaterialBlock), alignment);
+	objectStride = alignUp(sizeof(ObjectBlock), alignment);
+
+	frameBuf = GLHandle::createBuffer();
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, frameBuf.get());
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), NULL, GL_STREAM_DRAW);
+	GLState::bindBufferBase(GL_UNIFORM_BUFFER, FRAME_BINDING, frameBuf.get());
+
+	materialBuf = GLHandle::createBuffer();
+	objectBuf = GLHandle::createBuffer();
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, objectBuf.get());
+	glBufferData(GL_UNIFORM_BUFFER, objectSlots*objectStride, NULL, GL_STREAM_DRAW);
+	objectSlot = 0;
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	GLSL::checkError(GET_FILE_LINE);
+}
+
+void UniformBlocks::attach(const shared_ptr<Program> &prog)
+{
+	const char *names[] = { "Frame", "Material", "Object", "MaterialTable" };
+	for(unsigned b = 0; b < 4; ++b) {
+		GLuint index = prog->getUniformBlock(names[b]);
+		if(index != GL_INVALID_INDEX) {
+			glUniformBlockBinding(prog->getPID(), index, b);
+		}
+	}
+}
+
+void UniformBlocks::setFrame(const glm::mat4 &P, const glm::mat4 &V, const vector<Light> &lights)
+{
+	FrameBlock frame;
+	memset(&frame, 0, sizeof(frame));
+	memcpy(frame.P, glm::value_ptr(P), sizeof(frame.P));
+	memcpy(frame.V, glm::value_ptr(V), sizeof(frame.V));
+	int count = min((int)lights.size(), MAX_LIGHTS);
+	for(int i = 0; i < count; ++i) {
+		frame.lightPos[i][0] = lights[i].posX;
+		frame.lightPos[i][1] = lights[i].posY;
+		frame.lightPos[i][2] = lights[i].posZ;
+		frame.lightPos[i][3] = 1.0f;
+		frame.lightColor[i][0] = lights[i].colX;
+		frame.lightColor[i][1] = lights[i].colY;
+		frame.lightColor[i][2] = lights[i].colZ;
+		frame.lightColor[i][3] = 1.0f;
+	}
+	// Replace the whole buffer so that the last frame's draws keep theirs
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, frameBuf.get());
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), &frame, GL_STREAM_DRAW);
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void UniformBlocks::setMaterials(const vector<Material> &materials)
+{
+	materialCount = min((int)materials.size(), MAX_MATERIALS);
+	vector<unsigned char> data(materialOffset + materialCount*materialStride, 0);
+	for(int i = 0; i < materialCount; ++i) {
+		const Material &m = materials[i];
+		MaterialBlock block = {
+			{ m.kax, m.kay, m.kaz, 0.0f },
+			{ m.kdx, m.kdy, m.kdz, 0.0f },
+			{ m.ksx, m.ksy, m.ksz },
+			m.s
+		};
+		// Once in the table and once in the material's own range
+		memcpy(&data[i*sizeof(MaterialBlock)], &block, sizeof(block));
+		memcpy(&data[materialOffset + i*materialStride], &block, sizeof(block));
+	}
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, materialBuf.get());
+	glBufferData(GL_UNIFORM_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+	GLState::bindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_TABLE_BINDING, materialBuf.get(), 0, MAX_MATERIALS*sizeof(MaterialBlock));
+	bindMaterial(0);
+}
+
+void UniformBlocks::bindMaterial(int material)
+{
+	if(material < 0 || material >= materialCount) {
+		return;
+	}
+	GLState::bindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BINDING, materialBuf.get(), materialOffset + material*materialStride, sizeof(MaterialBlock));
+}
+
+void UniformBlocks::setObject(const glm::mat4 &MV)
+{
+	ObjectBlock object;
+	packObject(MV, object);
+	setObject(object);
+}
+
+void UniformBlocks::packObject(const glm::mat4 &MV, ObjectBlock &object)
+{
+	memcpy(object.MV, glm::value_ptr(MV), sizeof(object.MV));
+	glm::mat3 N = glm::transpose(glm::inverse(glm::mat3(MV)));
+	for(int c = 0; c < 3; ++c) {
+		object.N[4*c] = N[c][0];
+		object.N[4*c + 1] = N[c][1];
+		object.N[4*c + 2] = N[c][2];
+		object.N[4*c + 3] = 0.0f;
+	}
+}
+
+void UniformBlocks::setObject(const ObjectBlock &object)
+{
+	// Start a new buffer when the ring wraps, rather than overwrite slots
+	// that queued draws may still read
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, objectBuf.get());
+	if(objectSlot == objectSlots) {
+		glBufferData(GL_UNIFORM_BUFFER, objectSlots*objectStride, NULL, GL_STREAM_DRAW);
+		objectSlot = 0;
+	}
+	size_t offset = objectSlot*objectStride;
+	glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(ObjectBlock), &object);
+	GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+	GLState::bindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BINDING, objectBuf.get(), offset, sizeof(ObjectBlock));
+	objectSlot++;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#ifndef UNIFORMBLOCKS_H
+#define UNIFORMBLOCKS_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include "GLHandle.h"
+
+class Program;
+class Material;
+class Light;
+
+/**
+ * The std140 uniform blocks that every program reads its camera, lights,
+ * material, and object transform from, so that they are uploaded once
+ * instead of with one glUniform call per value per program:
+ * - Frame: P, the view matrix V, and the lights, set once per frame
+ * - Material: ka, kd, ks, and s of one material. All materials are uploaded
+ *   together by setMaterials() and one is picked by binding its range of the
+ *   buffer with bindMaterial().
+ * - MaterialTable: the same materials as an array, indexed per instance by
+ *   the INSTANCED shader variants
+ * - Object: MV and the normal matrix N, set for each draw. Each setObject()
+ *   writes a new slot of a ring so that draws still in flight keep theirs.
+ * Each block has a fixed binding point, which attach() assigns in a program.
+ */
+class UniformBlocks
+{
+public:
+	enum Binding {
+		FRAME_BINDING,
+		MATERIAL_BINDING,
+		OBJECT_BINDING,
+		MATERIAL_TABLE_BINDING
+	};
+	// Length of the MaterialTable array in the shaders
+	static const int MAX_MATERIALS = 8;
+	// Lights in the Frame block; more are ignored, fewer are black
+	static const int MAX_LIGHTS = 2;
+	// std140 layout of the Object block: the columns of mat3s take 16 bytes
+	struct ObjectBlock {
+		float MV[16];
+		float N[12];
+	};
+
+	UniformBlocks();
+	virtual ~UniformBlocks();
+	// Uniform blocks need GL 3.1
+	static bool isSupported();
+	void init();
+	// Points the program's blocks, if it has them, at the binding points
+	static void attach(const std::shared_ptr<Program> &prog);
+
+	void setFrame(const glm::mat4 &P, const glm::mat4 &V, const std::vector<Light> &lights);
+	void setMaterials(const std::vector<Material> &materials);
+	void bindMaterial(int material);
+	void setObject(const glm::mat4 &MV);
+	// Computes N and lays out the block, without GL calls, so that it can be
+	// done on any thread ahead of setObject()
+	static void packObject(const glm::mat4 &MV, ObjectBlock &object);
+	void setObject(const ObjectBlock &object);
+
+private:
+	// std140 layouts: vec3s and the columns of mat3s take 16 bytes
+	struct FrameBlock {
+		float P[16];
+		float V[16];
+		float lightPos[MAX_LIGHTS][4];
+		float lightColor[MAX_LIGHTS][4];
+	};
+	struct MaterialBlock {
+		float ka[4];
+		float kd[4];
+		float ks[3];
+		float s;
+	};
+
+	GLHandle frameBuf;
+	GLHandle materialBuf; // the table, then one aligned range per material
+	GLHandle objectBuf;
+	size_t materialOffset; // of the first per-material range
+	size_t materialStride;
+	size_t objectStride;
+	unsigned objectSlot; // next slot of the ring
+	unsigned objectSlots;
+	int materialCount;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include "VertexFormat.h"
+
+#include "Program.h"
+
+using namespace std;
+
+namespace {
+
+const VertexFormat::Attrib LAYOUT_PN[] = {
+	{ "aPos", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPN, pos) },
+	{ "aNor", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPN, nor) }
+};
+
+const VertexFormat::Attrib LAYOUT_PNT[] = {
+	{ "aPos", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPNT, pos) },
+	{ "aNor", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPNT, nor) },
+	{ "aTex", 2, GL_FLOAT, GL_FALSE, offsetof(VertexPNT, tex) }
+};
+
+const VertexFormat::Attrib LAYOUT_QPN[] = {
+	{ "aPos", 3, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(VertexQPN, pos) },
+	{ "aNor", 2, GL_SHORT, GL_TRUE, offsetof(VertexQPN, nor) }
+};
+
+const VertexFormat::Attrib LAYOUT_QPNT[] = {
+	{ "aPos", 3, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(VertexQPNT, pos) },
+	{ "aNor", 2, GL_SHORT, GL_TRUE, offsetof(VertexQPNT, nor) },
+	{ "aTex", 2, GL_HALF_FLOAT, GL_FALSE, offsetof(VertexQPNT, tex) }
+};
+
+// Indexed by FORMAT_PN etc.
+const VertexFormat FORMATS[] = {
+	{ LAYOUT_PN, sizeof(LAYOUT_PN)/sizeof(VertexFormat::Attrib), sizeof(VertexPN), NULL },
+	{ LAYOUT_PNT, sizeof(LAYOUT_PNT)/sizeof(VertexFormat::Attrib), sizeof(VertexPNT), NULL },
+	{ LAYOUT_QPN, sizeof(LAYOUT_QPN)/sizeof(VertexFormat::Attrib), sizeof(VertexQPN), "OCT_NORMALS" },
+	{ LAYOUT_QPNT, sizeof(LAYOUT_QPNT)/sizeof(VertexFormat::Attrib), sizeof(VertexQPNT), "OCT_NORMALS" }
+};
+
+}
+
+const VertexFormat &VertexFormat::get(unsigned format)
+{
+	return FORMATS[format];
+}
+
+void VertexFormat::setAttribPointers(const shared_ptr<Program> &prog, bool enable) const
+{
+	for(int i = 0; i < nattribs; ++i) {
+		const Attrib &a = attribs[i];
+		int h = prog->getAttribute(a.name);
+		if(h == -1) {
+			continue;
+		}
+		if(enable) {
+			glEnableVertexAttribArray(h);
+			glVertexAttribPointer(h, a.size, a.type, a.normalized, (GLsizei)stride, (const void *)a.offset);
+		} else {
+			glDisableVertexAttribArray(h);
+		}
+	}
+}
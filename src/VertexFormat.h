@@ -0,0 +1,70 @@
+#pragma once
+#ifndef VERTEXFORMAT_H
+#define VERTEXFORMAT_H
+
+#include <cstddef>
+#include <memory>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+class Program;
+
+// Interleaved vertices. The quantized formats store positions as unorm16
+// inside the mesh bounds (the 4th component is padding), normals as snorm16
+// octahedral, and texcoords as half floats; the vertex shaders decode them.
+struct VertexPN {
+	float pos[3];
+	float nor[3];
+};
+
+struct VertexPNT {
+	float pos[3];
+	float nor[3];
+	float tex[2];
+};
+
+struct VertexQPN {
+	unsigned short pos[4];
+	short nor[2];
+};
+
+struct VertexQPNT {
+	unsigned short pos[4];
+	short nor[2];
+	unsigned short tex[2];
+};
+
+// Indices of the formats, as stored in the mesh cache
+const unsigned FORMAT_PN = 0;
+const unsigned FORMAT_PNT = 1;
+const unsigned FORMAT_QPN = 2;
+const unsigned FORMAT_QPNT = 3;
+
+/**
+ * An interleaved vertex format, described at compile time by its attribute
+ * table. Used by Shape for its own buffers and by GeometryArena for the
+ * shared ones.
+ */
+struct VertexFormat {
+	// One attribute of an interleaved vertex
+	struct Attrib {
+		const char *name;
+		GLint size;
+		GLenum type;
+		GLboolean normalized;
+		size_t offset;
+	};
+	
+	const Attrib *attribs;
+	int nattribs;
+	size_t stride;
+	const char *define; // that the vertex shaders decode this format with, or NULL
+	
+	static const VertexFormat &get(unsigned format);
+	// Points the program's attributes at the buffer bound to GL_ARRAY_BUFFER,
+	// or disables them
+	void setAttribPointers(const std::shared_ptr<Program> &prog, bool enable) const;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+WorkerPool::WorkerPool(int nthreads) :
+	job(0),
+	count(0),
+	ranges(0),
+	generation(0),
+	pending(0),
+	stopping(false)
+{
+	if(nthreads <= 0) {
+		nthreads = max(1, (int)thread::hardware_concurrency());
+	}
+	for(int w = 1; w < nthreads; ++w) {
+		workers.emplace_back(&WorkerPool::workerMain, this, w);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		lock_guard<mutex> lock(stateMutex);
+		stopping = true;
+	}
+	started.notify_all();
+	for(auto &worker : workers) {
+		worker.join();
+	}
+}
+
+void WorkerPool::run(size_t count, const Job &job, size_t minCount)
+{
+	int ranges = (int)min((size_t)getThreadCount(), max((size_t)1, count/max(minCount, (size_t)1)));
+	if(ranges <= 1) {
+		job(0, 0, count);
+		return;
+	}
+	{
+		lock_guard<mutex> lock(stateMutex);
+		this->job = &job;
+		this->count = count;
+		this->ranges = ranges;
+		pending = (int)workers.size();
+		generation++;
+	}
+	started.notify_all();
+	runRange(0);
+	unique_lock<mutex> lock(stateMutex);
+	finished.wait(lock, [this]() { return pending == 0; });
+	this->job = 0;
+}
+
+void WorkerPool::runRange(int worker)
+{
+	if(worker < ranges) {
+		size_t begin = count*worker/ranges;
+		size_t end = count*(worker + 1)/ranges;
+		(*job)(worker, begin, end);
+	}
+}
+
+void WorkerPool::workerMain(int worker)
+{
+	unsigned seen = 0;
+	for(;;) {
+		{
+			unique_lock<mutex> lock(stateMutex);
+			started.wait(lock, [&]() { return stopping || generation != seen; });
+			if(stopping) {
+				return;
+			}
+			seen = generation;
+		}
+		runRange(worker);
+		bool last;
+		{
+			lock_guard<mutex> lock(stateMutex);
+			last = --pending == 0;
+		}
+		if(last) {
+			finished.notify_one();
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Threads that stay alive between frames to run the ranges of a parallel
+ * loop. run() splits [0, count) into one contiguous range per thread, runs
+ * the first range on the calling thread, and returns once every range is
+ * done. Each range is given the index of its worker, so that it can write to
+ * that worker's own buffers without locking. Jobs must not make GL calls.
+ */
+class WorkerPool
+{
+public:
+	// begin and end bound the range, worker is in [0, getThreadCount())
+	typedef std::function<void(int worker, size_t begin, size_t end)> Job;
+
+	// nthreads <= 0 picks the number of hardware threads. The calling
+	// thread counts as one of them.
+	WorkerPool(int nthreads = 0);
+	virtual ~WorkerPool();
+	int getThreadCount() const { return (int)workers.size() + 1; }
+	// Ranges get at least minCount items, so small loops are run on the
+	// calling thread alone without waking the workers.
+	void run(size_t count, const Job &job, size_t minCount = 1);
+
+private:
+	void workerMain(int worker);
+	void runRange(int worker);
+
+	std::vector<std::thread> workers;
+	std::mutex stateMutex;
+	std::condition_variable started;
+	std::condition_variable finished;
+	const Job *job; // of the current run
+	size_t count;
+	int ranges;
+	unsigned generation; // incremented by each run that wakes the workers
+	int pending; // workers still busy with the current run
+	bool stopping;
+};
+
+#endif
@@ -1,8 +1,13 @@
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
 #define _USE_MATH_DEFINES
 #include <cmath>
+#include <iomanip>
 #include <iostream>
+#include <thread>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -18,125 +23,822 @@
 #include "stb_image_write.h"
 
 #include "Camera.h"
+#include "Frustum.h"
+#include "GeometryArena.h"
+#include "GLHandle.h"
 #include "GLSL.h"
+#include "GLState.h"
 #include "MatrixStack.h"
 #include "Program.h"
+#include "RenderQueue.h"
+#include "Scene.h"
+#include "ShaderVariants.h"
+#include "SpscQueue.h"
 #include "Shape.h"
-#include "Material.h"
-#include "Light.h"
+#include "TripleBuffer.h"
+#include "UniformBlocks.h"
+#include "VertexFormat.h"
+#include "WorkerPool.h"
 
 using namespace std;
 
 GLFWwindow *window; // Main application window
 string RESOURCE_DIR = "./"; // Where the resources are loaded from
 bool OFFLINE = false;
+bool COMPRESSED = false; // Store the meshes in the quantized vertex format
 
 shared_ptr<Camera> camera;
-shared_ptr<Program> prog_normal;
-shared_ptr<Program> prog_blinnPhong;
-shared_ptr<Program> prog_silhouette;
-shared_ptr<Program> prog_cel;
-shared_ptr<Shape> bunny_shape;
-shared_ptr<Shape> teapot_shape;
-
+string SCENE_FILE = "scene.txt"; // in RESOURCE_DIR
+shared_ptr<Scene> scene; // meshes, materials, lights, shader modes, and objects
+vector<shared_ptr<ShaderVariants> > shaders; // by scene mode
+shared_ptr<ShaderVariants> placeholder_shaders; // drawn with while a variant is compiling
+vector<shared_ptr<Shape> > shapes; // by scene mesh
+shared_ptr<GeometryArena> arena; // shared geometry buffers, if supported
+shared_ptr<UniformBlocks> uniform_blocks; // camera, light, material, and object blocks
+vector<int> object_lod; // level of detail of each scene object drawn last frame
+// A visible scene object, packed for drawing by a worker
+struct Draw {
+	UniformBlocks::ObjectBlock object; // for drawing one shape at a time
+	Shape::Instance instance; // for the arena
+	Frustum frustum; // in object space
+	int index; // of the scene object
+};
+// What one worker prepared for the frame. The GL thread only replays it.
+struct CommandBuffer {
+	vector<Draw> draws;
+	vector<RenderQueue::Item> items; // the draws' queue keys
+	vector<vector<Shape::Instance> > buckets; // of the crowd, by mesh and level of detail
+	unsigned tested; // objects tested against the view
+	unsigned culled;
+};
+// Queue items index a draw of a command buffer as worker << WORKER_SHIFT | draw
+const unsigned WORKER_SHIFT = 24;
+shared_ptr<WorkerPool> workers; // run the prepare phase of each frame
+vector<CommandBuffer> command_buffers; // by worker
+vector<shared_ptr<Program> > mesh_programs; // of the current mode, picked by prepareDraws()
+int viewport_width = 0; // of the framebuffer, in pixels
+int viewport_height = 1;
+RenderQueue render_queue; // the visible draws of the last frame
+unsigned objectsTested = 0; // since the last cull stats report
+unsigned objectsCulled = 0;
+const int CROWD_SIZE = 40; // the crowd is a CROWD_SIZE x CROWD_SIZE grid
+// Smaller loops are prepared on fewer workers
+const size_t MIN_OBJECTS_PER_WORKER = 16;
+const size_t MIN_CROWD_PER_WORKER = 64;
+vector<int> crowd_lod; // level of detail of each crowd member last frame
+double program_build_time = 0.0; // seconds init() spent waiting for programs
+int programs_started = 0; // by init()
+int programs_cached = 0; // of those, loaded from the binary cache
+
+// The render thread's copy of the input state, taken from the latest
+// snapshot at the start of each frame
 bool keyToggles[256] = {false}; // only for English keyboards!
+int currentMode = 0; // scene mode
+int currentMaterial = 0; // added to each object's material
+
+// Actions that need the GL context, requested by keys on the main thread and
+// run by the render thread
+enum Request {
+	BENCHMARK_DRAWS,
+	BENCHMARK_CULLING,
+	BENCHMARK_RENDER,
+	BENCHMARK_PREPARE,
+	RELOAD_MESH,
+	PRINT_ARENA_STATS,
+	COMPACT_ARENA,
+	REQUEST_COUNT
+};
+
+// Everything the input events change. The main thread owns one copy and
+// publishes snapshots of it to the render thread.
+struct InputState {
+	Camera camera;
+	bool keyToggles[256];
+	int mode; // cycled with s
+	int material; // cycled with m
+	vector<Light> lights; // moved with x and y
+	int width; // of the framebuffer
+	int height;
+	unsigned requests[REQUEST_COUNT]; // made so far, by Request
+	// Since the previous snapshot, each of which the render thread takes
+	unsigned handled; // events
+	unsigned coalesced; // cursor moves replaced by a later one
+	unsigned dropped; // events lost to a full queue
+	double latency; // age in seconds of the oldest event handled
+};
+InputState input; // main thread only
+int currentLight = 0; // of input.lights, cycled with l
+TripleBuffer<InputState> input_snapshots;
+unsigned requests_done[REQUEST_COUNT]; // render thread only
+
+// Input as the GLFW callbacks receive it, queued on the main thread until the
+// render thread has taken the last snapshot
+struct InputEvent {
+	enum Type { KEY, CHAR, MOUSE_BUTTON, CURSOR, RESIZE };
+	Type type;
+	double time; // glfwGetTime() when it arrived
+	int key; // KEY and CHAR
+	int action; // KEY and MOUSE_BUTTON
+	int mods;
+	double x; // cursor position, or the framebuffer size for RESIZE
+	double y;
+};
+SpscQueue<InputEvent> input_events(1024);
+atomic<bool> input_taken(false); // set by the render thread for each snapshot
+unsigned input_handled = 0; // render thread, since the last cull stats report
+unsigned input_coalesced = 0;
+unsigned input_dropped = 0;
+double input_latency = 0.0;
+atomic<bool> render_stop(false); // ends the render loop after the current frame
 
-enum ShaderMode { NORMAL, BLINN_PHONG, SILHOUETTE, CEL };
-ShaderMode currentShaderMode = NORMAL;
 
-enum MaterialMode { PINK, BLUE, GRAY };
-MaterialMode currentMaterial = PINK;
+// This function is called when a GLFW error occurs
+static void error_callback(int error, const char *description)
+{
+	cerr << description << endl;
+}
 
-shared_ptr<Material> pink_material;
-shared_ptr<Material> blue_material;
-shared_ptr<Material> gray_material;
+static shared_ptr<Program> getProgram(int mode, bool instanced, unsigned vertexFormat, bool wait = false);
 
-enum LightMode { LIGHT_ONE, LIGHT_TWO};
-LightMode currentLight = LIGHT_ONE;
+// Measures the CPU cost of Shape::draw with per-draw attribute setup and with
+// cached vertex array objects, drawing the scene's first mesh in its first
+// mode. Press B to run it.
+static void benchmarkDraws()
+{
+	const int ndraws = 10000;
+	const shared_ptr<Shape> &shape = shapes[0];
+	bool hadVAO = shape->isUsingVAO();
+	auto P = make_shared<MatrixStack>();
+	auto MV = make_shared<MatrixStack>();
+	MV->scale(0.01f);
+	shared_ptr<Program> prog = getProgram(0, false, shape->getVertexFormat(), true);
+	prog->bind();
+	uniform_blocks->setFrame(P->topMatrix(), MV->topMatrix(), scene->getLights());
+	uniform_blocks->setObject(MV->topMatrix());
+	for(int pass = 0; pass < 2; ++pass) {
+		bool vao = pass == 1;
+		if(vao && !hadVAO) {
+			break;
+		}
+		if(!vao && GLSL::isCoreProfile()) {
+			// There is no default VAO to set the attributes in
+			continue;
+		}
+		shape->setUseVAO(vao);
+		shape->draw(prog); // warm up, records the VAO
+		glFinish();
+		double t0 = glfwGetTime();
+		for(int i = 0; i < ndraws; ++i) {
+			shape->draw(prog);
+		}
+		double t1 = glfwGetTime();
+		glFinish();
+		double t2 = glfwGetTime();
+		cout << (vao ? "cached VAO:       " : "per-draw attribs: ");
+		cout << 1e6*(t1 - t0)/ndraws << " us/draw CPU, " << 1e6*(t2 - t0)/ndraws << " us/draw incl. GPU" << endl;
+	}
+	shape->setUseVAO(hadVAO);
+	prog->unbind();
+	
+	// The same number of copies in one instanced draw
+	if(!shape->isInstancing()) {
+		return;
+	}
+	vector<Shape::Instance> instances(ndraws);
+	for(int i = 0; i < ndraws; ++i) {
+		memcpy(instances[i].model, glm::value_ptr(glm::mat4(1.0f)), sizeof(instances[i].model));
+		instances[i].material = 0.0f;
+	}
+	prog = getProgram(0, true, shape->getVertexFormat(), true);
+	prog->bind();
+	shape->drawInstanced(prog, instances); // warm up
+	glFinish();
+	double t0 = glfwGetTime();
+	shape->drawInstanced(prog, instances);
+	double t1 = glfwGetTime();
+	glFinish();
+	double t2 = glfwGetTime();
+	cout << "instanced:        " << 1e6*(t1 - t0)/ndraws << " us/draw CPU, " << 1e6*(t2 - t0)/ndraws << " us/draw incl. GPU" << endl;
+	prog->unbind();
+}
 
-shared_ptr<Light> light_one;
-shared_ptr<Light> light_two;
+// Measures frustum culling of many bounding spheres, one at a time and in
+// SSE batches. Press F to run it.
+static void benchmarkCulling()
+{
+	const size_t nobjects = 100000;
+	vector<float> x(nobjects), y(nobjects), z(nobjects), r(nobjects);
+	for(size_t i = 0; i < nobjects; ++i) {
+		x[i] = 20.0f*rand()/RAND_MAX - 10.0f;
+		y[i] = 20.0f*rand()/RAND_MAX - 10.0f;
+		z[i] = 20.0f*rand()/RAND_MAX - 10.0f;
+		r[i] = 0.5f*rand()/RAND_MAX;
+	}
+	auto P = make_shared<MatrixStack>();
+	auto MV = make_shared<MatrixStack>();
+	camera->applyProjectionMatrix(P);
+	camera->applyViewMatrix(MV);
+	Frustum frustum;
+	frustum.set(P->topMatrix(), MV->topMatrix());
+	vector<unsigned char> visible(nobjects);
+	
+	double t0 = glfwGetTime();
+	size_t nscalar = 0;
+	for(size_t i = 0; i < nobjects; ++i) {
+		float c[3] = { x[i], y[i], z[i] };
+		nscalar += frustum.intersectsSphere(c, r[i]) ? 1 : 0;
+	}
+	double t1 = glfwGetTime();
+	size_t nbatch = frustum.cullSpheres(x.data(), y.data(), z.data(), r.data(), nobjects, visible.data());
+	double t2 = glfwGetTime();
+	cout << nobjects << " spheres, " << nbatch << " visible (" << nscalar << " scalar)" << endl;
+	cout << "  one at a time: " << 1e9*(t1 - t0)/nobjects << " ns/sphere" << endl;
+	cout << "  batched:       " << 1e9*(t2 - t1)/nobjects << " ns/sphere" << endl;
+}
 
+// Returns the radius in pixels of a bounding sphere c, r seen through the
+// model-view matrix M, using the camera's vertical field of view.
+static float projectedRadius(const glm::mat4 &M, const float c[3], float r)
+{
+	glm::vec3 center = glm::vec3(M * glm::vec4(c[0], c[1], c[2], 1.0f));
+	float scale = max(glm::length(glm::vec3(M[0])), max(glm::length(glm::vec3(M[1])), glm::length(glm::vec3(M[2]))));
+	float radius = r*scale;
+	float dist = -center.z;
+	if(dist <= radius) {
+		return 1e9f; // the camera is inside the sphere
+	}
+	return radius / sqrt(dist*dist - radius*radius) / tan(0.5f*camera->getFovy()) * 0.5f*viewport_height;
+}
 
-// This function is called when a GLFW error occurs
-static void error_callback(int error, const char *description)
+// Tests a shape against the view and picks the level of detail that fits
+// its size on screen. lod holds the level picked last frame. Returns false if
+// the shape is outside the view, and counts it in buffer. Press d to always
+// draw full detail, and k to draw everything.
+static bool prepareShape(const shared_ptr<Shape> &shape, int &lod, const glm::mat4 &P, const glm::mat4 &MV, Frustum &frustum, CommandBuffer &buffer)
 {
-	cerr << description << endl;
+	float c[3], r;
+	shape->getBoundingSphere(c, r);
+	if(!keyToggles[(unsigned)'k']) {
+		frustum.set(P, MV);
+		frustum.setConeCulling(keyToggles[(unsigned)'c']);
+		buffer.tested++;
+		if(!frustum.intersectsSphere(c, r)) {
+			buffer.culled++;
+			return false;
+		}
+	}
+	
+	if(keyToggles[(unsigned)'d']) {
+		lod = 0;
+	} else {
+		lod = shape->selectLOD(projectedRadius(MV, c, r), lod);
+	}
+	return true;
 }
 
-// This function is called when a key is pressed
-static void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
+// Returns prog if it has linked, and otherwise the placeholder. A program
+// the driver is done with is finished here; with wait, it is finished even
+// if that means waiting for the driver.
+static shared_ptr<Program> readyProgram(const shared_ptr<Program> &prog, const shared_ptr<Program> &placeholder, bool wait = false)
 {
-	if(key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
-		glfwSetWindowShouldClose(window, GL_TRUE);
+	if(prog->getStatus() == Program::COMPILING && (wait || !prog->isCompiling())) {
+		// Report compile errors, but not names that a program does not use
+		prog->setVerbose(true);
+		bool linked = prog->finish();
+		prog->setVerbose(false);
+		if(linked) {
+			UniformBlocks::attach(prog);
+		}
+	}
+	return prog->getStatus() == Program::LINKED ? prog : placeholder;
+}
+
+// Finishes the programs that are done compiling, or all of them with wait
+static void finishPrograms(bool wait)
+{
+	for(const auto &variants : shaders) {
+		for(const auto &variant : variants->getVariants()) {
+			readyProgram(variant.second, nullptr, wait);
+		}
+	}
+}
+
+// Writes the binaries of the programs linked since the last call. Not done
+// as each program is linked, which may be in the middle of a frame.
+static void saveProgramBinaries()
+{
+	for(const auto &variants : shaders) {
+		variants->saveBinaries();
+	}
+	placeholder_shaders->saveBinaries();
+}
+
+// Defines of a shader mode's variant for drawing vertices in vertexFormat
+static Program::Defines getDefines(int mode, bool instanced, unsigned vertexFormat)
+{
+	Program::Defines defines = scene->getModes()[mode].defines;
+	if(instanced) {
+		defines["INSTANCED"] = 1;
+	}
+	const char *define = VertexFormat::get(vertexFormat).define;
+	if(define) {
+		defines[define] = 1;
+	}
+	return defines;
+}
+
+// The variant of a shader mode for drawing vertices in vertexFormat, started
+// if it is new, or the placeholder while it compiles
+static shared_ptr<Program> getProgram(int mode, bool instanced, unsigned vertexFormat, bool wait)
+{
+	Program::Defines placeholderDefines;
+	if(instanced) {
+		placeholderDefines["INSTANCED"] = 1;
+	}
+	shared_ptr<Program> prog = shaders[mode]->get(getDefines(mode, instanced, vertexFormat));
+	return readyProgram(prog, placeholder_shaders->get(placeholderDefines), wait);
+}
+
+// The material an object is drawn with, after cycling with m
+static int getMaterial(int object)
+{
+	int count = (int)scene->getMaterials().size();
+	return (scene->getObjects()[object].material + currentMaterial) % count;
+}
+
+// Empties the workers' command buffers for a new frame
+static void resetCommandBuffers()
+{
+	command_buffers.resize(workers->getThreadCount());
+	for(CommandBuffer &buffer : command_buffers) {
+		buffer.draws.clear();
+		buffer.items.clear();
+		buffer.buckets.resize(shapes.size()*8);
+		for(auto &bucket : buffer.buckets) {
+			bucket.clear();
+		}
+		buffer.tested = 0;
+		buffer.culled = 0;
+	}
+}
+
+// Adds up the workers' culling counts
+static void countCulled()
+{
+	for(const CommandBuffer &buffer : command_buffers) {
+		objectsTested += buffer.tested;
+		objectsCulled += buffer.culled;
+	}
+}
+
+// Transforms and culls the scene's objects, picks their level of detail, and
+// packs the visible ones on the workers, then queues them sorted by program,
+// material, mesh, and depth. For the arena, the model matrices are packed as
+// instances and the material is left out of the key, since it is read per
+// instance. MV is the view matrix.
+static void prepareDraws(const shared_ptr<MatrixStack> &P, const shared_ptr<MatrixStack> &MV, double t, bool instanced)
+{
+	// Programs are picked here, since finding one may need GL calls
+	mesh_programs.resize(shapes.size());
+	for(size_t mesh = 0; mesh < shapes.size(); ++mesh) {
+		mesh_programs[mesh] = getProgram(currentMode, instanced, shapes[mesh]->getVertexFormat());
+	}
+	resetCommandBuffers();
+	const vector<Scene::Object> &objects = scene->getObjects();
+	const glm::mat4 &V = MV->topMatrix();
+	const glm::mat4 &proj = P->topMatrix();
+	workers->run(objects.size(), [&](int worker, size_t begin, size_t end) {
+		CommandBuffer &buffer = command_buffers[worker];
+		MatrixStack M;
+		if(!instanced) {
+			M.multMatrix(V);
+		}
+		for(size_t i = begin; i < end; ++i) {
+			Draw draw;
+			draw.index = (int)i;
+			M.pushMatrix();
+			scene->applyTransform((int)i, t, M);
+			glm::mat4 objectMV = instanced ? V*M.topMatrix() : M.topMatrix();
+			if(instanced) {
+				memcpy(draw.instance.model, glm::value_ptr(M.topMatrix()), sizeof(draw.instance.model));
+				draw.instance.material = (float)getMaterial((int)i);
+			}
+			M.popMatrix();
+			int mesh = objects[i].mesh;
+			const shared_ptr<Shape> &shape = shapes[mesh];
+			if(!prepareShape(shape, object_lod[i], proj, objectMV, draw.frustum, buffer)) {
+				continue;
+			}
+			if(!instanced) {
+				UniformBlocks::packObject(objectMV, draw.object);
+			}
+			float c[3], r;
+			shape->getBoundingSphere(c, r);
+			float depth = -(objectMV*glm::vec4(c[0], c[1], c[2], 1.0f)).z;
+			unsigned material = instanced ? 0 : (unsigned)getMaterial((int)i);
+			uint64_t key = RenderQueue::makeKey(mesh_programs[mesh]->getPID(), material, mesh, depth);
+			buffer.items.push_back({ key, (unsigned)worker << WORKER_SHIFT | (unsigned)buffer.draws.size() });
+			buffer.draws.push_back(draw);
+		}
+	}, MIN_OBJECTS_PER_WORKER);
+	
+	render_queue.clear();
+	for(const CommandBuffer &buffer : command_buffers) {
+		render_queue.append(buffer.items);
+	}
+	render_queue.sort();
+	countCulled();
+}
+
+// The draw a queue item refers to
+static const Draw &getDraw(const RenderQueue::Item &item)
+{
+	return command_buffers[item.index >> WORKER_SHIFT].draws[item.index & ((1u << WORKER_SHIFT) - 1)];
+}
+
+// Draws the scene's visible objects one at a time with the program of the
+// current mode, in the order of the render queue. MV is the view matrix.
+static void drawShapes(const shared_ptr<MatrixStack> &P, const shared_ptr<MatrixStack> &MV, double t)
+{
+	prepareDraws(P, MV, t, false);
+	const vector<Scene::Object> &objects = scene->getObjects();
+	for(const RenderQueue::Item &item : render_queue.getItems()) {
+		const Draw &draw = getDraw(item);
+		int mesh = objects[draw.index].mesh;
+		const shared_ptr<Program> &prog = mesh_programs[mesh];
+		// Binds that repeat the last draw's are filtered by GLState
+		prog->bind();
+		uniform_blocks->bindMaterial(getMaterial(draw.index));
+		uniform_blocks->setObject(draw.object);
+		const Frustum *frustum = keyToggles[(unsigned)'k'] ? 0 : &draw.frustum;
+		shapes[mesh]->draw(prog, object_lod[draw.index], frustum);
+	}
+	GLState::useProgram(0);
+}
+
+// Draws the scene's visible objects with one multi-draw indirect submission
+// from the shared arena, queued front to back. Press g to draw them one at a
+// time instead.
+static void drawArena(const shared_ptr<MatrixStack> &P, const shared_ptr<MatrixStack> &MV, double t)
+{
+	prepareDraws(P, MV, t, true);
+	const vector<Scene::Object> &objects = scene->getObjects();
+	for(const RenderQueue::Item &item : render_queue.getItems()) {
+		const Draw &draw = getDraw(item);
+		const Frustum *frustum = keyToggles[(unsigned)'k'] ? 0 : &draw.frustum;
+		shapes[objects[draw.index].mesh]->queueDraw(draw.instance, object_lod[draw.index], frustum);
 	}
+	
+	arena->submit([](unsigned vertexFormat) {
+		return getProgram(currentMode, true, vertexFormat);
+	});
+}
+
+// Poses, culls, and picks the level of detail of each member of a grid of
+// copies of the scene's objects on the workers, which sort the visible ones
+// into their buckets by mesh and level of detail.
+static void prepareCrowd(const shared_ptr<MatrixStack> &P, const shared_ptr<MatrixStack> &MV, double t)
+{
+	const int n = CROWD_SIZE*CROWD_SIZE;
+	const vector<Scene::Object> &objects = scene->getObjects();
+	int nobjects = (int)objects.size();
+	int nmaterials = (int)scene->getMaterials().size();
+	crowd_lod.resize(n, 0);
+	resetCommandBuffers();
+	bool cull = !keyToggles[(unsigned)'k'];
+	Frustum frustum;
+	frustum.set(P->topMatrix(), MV->topMatrix());
+	const glm::mat4 &V = MV->topMatrix();
+	workers->run(n, [&](int worker, size_t begin, size_t end) {
+		CommandBuffer &buffer = command_buffers[worker];
+		
+		// Model matrices, each member posed like an object of the scene and
+		// animated with its own phase
+		size_t count = end - begin;
+		vector<Shape::Instance> instances(count);
+		vector<int> mesh(count);
+		vector<float> x(count), y(count), z(count), r(count);
+		MatrixStack M;
+		for(size_t k = 0; k < count; ++k) {
+			int i = (int)(begin + k);
+			int row = i / CROWD_SIZE, col = i % CROWD_SIZE;
+			int object = (row + col) % nobjects;
+			mesh[k] = objects[object].mesh;
+			M.pushMatrix();
+			M.translate(col - 0.5f*CROWD_SIZE, -0.5f, -(float)row);
+			scene->applyPose(object, t + i, M);
+			memcpy(instances[k].model, glm::value_ptr(M.topMatrix()), sizeof(instances[k].model));
+			instances[k].material = (float)(i % nmaterials);
+			
+			// World-space bounding sphere
+			float c[3], radius;
+			shapes[mesh[k]]->getBoundingSphere(c, radius);
+			glm::vec4 center = M.topMatrix() * glm::vec4(c[0], c[1], c[2], 1.0f);
+			x[k] = center.x;
+			y[k] = center.y;
+			z[k] = center.z;
+			r[k] = radius*scene->getRadiusScale(object);
+			M.popMatrix();
+		}
+		
+		// Cull against the world-space frustum and sort the rest by mesh
+		// and level of detail
+		vector<unsigned char> visible(count, 1);
+		if(cull) {
+			size_t nvisible = frustum.cullSpheres(x.data(), y.data(), z.data(), r.data(), count, visible.data());
+			buffer.tested += (unsigned)count;
+			buffer.culled += (unsigned)(count - nvisible);
+		}
+		for(size_t k = 0; k < count; ++k) {
+			if(!visible[k]) {
+				continue;
+			}
+			int &lod = crowd_lod[begin + k];
+			if(keyToggles[(unsigned)'d']) {
+				lod = 0;
+			} else {
+				float c[3] = { x[k], y[k], z[k] };
+				lod = min(shapes[mesh[k]]->selectLOD(projectedRadius(V, c, r[k]), lod), 7);
+			}
+			buffer.buckets[mesh[k]*8 + lod].push_back(instances[k]);
+		}
+	}, MIN_CROWD_PER_WORKER);
+	countCulled();
+}
 
+// Draws a grid of copies of the scene's objects with one instanced draw per
+// mesh and level of detail. Members outside the view are dropped on the CPU.
+// Press i to show the crowd instead of the scene.
+static void drawCrowd(const shared_ptr<MatrixStack> &P, const shared_ptr<MatrixStack> &MV, double t)
+{
+	prepareCrowd(P, MV, t);
+	vector<Shape::Instance> instances;
+	for(size_t k = 0; k < shapes.size(); ++k) {
+		shared_ptr<Program> prog = getProgram(currentMode, true, shapes[k]->getVertexFormat());
+		prog->bind();
+		for(int lod = 0; lod < 8; ++lod) {
+			// The workers' buckets in worker order, which is grid order
+			instances.clear();
+			for(const CommandBuffer &buffer : command_buffers) {
+				const vector<Shape::Instance> &bucket = buffer.buckets[k*8 + lod];
+				instances.insert(instances.end(), bucket.begin(), bucket.end());
+			}
+			shapes[k]->drawInstanced(prog, instances, lod);
+		}
+	}
+	GLState::useProgram(0);
+}
+
+// Prints how full and how fragmented the arena is. Press A to print it, and
+// shift+A to compact the arena first.
+static void printArenaStats()
+{
+	GeometryArena::Stats stats = arena->getStats();
+	cout << "arena: " << stats.allocations << " allocations in " << stats.pools << " pools, ";
+	cout << stats.used/1024 << " of " << stats.capacity/1024 << " KB used (" << 100.0*stats.used/max(stats.capacity, (size_t)1) << "%), ";
+	cout << stats.freeBlocks << " free blocks, largest " << stats.largestFree/1024 << " KB, ";
+	cout << 100.0f*stats.fragmentation << "% fragmented" << endl;
+}
+
+// Loads a scene mesh into a new shape
+static shared_ptr<Shape> loadShape(int mesh)
+{
+	auto shape = make_shared<Shape>();
+	shape->loadMesh(scene->getMeshes()[mesh].fileName);
+	shape->setCompressed(COMPRESSED);
+	shape->setArena(arena);
+	shape->init();
+	return shape;
+}
+
+// Unloads the scene's first mesh and loads it again, which frees its part of
+// the arena and allocates a new one. Press R to run it.
+static void reloadMesh()
+{
+	shapes[0] = loadShape(0);
+	const vector<Scene::Object> &objects = scene->getObjects();
+	for(size_t i = 0; i < objects.size(); ++i) {
+		if(objects[i].mesh == 0) {
+			object_lod[i] = 0;
+		}
+	}
+	if(arena) {
+		printArenaStats();
+	}
+}
+
+// Prints the fraction of clusters and triangles culled over the last second.
+// Press p to turn it on.
+static void reportCullStats()
+{
+	static double lastReport = 0.0;
+	double now = glfwGetTime();
+	if(now - lastReport < 1.0) {
+		return;
+	}
+	lastReport = now;
+	Shape::CullStats total = { 0, 0, 0, 0, 0 };
+	for(const auto &shape : shapes) {
+		const Shape::CullStats &stats = shape->getCullStats();
+		total.clusters += stats.clusters;
+		total.frustumCulled += stats.frustumCulled;
+		total.backfaceCulled += stats.backfaceCulled;
+		total.triangles += stats.triangles;
+		total.trianglesDrawn += stats.trianglesDrawn;
+		shape->resetCullStats();
+	}
+	unsigned tested = objectsTested, culled = objectsCulled;
+	objectsTested = 0;
+	objectsCulled = 0;
+	unsigned handled = input_handled, coalesced = input_coalesced, dropped = input_dropped;
+	double latency = input_latency;
+	input_handled = 0;
+	input_coalesced = 0;
+	input_dropped = 0;
+	input_latency = 0.0;
+	if(!keyToggles[(unsigned)'p'] || tested == 0) {
+		return;
+	}
+	cout << "objects culled: " << 100.0*culled/tested << "%, ";
+	double clusters = max(total.clusters, 1u);
+	cout << "clusters culled: " << 100.0*total.frustumCulled/clusters << "% frustum, ";
+	cout << 100.0*total.backfaceCulled/clusters << "% backface; triangles drawn: ";
+	cout << 100.0*total.trianglesDrawn/max(total.triangles, 1ull) << "%" << endl;
+	if(arena && arena->getSubmitCount() > 0) {
+		cout << "arena: " << arena->getCommandCount() << " draws in " << arena->getSubmitCount() << " submissions" << endl;
+	}
+	if(!keyToggles[(unsigned)'i']) {
+		const RenderQueue::Stats &queue = render_queue.getStats();
+		cout << "render queue: " << queue.items << " draws, " << queue.programChanges << " program and ";
+		cout << queue.materialChanges << " material changes (" << queue.unsortedProgramChanges << " and ";
+		cout << queue.unsortedMaterialChanges << " in scene order)" << endl;
+	}
+	cout << "GL objects: " << GLHandle::getPendingCount() << " awaiting deletion, " << GLHandle::getDeletedCount() << " deleted" << endl;
+	GLState::Stats state = GLState::getFrameStats();
+	cout << "GL state calls last frame: " << state.issued << " issued, " << state.skipped << " skipped" << endl;
+	cout << "input: " << handled << " events, " << coalesced << " cursor moves coalesced, ";
+	cout << dropped << " dropped, oldest " << 1e3*latency << " ms" << endl;
+}
+
+static void render();
+
+// Measures the CPU time of preparing the scene's draws and the crowd with 1,
+// 2, 4, ... worker threads, up to the number of hardware threads. Press T to
+// run it.
+static void benchmarkPrepare()
+{
+	const int nframes = 100;
+	auto P = make_shared<MatrixStack>();
+	auto MV = make_shared<MatrixStack>();
+	camera->applyProjectionMatrix(P);
+	camera->applyViewMatrix(MV);
+	shared_ptr<WorkerPool> hadWorkers = workers;
+	int maxThreads = max(1, (int)thread::hardware_concurrency());
+	double base[2] = { 0.0, 0.0 };
+	for(int nthreads = 1; ; nthreads = min(2*nthreads, maxThreads)) {
+		workers = make_shared<WorkerPool>(nthreads);
+		double t0 = glfwGetTime();
+		for(int i = 0; i < nframes; ++i) {
+			prepareDraws(P, MV, 0.0, false);
+		}
+		double t1 = glfwGetTime();
+		for(int i = 0; i < nframes; ++i) {
+			prepareCrowd(P, MV, 0.0);
+		}
+		double t2 = glfwGetTime();
+		double us[2] = { 1e6*(t1 - t0)/nframes, 1e6*(t2 - t1)/nframes };
+		if(nthreads == 1) {
+			base[0] = us[0];
+			base[1] = us[1];
+		}
+		cout << nthreads << (nthreads == 1 ? " thread:  " : " threads: ");
+		cout << "scene " << us[0] << " us/frame (" << base[0]/us[0] << "x), ";
+		cout << "crowd " << us[1] << " us/frame (" << base[1]/us[1] << "x)" << endl;
+		if(nthreads == maxThreads) {
+			break;
+		}
+	}
+	workers = hadWorkers;
+	objectsTested = 0;
+	objectsCulled = 0;
+}
+
+// Measures the CPU time of a frame of the per-shape render loop in each of the
+// scene's shader modes. Press U to run it.
+static void benchmarkRender()
+{
+	const int nframes = 200;
+	int hadMode = currentMode;
+	bool hadOffline = OFFLINE;
+	bool hadForce = keyToggles[(unsigned)'g'];
+	OFFLINE = false;
+	keyToggles[(unsigned)'g'] = true; // measure the per-shape loop, not the arena
+	finishPrograms(true);
+	const vector<Scene::Mode> &modes = scene->getModes();
+	for(size_t mode = 0; mode < modes.size(); ++mode) {
+		currentMode = (int)mode;
+		render(); // warm up
+		glFinish();
+		double t0 = glfwGetTime();
+		for(int i = 0; i < nframes; ++i) {
+			render();
+		}
+		double t1 = glfwGetTime();
+		glFinish();
+		cout << left << setw(13) << modes[mode].name + ":" << right << 1e6*(t1 - t0)/nframes << " us/frame CPU" << endl;
+	}
+	currentMode = hadMode;
+	OFFLINE = hadOffline;
+	keyToggles[(unsigned)'g'] = hadForce;
+}
+
+// Acts on a key press, on the main thread
+static void handleKey(int key, int action, int mods)
+{
 	switch(key) {
+		case GLFW_KEY_B:
+		{
+			if(action == GLFW_PRESS) {
+				input.requests[BENCHMARK_DRAWS]++;
+			}
+			break;
+		}
+		case GLFW_KEY_F:
+		{
+			if(action == GLFW_PRESS) {
+				input.requests[BENCHMARK_CULLING]++;
+			}
+			break;
+		}
+		case GLFW_KEY_U:
+		{
+			if(action == GLFW_PRESS) {
+				input.requests[BENCHMARK_RENDER]++;
+			}
+			break;
+		}
+		case GLFW_KEY_T:
+		{
+			if(action == GLFW_PRESS) {
+				input.requests[BENCHMARK_PREPARE]++;
+			}
+			break;
+		}
+		case GLFW_KEY_R:
+		{
+			if(action == GLFW_PRESS) {
+				input.requests[RELOAD_MESH]++;
+			}
+			break;
+		}
+		case GLFW_KEY_A:
+		{
+			if(action == GLFW_PRESS) {
+				input.requests[mods == GLFW_MOD_SHIFT ? COMPACT_ARENA : PRINT_ARENA_STATS]++;
+			}
+			break;
+		}
         case GLFW_KEY_S: 
         {
 			if(action == GLFW_PRESS) {
-				if(currentShaderMode == NORMAL) {
-					currentShaderMode = BLINN_PHONG;
-				} else if(currentShaderMode == BLINN_PHONG) {
-					currentShaderMode = SILHOUETTE;
-				} else if(currentShaderMode == SILHOUETTE) {
-					currentShaderMode = CEL;
-				} else {
-					currentShaderMode = NORMAL;
-				}
+				input.mode = (input.mode + 1) % (int)scene->getModes().size();
 			}
             break;
         }
 		case GLFW_KEY_M: 
         {
             if(action == GLFW_PRESS) {
-				if(currentMaterial == PINK) {
-					currentMaterial = BLUE;
-				} else if(currentMaterial == BLUE) {
-					currentMaterial = GRAY;
-				} else {
-					currentMaterial = PINK;
-				}
+				input.material = (input.material + 1) % (int)scene->getMaterials().size();
             }
             break;
         }
 		case GLFW_KEY_L: 
         {
-            if(action == GLFW_PRESS) {
-                currentLight = (currentLight == LIGHT_ONE) ? LIGHT_TWO : LIGHT_ONE;
+            if(action == GLFW_PRESS && !input.lights.empty()) {
+                currentLight = (currentLight + 1) % (int)input.lights.size();
             }
             break;
         }
 		case GLFW_KEY_X: 
         { 
-            if(action == GLFW_PRESS) {
+            if(action == GLFW_PRESS && !input.lights.empty()) {
+				Light &light = input.lights[currentLight];
 				if(mods == GLFW_MOD_SHIFT) {
-					if(currentLight == LIGHT_ONE)
-						light_one->posX += 0.25;
-					else
-						light_two->posX += 0.25;
+					light.posX += 0.25;
 				} else {
-					if(currentLight == LIGHT_ONE)
-						light_one->posX -= 0.25;
-					else
-						light_two->posX -= 0.25;
+					light.posX -= 0.25;
 				}
             }
             break;
         }
 		case GLFW_KEY_Y: 
         { 
-            if(action == GLFW_PRESS) {
+            if(action == GLFW_PRESS && !input.lights.empty()) {
+				Light &light = input.lights[currentLight];
 				if(mods == GLFW_MOD_SHIFT) {
-					if(currentLight == LIGHT_ONE)
-						light_one->posY += 0.25;
-					else
-						light_two->posY += 0.25;
+					light.posY += 0.25;
 				} else {
-					if(currentLight == LIGHT_ONE)
-						light_one->posY-= 0.25;
-					else
-						light_two->posY -= 0.25;
+					light.posY -= 0.25;
 				}
             }
             break;
@@ -144,21 +846,86 @@ static void key_callback(GLFWwindow *window, int key, int scancode, int action,
     }
 }
 
+// Acts on an input event, on the main thread
+static void handleEvent(const InputEvent &event)
+{
+	switch(event.type) {
+		case InputEvent::KEY:
+			handleKey(event.key, event.action, event.mods);
+			break;
+		case InputEvent::CHAR:
+			input.keyToggles[event.key] = !input.keyToggles[event.key];
+			break;
+		case InputEvent::MOUSE_BUTTON:
+			if(event.action == GLFW_PRESS) {
+				bool shift = (event.mods & GLFW_MOD_SHIFT) != 0;
+				bool ctrl  = (event.mods & GLFW_MOD_CONTROL) != 0;
+				bool alt   = (event.mods & GLFW_MOD_ALT) != 0;
+				input.camera.mouseClicked((float)event.x, (float)event.y, shift, ctrl, alt);
+			}
+			break;
+		case InputEvent::CURSOR:
+			input.camera.mouseMoved((float)event.x, (float)event.y);
+			break;
+		case InputEvent::RESIZE:
+			input.width = (int)event.x;
+			input.height = (int)event.y;
+			break;
+	}
+}
+
+// Handles the events queued since the last snapshot, once the render thread
+// has taken it, so at most once per frame. Of a run of cursor moves only the
+// last is handled, so that the camera is updated once per frame however often
+// the OS reports motion. Returns the number of events.
+static unsigned drainInput()
+{
+	double now = glfwGetTime();
+	unsigned handled = 0;
+	InputEvent event, next;
+	bool hasNext = input_events.pop(next);
+	while(hasNext) {
+		event = next;
+		hasNext = input_events.pop(next);
+		handled++;
+		input.latency = max(input.latency, now - event.time);
+		if(event.type == InputEvent::CURSOR && hasNext && next.type == InputEvent::CURSOR) {
+			input.coalesced++;
+			continue;
+		}
+		handleEvent(event);
+	}
+	input.handled += handled;
+	return handled;
+}
+
+// Stamps an event and queues it until the next drainInput()
+static void queueEvent(InputEvent event)
+{
+	event.time = glfwGetTime();
+	if(!input_events.push(event)) {
+		input.dropped++;
+	}
+}
+
+// This function is called when a key is pressed
+static void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+	if(key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
+		glfwSetWindowShouldClose(window, GL_TRUE);
+	}
+	InputEvent event = { InputEvent::KEY, 0.0, key, action, mods, 0.0, 0.0 };
+	queueEvent(event);
+}
+
 // This function is called when the mouse is clicked
 static void mouse_button_callback(GLFWwindow *window, int button, int action, int mods)
 {
 	// Get the current mouse position.
 	double xmouse, ymouse;
 	glfwGetCursorPos(window, &xmouse, &ymouse);
-	// Get current window size.
-	int width, height;
-	glfwGetWindowSize(window, &width, &height);
-	if(action == GLFW_PRESS) {
-		bool shift = (mods & GLFW_MOD_SHIFT) != 0;
-		bool ctrl  = (mods & GLFW_MOD_CONTROL) != 0;
-		bool alt   = (mods & GLFW_MOD_ALT) != 0;
-		camera->mouseClicked((float)xmouse, (float)ymouse, shift, ctrl, alt);
-	}
+	InputEvent event = { InputEvent::MOUSE_BUTTON, 0.0, button, action, mods, xmouse, ymouse };
+	queueEvent(event);
 }
 
 // This function is called when the mouse moves
@@ -166,26 +933,31 @@ static void cursor_position_callback(GLFWwindow* window, double xmouse, double y
 {
 	int state = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT);
 	if(state == GLFW_PRESS) {
-		camera->mouseMoved((float)xmouse, (float)ymouse);
+		InputEvent event = { InputEvent::CURSOR, 0.0, 0, 0, 0, xmouse, ymouse };
+		queueEvent(event);
 	}
 }
 
 static void char_callback(GLFWwindow *window, unsigned int key)
 {
-	keyToggles[key] = !keyToggles[key];
+	if(key < 256) {
+		InputEvent event = { InputEvent::CHAR, 0.0, (int)key, 0, 0, 0.0, 0.0 };
+		queueEvent(event);
+	}
 }
 
-// If the window is resized, capture the new size and reset the viewport
+// If the window is resized, capture the new size. The render thread resets
+// the viewport once it takes the snapshot.
 static void resize_callback(GLFWwindow *window, int width, int height)
 {
-	glViewport(0, 0, width, height);
+	InputEvent event = { InputEvent::RESIZE, 0.0, 0, 0, 0, (double)width, (double)height };
+	queueEvent(event);
 }
 
 // https://lencerf.github.io/post/2019-09-21-save-the-opengl-rendering-to-image-file/
-static void saveImage(const char *filepath, GLFWwindow *w)
+static void saveImage(const char *filepath)
 {
-	int width, height;
-	glfwGetFramebufferSize(w, &width, &height);
+	int width = viewport_width, height = viewport_height;
 	GLsizei nrChannels = 3;
 	GLsizei stride = nrChannels * width;
 	stride += (stride % 4) ? (4 - stride % 4) : 0;
@@ -212,172 +984,105 @@ static void init()
 	// Set background color.
 	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
 	// Enable z-buffer test.
-	glEnable(GL_DEPTH_TEST);
-
-	prog_normal = make_shared<Program>();
-	prog_normal->setShaderNames(RESOURCE_DIR + "normal_vert.glsl", RESOURCE_DIR + "normal_frag.glsl");
-	prog_normal->setVerbose(true);
-	prog_normal->init();
-	prog_normal->addAttribute("aPos");
-	prog_normal->addAttribute("aNor");
-	prog_normal->addUniform("MV");
-	prog_normal->addUniform("P");
-	prog_normal->setVerbose(false);
-
-
-	prog_blinnPhong = make_shared<Program>();
-	prog_blinnPhong->setShaderNames(RESOURCE_DIR + "blinnphong_vert.glsl", RESOURCE_DIR + "blinnphong_frag.glsl");
-	prog_blinnPhong->setVerbose(true);
-	prog_blinnPhong->init();
-	prog_blinnPhong->addAttribute("aPos");
-	prog_blinnPhong->addAttribute("aNor");
-	prog_blinnPhong->addUniform("MV");
-	prog_blinnPhong->addUniform("P");
-	prog_blinnPhong->addUniform("lightPos1");
-	prog_blinnPhong->addUniform("lightColor1");
-	prog_blinnPhong->addUniform("lightPos2");
-	prog_blinnPhong->addUniform("lightColor2");
-	prog_blinnPhong->addUniform("ka");
-	prog_blinnPhong->addUniform("kd");
-	prog_blinnPhong->addUniform("ks");
-	prog_blinnPhong->addUniform("s");
-	prog_blinnPhong->setVerbose(false);
-
-	prog_silhouette = make_shared<Program>();
-	prog_silhouette->setShaderNames(RESOURCE_DIR + "silhouette_vert.glsl", RESOURCE_DIR + "silhouette_frag.glsl");
-	prog_silhouette->setVerbose(true);
-	prog_silhouette->init();
-	prog_silhouette->addAttribute("aPos");
-	prog_silhouette->addAttribute("aNor");
-	prog_silhouette->addUniform("MV");
-	prog_silhouette->addUniform("P");
-	prog_silhouette->addUniform("N");
-	prog_silhouette->setVerbose(false);
-
-
-	prog_cel = make_shared<Program>();
-	prog_cel->setShaderNames(RESOURCE_DIR + "cel_vert.glsl", RESOURCE_DIR + "cel_frag.glsl");
-	prog_cel->setVerbose(true);
-	prog_cel->init();
-	prog_cel->addAttribute("aPos");
-	prog_cel->addAttribute("aNor");
-	prog_cel->addUniform("MV");
-	prog_cel->addUniform("P");
-	prog_cel->addUniform("lightPos");
-	prog_cel->addUniform("lightColor");
-	prog_cel->addUniform("ka");
-	prog_cel->addUniform("kd");
-	prog_cel->addUniform("ks");
-	prog_cel->addUniform("s");
-	prog_cel->addUniform("N");
-	prog_cel->setVerbose(false);
+	GLState::setEnabled(GL_DEPTH_TEST, true);
+
+	// Programs are loaded from their binary caches when possible, and
+	// otherwise compiled in the background if the driver supports it
+	auto programStart = chrono::steady_clock::now();
+	if(GLEW_KHR_parallel_shader_compile) {
+		glMaxShaderCompilerThreadsKHR(0xffffffff);
+	} else if(GLEW_ARB_parallel_shader_compile) {
+		glMaxShaderCompilerThreadsARB(0xffffffff);
+	}
+	
+	// The shaders of each mode of the scene. Their variants are picked per
+	// draw, see getDefines().
+	const vector<Scene::Mode> &modes = scene->getModes();
+	shaders.resize(modes.size());
+	for(size_t mode = 0; mode < modes.size(); ++mode) {
+		const string &name = modes[mode].shader;
+		shaders[mode] = make_shared<ShaderVariants>();
+		shaders[mode]->setShaderNames(name + "_vert.glsl", name + "_frag.glsl");
+		shaders[mode]->setBinaryCacheName(name);
+	}
+	
+	// Flat gray stand-ins, small enough to compile right away
+	placeholder_shaders = make_shared<ShaderVariants>();
+	placeholder_shaders->setShaderNames(RESOURCE_DIR + "placeholder_vert.glsl", RESOURCE_DIR + "placeholder_frag.glsl");
+	placeholder_shaders->setBinaryCacheName(RESOURCE_DIR + "placeholder");
+	
+	// Every program reads the camera, lights, material, and transforms from
+	// the same uniform blocks. Programs are attached as they finish.
+	uniform_blocks = make_shared<UniformBlocks>();
+	uniform_blocks->init();
+	Program::Defines instanced;
+	instanced["INSTANCED"] = 1;
+	readyProgram(placeholder_shaders->get(Program::Defines()), nullptr, true);
+	readyProgram(placeholder_shaders->get(instanced), nullptr, true);
+	
+	// Start the variants of every mode for the format the shapes will have,
+	// and only wait for those of the starting mode
+	unsigned vertexFormat = COMPRESSED ? FORMAT_QPN : FORMAT_PN;
+	for(size_t mode = 0; mode < modes.size(); ++mode) {
+		shaders[mode]->get(getDefines((int)mode, false, vertexFormat));
+		shaders[mode]->get(getDefines((int)mode, true, vertexFormat));
+	}
+	getProgram(currentMode, false, vertexFormat, true);
+	getProgram(currentMode, true, vertexFormat, true);
+	saveProgramBinaries();
+	// Names the code looks up that none of the shaders declare
+	Program::checkUniforms();
+	program_build_time = chrono::duration<double>(chrono::steady_clock::now() - programStart).count();
+	programs_started = 0;
+	programs_cached = 0;
+	for(const auto &variants : shaders) {
+		for(const auto &variant : variants->getVariants()) {
+			programs_started++;
+			programs_cached += variant.second->isFromBinaryCache() ? 1 : 0;
+		}
+	}
 	
 	camera = make_shared<Camera>();
 	camera->setInitDistance(2.0f); // Camera's initial Z translation
+	glfwGetFramebufferSize(window, &viewport_width, &viewport_height);
 	
-	bunny_shape = make_shared<Shape>();
-	bunny_shape->loadMesh(RESOURCE_DIR + "bunny.obj");
-	bunny_shape->init();
-
-	teapot_shape = make_shared<Shape>();
-	teapot_shape->loadMesh(RESOURCE_DIR + "teapot.obj");
-	teapot_shape->init();
+	// Threads for the prepare phase of each frame
+	workers = make_shared<WorkerPool>();
+	
+	// All meshes go into one arena so they can be drawn together
+	if(GeometryArena::isSupported()) {
+		arena = make_shared<GeometryArena>();
+	}
+	
+	for(size_t mesh = 0; mesh < scene->getMeshes().size(); ++mesh) {
+		shapes.push_back(loadShape((int)mesh));
+	}
+	object_lod.assign(scene->getObjects().size(), 0);
+	if(!shapes.empty() && !shapes[0]->isInstancing()) {
+		cout << "Instanced drawing needs OpenGL 3.3, the crowd (i) is disabled" << endl;
+	}
 	
 	GLSL::checkError(GET_FILE_LINE);
-
-	// MATERIALS
-	pink_material = make_shared<Material>();
-	blue_material = make_shared<Material>();
-	gray_material = make_shared<Material>();
-
-	//// Pink Material
-	pink_material->kax = 0.2f;
-	pink_material->kay = 0.2f;
-	pink_material->kaz = 0.2f;
-
-	pink_material->kdx = 0.8f;
-	pink_material->kdy = 0.7f;
-	pink_material->kdz = 0.7f;
-
-	pink_material->ksx = 1.0f;
-	pink_material->ksy = 0.9f;
-	pink_material->ksz = 0.8f;
-
-	pink_material->s = 200.0f;
-
-	//// Blue Material
-	blue_material->kax = 0.1f;
-	blue_material->kay = 0.1f;
-	blue_material->kaz = 0.5f;
-
-	blue_material->kdx = 0.5f;
-	blue_material->kdy = 0.5f;
-	blue_material->kdz = 1.0f;
-
-	blue_material->ksx = 1.0f;
-	blue_material->ksy = 0.9f;
-	blue_material->ksz = 0.8f;
-
-	blue_material->s = 200.0f;
-
-	//// Gray Material
-	gray_material->kax = 0.2f;
-	gray_material->kay = 0.2f;
-	gray_material->kaz = 0.2f;
-
-	gray_material->kdx = 0.5f;
-	gray_material->kdy = 0.5f;
-	gray_material->kdz = 0.5f;
-
-	gray_material->ksx = 0.7f;
-	gray_material->ksy = 0.7f;
-	gray_material->ksz = 0.7f;
-
-	gray_material->s = 200.0f;
-
-	// Lights
-	light_one = make_shared<Light>();
-	light_two = make_shared<Light>();
-
-	//// Light One
-	light_one->posX = 1.0f;
-	light_one->posY = 1.0f;
-	light_one->posZ = 1.0f;
-
-	light_one->colX = 0.8f;
-	light_one->colY = 0.8f;
-	light_one->colZ = 0.8f;
-
-	//// Light Two
-	light_two->posX = -1.0f;
-	light_two->posY = 1.0f;
-	light_two->posZ = 1.0f;
-
-	light_two->colX = 0.2f;
-	light_two->colY = 0.2f;
-	light_two->colZ = 0.0f;
+	
+	// Uploaded once, in scene order
+	if((int)scene->getMaterials().size() > UniformBlocks::MAX_MATERIALS) {
+		cerr << "Only the first " << UniformBlocks::MAX_MATERIALS << " materials of the scene are used" << endl;
+	}
+	uniform_blocks->setMaterials(scene->getMaterials());
 }
 
 // This function is called every frame to draw the scene.
 static void render()
 {
+	// Pick up programs that finished compiling since the last frame
+	finishPrograms(false);
+	
 	// Clear framebuffer.
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	if(keyToggles[(unsigned)'c']) {
-		glEnable(GL_CULL_FACE);
-	} else {
-		glDisable(GL_CULL_FACE);
-	}
-	if(keyToggles[(unsigned)'z']) {
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-	} else {
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	}
+	GLState::setEnabled(GL_CULL_FACE, keyToggles[(unsigned)'c']);
+	GLState::polygonMode(keyToggles[(unsigned)'z'] ? GL_LINE : GL_FILL);
 	
-	// Get current frame buffer size.
-	int width, height;
-	glfwGetFramebufferSize(window, &width, &height);
-	camera->setAspect((float)width/(float)height);
+	camera->setAspect((float)viewport_width/(float)viewport_height);
 	
 	double t = glfwGetTime();
 	if(!keyToggles[(unsigned)' ']) {
@@ -394,387 +1099,163 @@ static void render()
 	camera->applyProjectionMatrix(P);
 	MV->pushMatrix();
 	camera->applyViewMatrix(MV);
+	uniform_blocks->setFrame(P->topMatrix(), MV->topMatrix(), scene->getLights());
 	
-	
-	if(currentShaderMode == NORMAL) {
-		prog_normal->bind();
-		MV->pushMatrix();
-		MV->translate(-0.5f, -0.5f, 0.0f);
-		MV->rotate(t, 0.0f, 1.0f, 0.0f);
-		MV->scale(0.5f);
-		glUniformMatrix4fv(prog_normal->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-		glUniformMatrix4fv(prog_normal->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-		glm::mat4 MV_matrix = MV->topMatrix(); 
-		glm::mat3 normalMatrix = glm::mat3(MV_matrix); 
-		normalMatrix = glm::inverse(normalMatrix); 
-		normalMatrix = glm::transpose(normalMatrix);
-		glUniformMatrix3fv(prog_normal->getUniform("normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-		bunny_shape->draw(prog_normal);
-		MV->popMatrix();
-
-		prog_normal->bind();
-		MV->pushMatrix();
-		MV->translate(glm::vec3(0.5f, 0.0f, 0.0f)); 
-		glm::mat4 S(1.0f);
-		S[0][1] = 0.5f*cos(t);
-		MV->multMatrix(S);
-    	MV->rotate(static_cast<float>(M_PI), glm::vec3(0.0f, 1.0f, 0.0f)); 
-    	MV->scale(glm::vec3(0.5f));
-		glUniformMatrix4fv(prog_normal->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-		glUniformMatrix4fv(prog_normal->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-		MV_matrix = MV->topMatrix(); 
-		normalMatrix = glm::mat3(MV_matrix); 
-		normalMatrix = glm::inverse(normalMatrix); 
-		normalMatrix = glm::transpose(normalMatrix);
-		glUniformMatrix3fv(prog_normal->getUniform("normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-		teapot_shape->draw(prog_normal);
-		MV->popMatrix();
-
-		prog_normal->unbind();
-	} else if(currentShaderMode == BLINN_PHONG) {
-		if (currentMaterial == PINK) {
-				prog_blinnPhong->bind();
-				MV->pushMatrix();
-				MV->translate(-0.5f, -0.5f, 0.0f);
-				MV->rotate(t, 0.0f, 1.0f, 0.0f);
-				MV->scale(0.5f);
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-				glm::mat4 MV_matrix = MV->topMatrix(); 
-				glm::mat3 normalMatrix = glm::mat3(MV_matrix); 
-				normalMatrix = glm::inverse(normalMatrix); 
-				normalMatrix = glm::transpose(normalMatrix);
-				glUniformMatrix3fv(prog_blinnPhong->getUniform("normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-				glUniform3f(prog_blinnPhong->getUniform("lightPos1"), light_one->posX, light_one->posY, light_one->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor1"), light_one->colX, light_one->colY, light_one->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightPos2"), light_two->posX, light_two->posY, light_two->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor2"), light_two->colX, light_two->colY, light_two->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("ka"), pink_material->kax, pink_material->kay, pink_material->kaz);
-				glUniform3f(prog_blinnPhong->getUniform("kd"), pink_material->kdx, pink_material->kdy, pink_material->kdz);
-				glUniform3f(prog_blinnPhong->getUniform("ks"), pink_material->ksx, pink_material->ksy, pink_material->ksz);
-				glUniform1f(prog_blinnPhong->getUniform("s"), pink_material->s);
-				bunny_shape->draw(prog_blinnPhong);
-				MV->popMatrix();
-
-				MV->pushMatrix();
-				MV->translate(glm::vec3(0.5f, 0.0f, 0.0f)); 
-				glm::mat4 S(1.0f);
-				S[0][1] = 0.5f*cos(t);
-				MV->multMatrix(S);
-    			MV->rotate(static_cast<float>(M_PI), glm::vec3(0.0f, 1.0f, 0.0f)); 
-    			MV->scale(glm::vec3(0.5f));
-				
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-				MV_matrix = MV->topMatrix(); 
-				normalMatrix = glm::mat3(MV_matrix); 
-				normalMatrix = glm::inverse(normalMatrix); 
-				normalMatrix = glm::transpose(normalMatrix);
-				glUniformMatrix3fv(prog_blinnPhong->getUniform("normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-				glUniform3f(prog_blinnPhong->getUniform("lightPos1"), light_one->posX, light_one->posY, light_one->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor1"), light_one->colX, light_one->colY, light_one->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightPos2"), light_two->posX, light_two->posY, light_two->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor2"), light_two->colX, light_two->colY, light_two->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("ka"), pink_material->kax, pink_material->kay, pink_material->kaz);
-				glUniform3f(prog_blinnPhong->getUniform("kd"), pink_material->kdx, pink_material->kdy, pink_material->kdz);
-				glUniform3f(prog_blinnPhong->getUniform("ks"), pink_material->ksx, pink_material->ksy, pink_material->ksz);
-				glUniform1f(prog_blinnPhong->getUniform("s"), pink_material->s);
-				teapot_shape->draw(prog_blinnPhong);
-				MV->popMatrix();
-
-				prog_blinnPhong->unbind();
-		} else if(currentMaterial == BLUE) {
-				prog_blinnPhong->bind();
-				MV->pushMatrix();
-				MV->translate(-0.5f, -0.5f, 0.0f);
-				MV->rotate(t, 0.0f, 1.0f, 0.0f);
-				MV->scale(0.5f);
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-				glm::mat4 MV_matrix = MV->topMatrix(); 
-				glm::mat3 normalMatrix = glm::mat3(MV_matrix); 
-				normalMatrix = glm::inverse(normalMatrix); 
-				normalMatrix = glm::transpose(normalMatrix);
-				glUniformMatrix3fv(prog_blinnPhong->getUniform("normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-				glUniform3f(prog_blinnPhong->getUniform("lightPos1"), light_one->posX, light_one->posY, light_one->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor1"), light_one->colX, light_one->colY, light_one->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightPos2"), light_two->posX, light_two->posY, light_two->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor2"), light_two->colX, light_two->colY, light_two->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("ka"), blue_material->kax, blue_material->kay, blue_material->kaz);
-				glUniform3f(prog_blinnPhong->getUniform("kd"), blue_material->kdx, blue_material->kdy, blue_material->kdz);
-				glUniform3f(prog_blinnPhong->getUniform("ks"), blue_material->ksx, blue_material->ksy, blue_material->ksz);
-				glUniform1f(prog_blinnPhong->getUniform("s"), blue_material->s);
-				bunny_shape->draw(prog_blinnPhong);
-				MV->popMatrix();
-				
-				MV->pushMatrix();
-				MV->translate(glm::vec3(0.5f, 0.0f, 0.0f)); 
-				glm::mat4 S(1.0f);
-				S[0][1] = 0.5f*cos(t);
-				MV->multMatrix(S);
-    			MV->rotate(static_cast<float>(M_PI), glm::vec3(0.0f, 1.0f, 0.0f)); 
-    			MV->scale(glm::vec3(0.5f));
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-				MV_matrix = MV->topMatrix(); 
-				normalMatrix = glm::mat3(MV_matrix); 
-				normalMatrix = glm::inverse(normalMatrix); 
-				normalMatrix = glm::transpose(normalMatrix);
-				glUniformMatrix3fv(prog_blinnPhong->getUniform("normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-				glUniform3f(prog_blinnPhong->getUniform("lightPos1"), light_one->posX, light_one->posY, light_one->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor1"), light_one->colX, light_one->colY, light_one->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightPos2"), light_two->posX, light_two->posY, light_two->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor2"), light_two->colX, light_two->colY, light_two->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("ka"), blue_material->kax, blue_material->kay, blue_material->kaz);
-				glUniform3f(prog_blinnPhong->getUniform("kd"), blue_material->kdx, blue_material->kdy, blue_material->kdz);
-				glUniform3f(prog_blinnPhong->getUniform("ks"), blue_material->ksx, blue_material->ksy, blue_material->ksz);
-				glUniform1f(prog_blinnPhong->getUniform("s"), blue_material->s);
-				teapot_shape->draw(prog_blinnPhong);
-				MV->popMatrix();
-
-				prog_blinnPhong->unbind();
-		} else if(currentMaterial == GRAY) {
-				prog_blinnPhong->bind();
-				MV->pushMatrix();
-				MV->translate(-0.5f, -0.5f, 0.0f);
-				MV->rotate(t, 0.0f, 1.0f, 0.0f);
-				MV->scale(0.5f);
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-				glm::mat4 MV_matrix = MV->topMatrix(); 
-				glm::mat3 normalMatrix = glm::mat3(MV_matrix); 
-				normalMatrix = glm::inverse(normalMatrix); 
-				normalMatrix = glm::transpose(normalMatrix);
-				glUniformMatrix3fv(prog_blinnPhong->getUniform("normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-				glUniform3f(prog_blinnPhong->getUniform("lightPos1"), light_one->posX, light_one->posY, light_one->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor1"), light_one->colX, light_one->colY, light_one->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightPos2"), light_two->posX, light_two->posY, light_two->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor2"), light_two->colX, light_two->colY, light_two->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("ka"), gray_material->kax, gray_material->kay, gray_material->kaz);
-				glUniform3f(prog_blinnPhong->getUniform("kd"), gray_material->kdx, gray_material->kdy, gray_material->kdz);
-				glUniform3f(prog_blinnPhong->getUniform("ks"), gray_material->ksx, gray_material->ksy, gray_material->ksz);
-				glUniform1f(prog_blinnPhong->getUniform("s"), gray_material->s);
-				bunny_shape->draw(prog_blinnPhong);
-				MV->popMatrix();
-
-				MV->pushMatrix();
-				MV->translate(glm::vec3(0.5f, 0.0f, 0.0f)); 
-				glm::mat4 S(1.0f);
-				S[0][1] = 0.5f*cos(t);
-				MV->multMatrix(S);
-    			MV->rotate(static_cast<float>(M_PI), glm::vec3(0.0f, 1.0f, 0.0f)); 
-    			MV->scale(glm::vec3(0.5f));
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-				glUniformMatrix4fv(prog_blinnPhong->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-				MV_matrix = MV->topMatrix(); 
-				normalMatrix = glm::mat3(MV_matrix); 
-				normalMatrix = glm::inverse(normalMatrix); 
-				normalMatrix = glm::transpose(normalMatrix);
-				glUniformMatrix3fv(prog_blinnPhong->getUniform("normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-				glUniform3f(prog_blinnPhong->getUniform("lightPos1"), light_one->posX, light_one->posY, light_one->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor1"), light_one->colX, light_one->colY, light_one->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightPos2"), light_two->posX, light_two->posY, light_two->posZ);
-				glUniform3f(prog_blinnPhong->getUniform("lightColor2"), light_two->colX, light_two->colY, light_two->colZ);
-				glUniform3f(prog_blinnPhong->getUniform("ka"), gray_material->kax, gray_material->kay, gray_material->kaz);
-				glUniform3f(prog_blinnPhong->getUniform("kd"), gray_material->kdx, gray_material->kdy, gray_material->kdz);
-				glUniform3f(prog_blinnPhong->getUniform("ks"), gray_material->ksx, gray_material->ksy, gray_material->ksz);
-				glUniform1f(prog_blinnPhong->getUniform("s"), gray_material->s);
-				teapot_shape->draw(prog_blinnPhong);
-				MV->popMatrix();
-
-				prog_blinnPhong->unbind();
-		}
-	} else if(currentShaderMode == SILHOUETTE) {
-		prog_silhouette->bind();
-		MV->pushMatrix();
-		MV->translate(-0.5f, -0.5f, 0.0f);
-		MV->rotate(t, 0.0f, 1.0f, 0.0f);
-		MV->scale(0.5f);
-		glUniformMatrix4fv(prog_silhouette->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-		glUniformMatrix4fv(prog_silhouette->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-		glUniformMatrix4fv(prog_silhouette->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-		glm::mat4 MV_matrix = MV->topMatrix(); 
-		glm::mat3 normalMatrix = glm::mat3(MV_matrix); 
-		normalMatrix = glm::inverse(normalMatrix); 
-		normalMatrix = glm::transpose(normalMatrix);
-		glUniformMatrix3fv(prog_silhouette->getUniform("N"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-		bunny_shape->draw(prog_silhouette);
-		MV->popMatrix();
-
-		MV->pushMatrix();
-		MV->translate(glm::vec3(0.5f, 0.0f, 0.0f)); 
-		glm::mat4 S(1.0f);
-		S[0][1] = 0.5f*cos(t);
-		MV->multMatrix(S);
-		MV->rotate(static_cast<float>(M_PI), glm::vec3(0.0f, 1.0f, 0.0f)); 
-		MV->scale(glm::vec3(0.5f));
-		glUniformMatrix4fv(prog_silhouette->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-		glUniformMatrix4fv(prog_silhouette->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-		glUniformMatrix4fv(prog_silhouette->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-		MV_matrix = MV->topMatrix(); 
-		normalMatrix = glm::mat3(MV_matrix); 
-		normalMatrix = glm::inverse(normalMatrix); 
-		normalMatrix = glm::transpose(normalMatrix);
-		glUniformMatrix3fv(prog_silhouette->getUniform("N"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-		teapot_shape->draw(prog_silhouette);
-		MV->popMatrix();
-
-		prog_silhouette->unbind();
-	} else if(currentShaderMode == CEL) {
-		if(currentMaterial == PINK) {
-			prog_cel->bind();
-			MV->pushMatrix();
-			MV->translate(-0.5f, -0.5f, 0.0f);
-			MV->rotate(t, 0.0f, 1.0f, 0.0f);
-			MV->scale(0.5f);
-			glUniformMatrix4fv(prog_cel->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-			glUniformMatrix4fv(prog_cel->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-			glm::mat4 MV_matrix = MV->topMatrix(); 
-			glm::mat3 normalMatrix = glm::mat3(MV_matrix); 
-			normalMatrix = glm::inverse(normalMatrix); 
-			normalMatrix = glm::transpose(normalMatrix);
-			glUniformMatrix3fv(prog_cel->getUniform("N"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-			glUniform3f(prog_cel->getUniform("lightPos"), light_one->posX, light_one->posY, light_one->posZ);
-			glUniform3f(prog_cel->getUniform("lightColor"), light_one->colX, light_one->colY, light_one->colZ);
-			glUniform3f(prog_cel->getUniform("ka"), pink_material->kax, pink_material->kay, pink_material->kaz);
-			glUniform3f(prog_cel->getUniform("kd"), pink_material->kdx, pink_material->kdy, pink_material->kdz);
-			glUniform3f(prog_cel->getUniform("ks"), pink_material->ksx, pink_material->ksy, pink_material->ksz);
-			glUniform1f(prog_cel->getUniform("s"), pink_material->s);
-			bunny_shape->draw(prog_cel);
-			MV->popMatrix();
-
-			MV->pushMatrix();
-			MV->translate(glm::vec3(0.5f, 0.0f, 0.0f)); 
-			glm::mat4 S(1.0f);
-			S[0][1] = 0.5f*cos(t);
-			MV->multMatrix(S);
-			MV->rotate(static_cast<float>(M_PI), glm::vec3(0.0f, 1.0f, 0.0f)); 
-			MV->scale(glm::vec3(0.5f));
-			glUniformMatrix4fv(prog_cel->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-			glUniformMatrix4fv(prog_cel->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-			MV_matrix = MV->topMatrix(); 
-			normalMatrix = glm::mat3(MV_matrix); 
-			normalMatrix = glm::inverse(normalMatrix); 
-			normalMatrix = glm::transpose(normalMatrix);
-			glUniformMatrix3fv(prog_cel->getUniform("N"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-			glUniform3f(prog_cel->getUniform("lightPos"), light_one->posX, light_one->posY, light_one->posZ);
-			glUniform3f(prog_cel->getUniform("lightColor"), light_one->colX, light_one->colY, light_one->colZ);
-			glUniform3f(prog_cel->getUniform("ka"), pink_material->kax, pink_material->kay, pink_material->kaz);
-			glUniform3f(prog_cel->getUniform("kd"), pink_material->kdx, pink_material->kdy, pink_material->kdz);
-			glUniform3f(prog_cel->getUniform("ks"), pink_material->ksx, pink_material->ksy, pink_material->ksz);
-			glUniform1f(prog_cel->getUniform("s"), pink_material->s);
-			teapot_shape->draw(prog_cel);
-			MV->popMatrix();
-			prog_cel->unbind();
-		} else if(currentMaterial == BLUE) {
-			prog_cel->bind();
-			MV->pushMatrix();
-			MV->translate(-0.5f, -0.5f, 0.0f);
-			MV->rotate(t, 0.0f, 1.0f, 0.0f);
-			MV->scale(0.5f);
-			glUniformMatrix4fv(prog_cel->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-			glUniformMatrix4fv(prog_cel->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-			glm::mat4 MV_matrix = MV->topMatrix(); 
-			glm::mat3 normalMatrix = glm::mat3(MV_matrix); 
-			normalMatrix = glm::inverse(normalMatrix); 
-			normalMatrix = glm::transpose(normalMatrix);
-			glUniformMatrix3fv(prog_cel->getUniform("N"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-			glUniform3f(prog_cel->getUniform("lightPos"), light_one->posX, light_one->posY, light_one->posZ);
-			glUniform3f(prog_cel->getUniform("lightColor"), light_one->colX, light_one->colY, light_one->colZ);
-			glUniform3f(prog_cel->getUniform("ka"), blue_material->kax, blue_material->kay, blue_material->kaz);
-			glUniform3f(prog_cel->getUniform("kd"), blue_material->kdx, blue_material->kdy, blue_material->kdz);
-			glUniform3f(prog_cel->getUniform("ks"), blue_material->ksx, blue_material->ksy, blue_material->ksz);
-			glUniform1f(prog_cel->getUniform("s"), blue_material->s);
-			bunny_shape->draw(prog_cel);
-			MV->popMatrix();
-
-			MV->pushMatrix();
-			MV->translate(glm::vec3(0.5f, 0.0f, 0.0f)); 
-			glm::mat4 S(1.0f);
-			S[0][1] = 0.5f*cos(t);
-			MV->multMatrix(S);
-			MV->rotate(static_cast<float>(M_PI), glm::vec3(0.0f, 1.0f, 0.0f)); 
-			MV->scale(glm::vec3(0.5f));
-			glUniformMatrix4fv(prog_cel->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-			glUniformMatrix4fv(prog_cel->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-			MV_matrix = MV->topMatrix(); 
-			normalMatrix = glm::mat3(MV_matrix); 
-			normalMatrix = glm::inverse(normalMatrix); 
-			normalMatrix = glm::transpose(normalMatrix);
-			glUniformMatrix3fv(prog_cel->getUniform("N"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-			glUniform3f(prog_cel->getUniform("lightPos"), light_one->posX, light_one->posY, light_one->posZ);
-			glUniform3f(prog_cel->getUniform("lightColor"), light_one->colX, light_one->colY, light_one->colZ);
-			glUniform3f(prog_cel->getUniform("ka"), blue_material->kax, blue_material->kay, blue_material->kaz);
-			glUniform3f(prog_cel->getUniform("kd"), blue_material->kdx, blue_material->kdy, blue_material->kdz);
-			glUniform3f(prog_cel->getUniform("ks"), blue_material->ksx, blue_material->ksy, blue_material->ksz);
-			glUniform1f(prog_cel->getUniform("s"), blue_material->s);
-			teapot_shape->draw(prog_cel);
-			MV->popMatrix();
-			prog_cel->unbind();
-		} else if(currentMaterial == GRAY) {
-			prog_cel->bind();
-			MV->pushMatrix();
-			MV->translate(-0.5f, -0.5f, 0.0f);
-			MV->rotate(t, 0.0f, 1.0f, 0.0f);
-			MV->scale(0.5f);
-			glUniformMatrix4fv(prog_cel->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-			glUniformMatrix4fv(prog_cel->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-			glm::mat4 MV_matrix = MV->topMatrix(); 
-			glm::mat3 normalMatrix = glm::mat3(MV_matrix); 
-			normalMatrix = glm::inverse(normalMatrix); 
-			normalMatrix = glm::transpose(normalMatrix);
-			glUniformMatrix3fv(prog_cel->getUniform("N"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-			glUniform3f(prog_cel->getUniform("lightPos"), light_one->posX, light_one->posY, light_one->posZ);
-			glUniform3f(prog_cel->getUniform("lightColor"), light_one->colX, light_one->colY, light_one->colZ);
-			glUniform3f(prog_cel->getUniform("ka"), gray_material->kax, gray_material->kay, gray_material->kaz);
-			glUniform3f(prog_cel->getUniform("kd"), gray_material->kdx, gray_material->kdy, gray_material->kdz);
-			glUniform3f(prog_cel->getUniform("ks"), gray_material->ksx, gray_material->ksy, gray_material->ksz);
-			glUniform1f(prog_cel->getUniform("s"), gray_material->s);
-			bunny_shape->draw(prog_cel);
-			MV->popMatrix();
-
-			MV->pushMatrix();
-			MV->translate(glm::vec3(0.5f, 0.0f, 0.0f)); 
-			glm::mat4 S(1.0f);
-			S[0][1] = 0.5f*cos(t);
-			MV->multMatrix(S);
-			MV->rotate(static_cast<float>(M_PI), glm::vec3(0.0f, 1.0f, 0.0f)); 
-			MV->scale(glm::vec3(0.5f));
-			glUniformMatrix4fv(prog_cel->getUniform("P"), 1, GL_FALSE, glm::value_ptr(P->topMatrix()));
-			glUniformMatrix4fv(prog_cel->getUniform("MV"), 1, GL_FALSE, glm::value_ptr(MV->topMatrix()));
-			MV_matrix = MV->topMatrix(); 
-			normalMatrix = glm::mat3(MV_matrix); 
-			normalMatrix = glm::inverse(normalMatrix); 
-			normalMatrix = glm::transpose(normalMatrix);
-			glUniformMatrix3fv(prog_cel->getUniform("N"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-			glUniform3f(prog_cel->getUniform("lightPos"), light_one->posX, light_one->posY, light_one->posZ);
-			glUniform3f(prog_cel->getUniform("lightColor"), light_one->colX, light_one->colY, light_one->colZ);
-			glUniform3f(prog_cel->getUniform("ka"), gray_material->kax, gray_material->kay, gray_material->kaz);
-			glUniform3f(prog_cel->getUniform("kd"), gray_material->kdx, gray_material->kdy, gray_material->kdz);
-			glUniform3f(prog_cel->getUniform("ks"), gray_material->ksx, gray_material->ksy, gray_material->ksz);
-			glUniform1f(prog_cel->getUniform("s"), gray_material->s);
-			teapot_shape->draw(prog_cel);
-			MV->popMatrix();
-			prog_cel->unbind();
-		} 
+	bool inArena = true;
+	for(const auto &shape : shapes) {
+		inArena = inArena && shape->isInArena();
+	}
+	if(keyToggles[(unsigned)'i']) {
+		drawCrowd(P, MV, t);
+	} else if(arena && GeometryArena::isMultiDrawSupported() && !keyToggles[(unsigned)'g'] && inArena) {
+		drawArena(P, MV, t);
+	} else {
+		drawShapes(P, MV, t);
 	}
 
 	MV->popMatrix();
 	P->popMatrix();
 	
 	GLSL::checkError(GET_FILE_LINE);
+	reportCullStats();
 	
 	if(OFFLINE) {
-		saveImage("output.png", window);
+		saveImage("output.png");
 		GLSL::checkError(GET_FILE_LINE);
+		// Stop after this frame, rather than once the main thread notices
+		render_stop = true;
 		glfwSetWindowShouldClose(window, true);
+		glfwPostEmptyEvent(); // wake the main thread
+	}
+}
+
+// Releases the scene's GL objects and deletes them while the context still
+// exists
+static void cleanup()
+{
+	// Programs that were first used after init()
+	saveProgramBinaries();
+	shapes.clear();
+	arena.reset();
+	mesh_programs.clear();
+	shaders.clear();
+	placeholder_shaders.reset();
+	GLHandle::shutdown();
+}
+
+// Fills the main thread's input state from what init() set up
+static void initInput()
+{
+	input.camera = *camera;
+	memcpy(input.keyToggles, keyToggles, sizeof(input.keyToggles));
+	input.mode = currentMode;
+	input.material = currentMaterial;
+	input.lights = scene->getLights();
+	glfwGetFramebufferSize(window, &input.width, &input.height);
+	memset(input.requests, 0, sizeof(input.requests));
+	memset(requests_done, 0, sizeof(requests_done));
+}
+
+// Hands a snapshot of the input state to the render thread, and starts the
+// stats of the next one
+static void publishInput()
+{
+	input_snapshots.getBack() = input;
+	input_snapshots.publish();
+	input.handled = 0;
+	input.coalesced = 0;
+	input.dropped = 0;
+	input.latency = 0.0;
+}
+
+// Takes the latest input snapshot into the render thread's state, and runs
+// the actions requested since the last one. Then lets the main thread drain
+// the events that arrived meanwhile.
+static void applyInput()
+{
+	if(!input_snapshots.update()) {
+		return;
+	}
+	const InputState &latest = input_snapshots.getFront();
+	*camera = latest.camera;
+	memcpy(keyToggles, latest.keyToggles, sizeof(keyToggles));
+	currentMode = latest.mode;
+	currentMaterial = latest.material;
+	scene->getLights() = latest.lights;
+	if(latest.width != viewport_width || max(latest.height, 1) != viewport_height) {
+		viewport_width = latest.width;
+		viewport_height = max(latest.height, 1);
+		glViewport(0, 0, viewport_width, viewport_height);
+	}
+	input_handled += latest.handled;
+	input_coalesced += latest.coalesced;
+	input_dropped += latest.dropped;
+	input_latency = max(input_latency, latest.latency);
+	input_taken = true;
+	glfwPostEmptyEvent();
+	
+	// Each action runs once, however many times it was requested since
+	bool pending[REQUEST_COUNT];
+	for(int r = 0; r < REQUEST_COUNT; ++r) {
+		pending[r] = requests_done[r] != latest.requests[r];
+		requests_done[r] = latest.requests[r];
+	}
+	if(pending[BENCHMARK_DRAWS]) {
+		benchmarkDraws();
+	}
+	if(pending[BENCHMARK_CULLING]) {
+		benchmarkCulling();
+	}
+	if(pending[BENCHMARK_RENDER]) {
+		benchmarkRender();
+	}
+	if(pending[BENCHMARK_PREPARE]) {
+		benchmarkPrepare();
+	}
+	if(pending[RELOAD_MESH]) {
+		reloadMesh();
+	}
+	if(arena && pending[COMPACT_ARENA]) {
+		arena->compact();
+	}
+	if(arena && (pending[PRINT_ARENA_STATS] || pending[COMPACT_ARENA])) {
+		printArenaStats();
 	}
 }
 
+// Runs on the render thread, which owns the GL context, until render_stop is
+// set. startTime is when the program started.
+static void renderLoop(chrono::steady_clock::time_point startTime)
+{
+	glfwMakeContextCurrent(window);
+	bool firstFrame = true;
+	while(!render_stop) {
+		applyInput();
+		// Render scene.
+		render();
+		// Swap front and back buffers. Waits for vsync on this thread only.
+		glfwSwapBuffers(window);
+		if(firstFrame) {
+			// Startup time, with and without programs from the binary cache
+			glFinish();
+			double elapsed = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+			cout << "time to first frame: " << 1e3*elapsed << " ms, " << 1e3*program_build_time << " ms building programs (";
+			cout << programs_cached << " of " << programs_started << " from the binary cache)" << endl;
+			firstFrame = false;
+		}
+		// Delete the GL objects released by frames the GPU has finished.
+		GLHandle::endFrame();
+		GLState::endFrame();
+	}
+	cleanup();
+	glfwMakeContextCurrent(NULL);
+}
+
 int main(int argc, char **argv)
 {
+	auto startTime = chrono::steady_clock::now();
 	if(argc < 2) {
-		cout << "Usage: A3 RESOURCE_DIR" << endl;
+		cout << "Usage: A3 RESOURCE_DIR [OFFLINE] [COMPRESSED] [SCENE_FILE]" << endl;
 		return 0;
 	}
 	RESOURCE_DIR = argv[1] + string("/");
@@ -783,6 +1264,16 @@ int main(int argc, char **argv)
 	if(argc >= 3) {
 		OFFLINE = atoi(argv[2]) != 0;
 	}
+	if(argc >= 4) {
+		COMPRESSED = atoi(argv[3]) != 0;
+	}
+	if(argc >= 5) {
+		SCENE_FILE = argv[4];
+	}
+	scene = make_shared<Scene>();
+	if(!scene->load(RESOURCE_DIR + SCENE_FILE)) {
+		return -1;
+	}
 
 	// Set error callback.
 	glfwSetErrorCallback(error_callback);
@@ -790,6 +1281,14 @@ int main(int argc, char **argv)
 	if(!glfwInit()) {
 		return -1;
 	}
+#ifdef __APPLE__
+	// The shaders need GL 3.1, and macOS only goes past 2.1 for a core,
+	// forward-compatible context
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#endif
 	// Create a windowed mode window and its OpenGL context.
 	window = glfwCreateWindow(640, 480, "Nitin Pendekanti", NULL, NULL);
 	if(!window) {
@@ -822,16 +1321,31 @@ int main(int argc, char **argv)
 	glfwSetFramebufferSizeCallback(window, resize_callback);
 	// Initialize scene.
 	init();
-	// Loop until the user closes the window.
+	initInput();
+	// Events that arrived during startup
+	glfwPollEvents();
+	drainInput();
+	publishInput();
+	// Hand the context to the render thread, and handle input here until the
+	// user closes the window. Events are queued as they arrive, and drained
+	// into a new snapshot once the render thread has taken the last one, so
+	// neither thread waits for the other.
+	glfwMakeContextCurrent(NULL);
+	thread renderThread(renderLoop, startTime);
+	bool drainDue = false;
 	while(!glfwWindowShouldClose(window)) {
-		// Render scene.
-		render();
-		// Swap front and back buffers.
-		glfwSwapBuffers(window);
-		// Poll for and process events.
-		glfwPollEvents();
+		glfwWaitEvents();
+		if(input_taken.exchange(false)) {
+			drainDue = true;
+		}
+		if(drainDue && drainInput() > 0) {
+			publishInput();
+			drainDue = false;
+		}
 	}
 	// Quit program.
+	render_stop = true;
+	renderThread.join();
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	return 0;